@@ -3,7 +3,9 @@
 //
 
 #include <sstream>
+#include <map>
 #include <boost/make_shared.hpp>
+#include <boost/foreach.hpp>
 #include "Client.hpp"
 #include "../common/network/Utils.hpp"
 #include "../common/network/Command.hpp"
@@ -12,6 +14,16 @@
 
 namespace network {
 
+namespace {
+    // 再接続用のチケット 接続先ごとに、プロセスが終わるまで覚えておく
+    struct ResumptionTicket {
+        std::string ticket;
+        std::string secret;
+    };
+    std::map<std::string, ResumptionTicket> resumption_tickets;
+    boost::mutex resumption_tickets_mutex;
+}
+
 Client::Client(const std::string& host,
         uint16_t remote_tcp_port,
         uint16_t local_udp_port,
@@ -91,26 +103,37 @@ Client::Client(const std::string& host,
         Logger::Error(_T("Incorrect local key pair"));
     }
 
+    // 要求を待たずに、接続に必要な情報と前回のチケットをまとめて送る
+    const std::string ticket_key = host + ":" + port_str.str();
+    ResumptionTicket resumption;
+    {
+        boost::mutex::scoped_lock lock(resumption_tickets_mutex);
+        auto it = resumption_tickets.find(ticket_key);
+        if (it != resumption_tickets.end()) {
+            resumption = it->second;
+        }
+    }
+    const std::string client_random = Encrypter::GetRandomBytes(ENCRYPTER_RANDOM_SIZE);
+
+    session_->QueueGreeting(network::ServerReceiveClientHello(
+                    network::Encrypter::GetHash(public_key),
+                    (uint16_t)MMO_PROTOCOL_VERSION,
+                    session_->udp_port(),
+                    public_key,
+                    resumption.ticket,
+                    client_random));
+    session_->QueueGreeting(network::ServerRequestedFullServerInfo());
+
     session_->set_on_receive(std::make_shared<CallbackFunc>(
-            [this, public_key](network::Command c) {
+            [this, public_key, ticket_key, resumption, client_random](network::Command c) {
 
                 switch (c.header()) {
 
                     // クライアント情報要求
+                    // 接続時に ServerReceiveClientHello で送っているので応じない
                     case network::header::ClientRequestedClientInfo:
                     {
-                        if (auto session = c.session().lock()) {
-                            Logger::Info(_T("Receive local public key fingerprint request"));
-                            Logger::Info(_T("Send local public key fingerprint..."));
-
-                            session->Send(network::ServerReceiveClientInfo(
-                                            network::Encrypter::GetHash(public_key),
-                                            (uint16_t)MMO_PROTOCOL_VERSION,
-                                            session->udp_port()
-                                    ));
-							
-							session->Send(network::ServerRequestedFullServerInfo());
-                        }
+                        Logger::Info(_T("Receive local public key fingerprint request"));
                     }
                     break;
 
@@ -153,19 +176,83 @@ Client::Client(const std::string& host,
                             }
                             */
 
+                            // サーバーは続けて ClientStartEncryptedSession を送ってくる
                             session->encrypter().SetCryptedCommonKey(key);
-                            session->Send(ServerStartEncryptedSession());
 
                         }
                     }
                     break;
 
+                    // チケットで再開 公開鍵暗号を使わずに新しい共通鍵を作る
+                    case header::ClientReceiveSessionResumed:
+                    {
+                        if (auto session = c.session().lock()) {
+                            Logger::Info(_T("Resume session"));
+
+                            uint32_t user_id;
+                            std::string server_random;
+                            Utils::Deserialize(c.body(), &user_id, &server_random);
+
+                            session->set_id(user_id);
+                            session->encrypter().Resume(resumption.secret, client_random, server_random);
+                        }
+                    }
+                    break;
+
+                    // 次回の接続用のチケット
+                    case header::ClientReceiveSessionTicket:
+                    {
+                        if (auto session = c.session().lock()) {
+                            ResumptionTicket ticket;
+                            Utils::Deserialize(c.body(), &ticket.ticket);
+                            ticket.secret = session->encrypter().GetResumptionSecret();
+
+                            boost::mutex::scoped_lock lock(resumption_tickets_mutex);
+                            resumption_tickets[ticket_key] = ticket;
+                        }
+                    }
+                    break;
+
                     // 暗号化通信開始
                     case network::header::ClientStartEncryptedSession:
                     {
                         if (auto session = c.session().lock()) {
                             Logger::Info(_T("Start encrypted session"));
                             session->EnableEncryption();
+                            session_->EnableUDPTestPacketAck();
+
+                            // 共通鍵を受け取れたことを示す サーバーはこれを確かめてからログインさせる
+                            session->Send(network::ServerReceiveKeyConfirmation(
+                                            session->encrypter().GetKeyConfirmation()));
+
+                            session->Send(network::ServerReceiveCapabilities(
+                                            network::capability::STREAM_COMPRESSION |
+                                            network::capability::LENGTH_PREFIXED_FRAMING |
+                                            network::capability::ACCOUNT_SNAPSHOT |
+                                            network::capability::ACCOUNT_PUSH |
+                                            network::capability::AUTHENTICATED_ENCRYPTION));
+                        }
+                    }
+                    break;
+
+                    // サーバーが有効にした機能
+                    case network::header::ClientReceiveCapabilities:
+                    {
+                        if (auto session = c.session().lock()) {
+                            uint32_t capabilities;
+                            network::Utils::Deserialize(c.body(), &capabilities);
+                            if (capabilities & network::capability::STREAM_COMPRESSION) {
+                                session->EnableStreamCompression();
+                                Logger::Info(_T("Enable stream compression"));
+                            }
+                            if (capabilities & network::capability::LENGTH_PREFIXED_FRAMING) {
+                                session->EnableLengthPrefixedFraming();
+                                Logger::Info(_T("Enable length prefixed framing"));
+                            }
+                            if (capabilities & network::capability::AUTHENTICATED_ENCRYPTION) {
+                                session->EnableAuthenticatedEncryption();
+                                Logger::Info(_T("Enable authenticated encryption"));
+                            }
                         }
                     }
                     break;
@@ -180,6 +267,59 @@ Client::Client(const std::string& host,
                     }
                     break;
 
+                    // 位置情報のUDP送受信を開始
+                    case network::header::ClientEnableUDPPosition:
+                    {
+                        if (auto session = c.session().lock()) {
+                            uint32_t token;
+                            network::Utils::Deserialize(c.body(), &token);
+                            session->set_udp_token(token);
+                            session->set_udp_enabled(true);
+                            Logger::Info(_T("Enable UDP position"));
+                        }
+                    }
+                    break;
+
+                    // 表示範囲の出入り サーバーと同じ順序で差分の基準を捨てる
+                    case network::header::ClientReceivePlayerEnterArea:
+                    case network::header::ClientReceivePlayerLeaveArea:
+                    {
+                        if (auto session = c.session().lock()) {
+                            uint32_t user_id;
+                            network::Utils::Deserialize(c.body(), &user_id);
+                            session->position_codec().Reset(user_id);
+                        }
+                    }
+                    break;
+
+                    // 位置情報の差分 取りこぼさないよう受信時に復号する
+                    case network::header::ClientUpdatePlayerPositionDelta:
+                    {
+                        if (auto session = c.session().lock()) {
+                            const std::string& body = c.body();
+                            std::string snapshot;
+                            size_t offset = 0;
+                            while (offset + sizeof(uint32_t) < body.size()) {
+                                uint32_t user_id;
+                                network::Utils::Deserialize(body.substr(offset, sizeof(user_id)), &user_id);
+                                offset += sizeof(user_id);
+
+                                PlayerPosition pos;
+                                size_t read = session->position_codec().Decode(user_id,
+                                        body.data() + offset, body.size() - offset, &pos);
+                                if (read == 0) {
+                                    Logger::Error(_T("Invalid position delta"));
+                                    break;
+                                }
+                                offset += read;
+
+                                snapshot += network::Utils::Serialize(user_id, pos.x, pos.y, pos.z, pos.theta, pos.vy);
+                            }
+                            c = Command(header::ClientUpdatePlayerPositionSnapshot, snapshot, session);
+                        }
+                    }
+                    break;
+
                     // 接続拒否
                     case network::header::ClientReceiveServerCrowdedError:
                     {
@@ -228,7 +368,12 @@ void Client::Write(const Command& msg)
         // 送信制限を超えていないかチェック
          // if (GetWriteByteAverage() <= write_average_limit_) {
         if (true) {
-            session_->Send(msg);
+            // 位置情報はUDPが使える場合はUDPで送る
+            if (msg.header() == header::ServerUpdatePlayerPosition && session_->udp_enabled()) {
+                session_->SendUDPPosition(msg.body());
+            } else {
+                session_->Send(msg);
+            }
          } else {
              Logger::Error(_T("Write limit exceeded"));
              Logger::Info(_T("Command ignored"));
@@ -322,6 +467,11 @@ void Client::ClientSession::Start()
 
 }
 
+void Client::ClientSession::QueueGreeting(const Command& command)
+{
+    greeting_.push_back(command);
+}
+
 void Client::ClientSession::Close()
 {
     Session::Close();
@@ -345,8 +495,13 @@ void Client::ClientSession::Connect(const boost::system::error_code& error)
 		socket_tcp_.set_option(option);
 
         boost::asio::async_read_until(socket_tcp_, receive_buf_, NETWORK_UTILS_DELIMITOR,
-                boost::bind(&ClientSession::ReceiveTCP, shared_from_this(),
-                        boost::asio::placeholders::error));
+                strand_.wrap(boost::bind(&ClientSession::ReceiveTCP, shared_from_this(),
+                        boost::asio::placeholders::error)));
+
+        BOOST_FOREACH(const Command& command, greeting_) {
+            Send(command);
+        }
+        greeting_.clear();
 
         if (on_receive_) {
             // (*on_receive_)(ConnectionSucceeded());
@@ -364,10 +519,25 @@ void Client::ClientSession::SendUDP(const std::string& message)
     io_service_.post(boost::bind(&Client::ClientSession::DoWriteUDP, this, holder, *iterator_udp_));
 }
 
+void Client::ClientSession::SendUDPPosition(const std::string& body)
+{
+    SendUDP(Utils::Serialize(static_cast<uint8_t>(header::ServerUpdatePlayerPositionSequenced),
+        udp_token(), NextUDPSequence()) + body);
+}
+
+void Client::ClientSession::EnableUDPTestPacketAck()
+{
+    udp_test_packet_ack_ready_ = true;
+    if (udp_test_packet_received_) {
+        SendUDP(Utils::Serialize(static_cast<uint8_t>(header::ServerReceiveUDPTestPacketAck)));
+    }
+}
+
 void Client::ClientSession::ReceiveUDP(const boost::system::error_code& error, size_t bytes_recvd)
 {
     if (bytes_recvd > 0) {
         Logger::Debug(_T("UDP Receive %d"), bytes_recvd);
+        FetchUDP(std::string(receive_buf_udp_, bytes_recvd));
     }
     if (!error) {
       socket_udp_.async_receive_from(
@@ -393,5 +563,50 @@ void Client::ClientSession::WriteUDP(const boost::system::error_code& error)
 
 }
 
+void Client::ClientSession::FetchUDP(const std::string& buffer)
+{
+    // サーバー以外からのパケットは無視
+    if (sender_endpoint_ != *iterator_udp_) {
+        return;
+    }
+
+    // テストパケットが届いたことをサーバーに返す
+    if (buffer == UDP_TEST_PACKET) {
+        udp_test_packet_received_ = true;
+        if (udp_test_packet_ack_ready_) {
+            SendUDP(Utils::Serialize(static_cast<uint8_t>(header::ServerReceiveUDPTestPacketAck)));
+        }
+        return;
+    }
+
+    uint8_t command_header;
+    uint16_t sequence;
+    if (buffer.size() < sizeof(command_header) + sizeof(sequence)) {
+        return;
+    }
+    Utils::Deserialize(buffer, &command_header, &sequence);
+
+    if (command_header != header::ClientUpdatePlayerPositionSequenced) {
+        return;
+    }
+
+    // 順番が入れ替わって届いた場合は、そのプレイヤーのより新しい位置を受け取っていたものだけを捨てる
+    // 他のプレイヤーの位置は、動くまで再送されないので捨てない
+    const size_t entry_size = sizeof(uint32_t) + 3 * sizeof(int16_t) + 2 * sizeof(uint8_t);
+    std::string snapshot;
+    for (size_t offset = sizeof(command_header) + sizeof(sequence);
+            offset + entry_size <= buffer.size(); offset += entry_size) {
+        uint32_t player_id;
+        Utils::Deserialize(buffer.substr(offset, sizeof(player_id)), &player_id);
+        if (AcceptUDPSequence(sequence, player_id)) {
+            snapshot.append(buffer, offset, entry_size);
+        }
+    }
+
+    if (!snapshot.empty() && on_receive_) {
+        (*on_receive_)(Command(header::ClientUpdatePlayerPositionSnapshot, snapshot));
+    }
+}
+
 }
 
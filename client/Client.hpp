@@ -6,6 +6,7 @@
 
 #include <string>
 #include <queue>
+#include <vector>
 #include "../common/network/Session.hpp"
 #include "../common/network/Signature.hpp"
 
@@ -25,7 +26,9 @@ namespace network {
                                 io_service_(io_service),
                                 endpoint_iterator_(endpoint_iterator),
                                 socket_udp_(io_service, udp::endpoint(udp::v4(), udp_port)),
-                                iterator_udp_(iterator_udp)
+                                iterator_udp_(iterator_udp),
+                                udp_test_packet_received_(false),
+                                udp_test_packet_ack_ready_(false)
                 {
                 }
                 ;
@@ -35,10 +38,18 @@ namespace network {
                     void Close();
                     void Connect(const boost::system::error_code& error);
                     void SendUDP(const std::string& data);
+                    void SendUDPPosition(const std::string& body);
+
+                    // 暗号化通信の開始後にテストパケットの受信を通知する
+                    void EnableUDPTestPacketAck();
+
+                    // 接続した直後に送るコマンド
+                    void QueueGreeting(const Command& command);
 
                     void ReceiveUDP(const boost::system::error_code& error, size_t bytes_recvd);
                     void DoWriteUDP(std::shared_ptr<std::string> data, const udp::endpoint& endpoint);
                     void WriteUDP(const boost::system::error_code& error);
+                    void FetchUDP(const std::string& buffer);
 
                 private:
                     boost::asio::io_service& io_service_;
@@ -49,6 +60,11 @@ namespace network {
                     udp::endpoint sender_endpoint_;
 
                     char receive_buf_udp_[UDP_MAX_RECEIVE_LENGTH];
+
+                    bool udp_test_packet_received_;
+                    bool udp_test_packet_ack_ready_;
+
+                    std::vector<Command> greeting_;
             };
 
             typedef boost::shared_ptr<ClientSession> ClientSessionPtr;
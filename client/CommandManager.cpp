@@ -14,7 +14,9 @@
 
 CommandManager::CommandManager(const ManagerAccessorPtr& manager_accessor) :
 	manager_accessor_(manager_accessor),
-	status_(STATUS_STANDBY)
+	status_(STATUS_STANDBY),
+	account_instance_id_(0),
+	account_sequence_(0)
 {
 }
 
@@ -28,7 +30,8 @@ void CommandManager::Update()
 
 		// 移動コマンドが溜まっている場合は強制的に消費
 		if (client_->GetCommandSize() > 40) {
-			while (command && command->header() == network::header::ClientUpdatePlayerPosition) {
+			while (command && (command->header() == network::header::ClientUpdatePlayerPosition ||
+					command->header() == network::header::ClientUpdatePlayerPositionSnapshot)) {
 				command = client_->PopCommand();
 			}
 		}
@@ -54,6 +57,13 @@ void CommandManager::FetchCommand(const network::Command& command)
 	// 暗号化通信を開始
 	case ClientStartEncryptedSession:
 	{
+		// 同じホストへの再接続の場合は切断中の変更だけを受け取る
+		// サーバーが再起動していれば instance_id が変わり、全員分が返る
+		// 初期化情報より先に送ると、サーバーはスナップショットを省く
+		if (account_sequence_ > 0 && account_host_ == account_manager->host()) {
+			client_->Write(network::ServerRequestedAccountChanges(account_instance_id_, account_sequence_));
+		}
+
 		const std::string& data = account_manager->GetSerializedData();
 		if (data.size() > 0) {
 			client_->Write(network::ServerReceiveAccountInitializeData(data));
@@ -185,6 +195,54 @@ void CommandManager::FetchCommand(const network::Command& command)
 	}
 		break;
 
+	// プレイヤー位置の一括更新
+	case ClientUpdatePlayerPositionSnapshot:
+	{
+		if (player_manager) {
+			network::BinaryReader reader(command.body());
+			while (reader.remaining() > 0) {
+				PlayerPosition pos;
+				uint32_t user_id;
+				if (!reader.Read(&user_id, &pos.x, &pos.y, &pos.z, &pos.theta, &pos.vy)) {
+					break;
+				}
+
+				player_manager->UpdatePlayerPosition(user_id, pos);
+			}
+		}
+	}
+		break;
+
+	// プレイヤーが表示範囲に入った
+	case ClientReceivePlayerEnterArea:
+	{
+		if (player_manager) {
+			PlayerPosition pos;
+			uint32_t user_id;
+			network::Utils::Deserialize(command.body(), &user_id, &pos.x, &pos.y, &pos.z, &pos.theta, &pos.vy);
+
+			if (auto player = player_manager->GetFromId(user_id)) {
+				player->set_in_area(true);
+			}
+			player_manager->UpdatePlayerPosition(user_id, pos);
+		}
+	}
+		break;
+
+	// プレイヤーが表示範囲から出た
+	case ClientReceivePlayerLeaveArea:
+	{
+		if (player_manager) {
+			uint32_t user_id;
+			network::Utils::Deserialize(command.body(), &user_id);
+
+			if (auto player = player_manager->GetFromId(user_id)) {
+				player->set_in_area(false);
+			}
+		}
+	}
+		break;
+
 	case ClientReceiveAccountRevisionUpdateNotify:
 	{
 		if (player_manager) {
@@ -212,6 +270,72 @@ void CommandManager::FetchCommand(const network::Command& command)
 	}
 		break;
 
+	// 他のプレイヤーの情報の差分
+	case ClientReceiveAccountRevisionPush:
+	{
+		if (player_manager) {
+			network::BinaryReader reader(command.body());
+			uint32_t base_revision, user_id, server_revision;
+			if (!reader.Read(&base_revision)) {
+				break;
+			}
+			const char* patch = reader.current();
+			const size_t patch_size = reader.remaining();
+			if (!reader.Read(&user_id, &server_revision)) {
+				break;
+			}
+
+			auto current_revision = player_manager->GetCurrentUserRevision(user_id);
+			if (server_revision <= current_revision) {
+				break;
+			}
+
+			if (current_revision >= base_revision) {
+				player_manager->ApplyRevisionPatch(std::string(patch, patch_size));
+			} else {
+				// 途中の更新を受け取っていないので、前回からの変更をまとめて取り直す
+				Logger::Info(_T("Account revision gap %d [%d < %d]"), user_id, current_revision, base_revision);
+				client_->Write(network::ServerRequestedAccountChanges(account_instance_id_, account_sequence_));
+			}
+		}
+	}
+		break;
+
+	// 通し番号より後のアカウントの変更
+	case ClientReceiveAccountChanges:
+	{
+		if (player_manager) {
+			network::BinaryReader reader(command.body());
+			uint32_t instance_id, sequence;
+			uint8_t full;
+			if (!reader.Read(&instance_id, &sequence, &full)) {
+				break;
+			}
+
+			Logger::Info(_T("Receive account changes %d -> %d%s"), account_sequence_, sequence,
+				full ? _T(" (full)") : _T(""));
+
+			network::ByteView patch;
+			while (reader.remaining() > 0 && reader.Read(&patch)) {
+				player_manager->ApplyRevisionPatch(patch.str());
+			}
+			account_instance_id_ = instance_id;
+			account_sequence_ = sequence;
+			account_host_ = account_manager->host();
+		}
+	}
+		break;
+
+	// チャンネル内の全員の情報
+	case ClientReceiveAccountSnapshot:
+	{
+		if (player_manager) {
+			Logger::Info(_T("Receive account snapshot %d byte"), command.body().size());
+			player_manager->ApplyAccountSnapshot(command.body());
+		}
+	}
+		break;
+
 	case FatalConnectionError:
 	case UserFatalConnectionError:
 	{
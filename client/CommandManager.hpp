@@ -67,6 +67,11 @@ class CommandManager {
 		Status status_;
 
 		std::map<unsigned char, ChannelPtr> channels_;
+
+		// 最後に受け取ったアカウントの変更の通し番号と、それを数えたサーバー
+		uint32_t account_instance_id_;
+		uint32_t account_sequence_;
+		std::string account_host_;
 };
 
 typedef std::shared_ptr<CommandManager> CommandManagerPtr;
@@ -34,6 +34,7 @@ name_(""),
 model_name_(""),
 login_(false),
 channel_(0),
+in_area_(true),
 revision_(0)
 {
     name_tip_image_handle_ = ResourceManager::LoadCachedDivGraph<4>(
@@ -587,6 +588,16 @@ void Player::set_channel(unsigned char channel)
 	channel_ = channel;
 }
 
+bool Player::in_area() const
+{
+	return in_area_;
+}
+
+void Player::set_in_area(bool in_area)
+{
+	in_area_ = in_area;
+}
+
 uint32_t Player::revision() const
 {
     return revision_;
@@ -72,6 +72,10 @@ class Player : public std::enable_shared_from_this<Player> {
 		unsigned char channel() const;
 		void set_channel(unsigned char channel);
 
+		// サーバーから位置情報が届く範囲にいるか
+		bool in_area() const;
+		void set_in_area(bool in_area);
+
         uint32_t revision() const;
         void set_revision(uint32_t revision);
         const PlayerPosition& position() const;
@@ -99,6 +103,7 @@ class Player : public std::enable_shared_from_this<Player> {
         std::string model_name_, current_model_name_;
         bool login_;
 		unsigned char channel_;
+		bool in_area_;
         unsigned int revision_;
         PlayerPosition pos_;
 
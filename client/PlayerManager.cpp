@@ -173,7 +173,7 @@ void PlayerManager::Update()
 		const auto& current_model = player->current_model_name();
 		auto model = player->model_name();
 
-		if (player->channel() != GetMyself()->channel()) {
+		if (player->channel() != GetMyself()->channel() || !player->in_area()) {
 			model = "";
 		}
 
@@ -215,7 +215,7 @@ void PlayerManager::Draw()
 
     // TODO: モデルの高さを取得する必要あり
     BOOST_FOREACH(auto pair, login_players_) {
-        if (pair.second-> channel() == channel && pair.second->login()) {
+        if (pair.second-> channel() == channel && pair.second->login() && pair.second->in_area()) {
             if (char_data_providers_.find(pair.second->id()) != char_data_providers_.end()) {
                 const VECTOR& pos = char_data_providers_[pair.second->id()]->position();
                 const float theta = char_data_providers_[pair.second->id()]->theta();
@@ -275,12 +275,15 @@ void PlayerManager::ApplyRevisionPatch(const std::string& patch)
 {
 	MMO_PROFILE_FUNCTION;
 
-    std::string buffer(patch);
-    Logger::Debug(_T("%s"), unicode::ToTString(network::Utils::ToHexString(buffer)));
+    Logger::Debug(_T("%s"), unicode::ToTString(network::Utils::ToHexString(patch)));
+
+    network::BinaryReader reader(patch);
 
     uint32_t user_id;
     uint32_t new_revision;
-    buffer.erase(0, network::Utils::Deserialize(buffer, &user_id, &new_revision));
+    if (!reader.Read(&user_id, &new_revision)) {
+        return;
+    }
 
 	auto command_manager = manager_accessor_->command_manager().lock();
 
@@ -301,9 +304,11 @@ void PlayerManager::ApplyRevisionPatch(const std::string& patch)
     assert(player);
     player->set_revision(new_revision);
 
-    while (buffer.size()) {
+    while (reader.remaining() > 0) {
         uint16_t property_int;
-        buffer.erase(0, network::Utils::Deserialize(buffer, &property_int));
+        if (!reader.Read(&property_int)) {
+            break;
+        }
 
         AccountProperty property = static_cast<AccountProperty>(property_int);
         Logger::Debug(_T("UpdatePlayer : %d %d"), user_id, property);
@@ -313,7 +318,7 @@ void PlayerManager::ApplyRevisionPatch(const std::string& patch)
             case LOGIN:
             {
                 char value;
-                buffer.erase(0, network::Utils::Deserialize(buffer, &value));
+                reader.Read(&value);
                 bool login = value;
 
 				auto card_manager = manager_accessor_->card_manager().lock();
@@ -335,7 +340,7 @@ void PlayerManager::ApplyRevisionPatch(const std::string& patch)
             case CHANNEL:
             {
                 unsigned char channel;
-                buffer.erase(0, network::Utils::Deserialize(buffer, &channel));
+                reader.Read(&channel);
                 player->set_channel(channel);
                 Logger::Debug(_T("UpdateChannel %d : %d"), user_id, channel);
             }
@@ -346,7 +351,7 @@ void PlayerManager::ApplyRevisionPatch(const std::string& patch)
                 auto initialize = player->name().empty();
 
                 std::string value;
-                buffer.erase(0, network::Utils::Deserialize(buffer, &value));
+                reader.Read(&value);
                 player->set_name(value);
 
                 // 名前を受信した時にログインを通知
@@ -361,7 +366,7 @@ void PlayerManager::ApplyRevisionPatch(const std::string& patch)
             case TRIP:
             {
                 std::string value;
-                buffer.erase(0, network::Utils::Deserialize(buffer, &value));
+                reader.Read(&value);
                 player->set_trip(value);
             }
                 Logger::Debug(_T("UpdateTrip %d"), user_id);
@@ -370,7 +375,7 @@ void PlayerManager::ApplyRevisionPatch(const std::string& patch)
             case MODEL_NAME:
             {
                 std::string value;
-                buffer.erase(0, network::Utils::Deserialize(buffer, &value));
+                reader.Read(&value);
 
                 if (player->model_name() != value) {
                     //auto command_manager = manager_accessor_->command_manager().lock();
@@ -388,7 +393,7 @@ void PlayerManager::ApplyRevisionPatch(const std::string& patch)
             case IP_ADDRESS:
             {
                 std::string value;
-                buffer.erase(0, network::Utils::Deserialize(buffer, &value));
+                reader.Read(&value);
                 player->set_ip_address(value);
             }
                 Logger::Debug(_T("UpdateIPAddress %d"), user_id);
@@ -397,7 +402,7 @@ void PlayerManager::ApplyRevisionPatch(const std::string& patch)
             case UDP_PORT:
             {
                 uint16_t port;
-                buffer.erase(0, network::Utils::Deserialize(buffer, &port));
+                reader.Read(&port);
                 player->set_udp_port(port);
             }
                 Logger::Debug(_T("UpdateUDPPort %d"), user_id);
@@ -419,6 +424,31 @@ void PlayerManager::ApplyRevisionPatch(const std::string& patch)
 
 }
 
+void PlayerManager::ApplyAccountSnapshot(const std::string& snapshot)
+{
+	MMO_PROFILE_FUNCTION;
+
+    network::BinaryReader reader(snapshot);
+    while (reader.remaining() > 0) {
+        network::ByteView patch;
+        PlayerPosition pos;
+        if (!reader.Read(&patch) ||
+                !reader.Read(&pos.x, &pos.y, &pos.z, &pos.theta, &pos.vy)) {
+            break;
+        }
+
+        ApplyRevisionPatch(patch.str());
+
+        uint32_t user_id;
+        if (network::BinaryReader(patch).Read(&user_id)) {
+            if (auto player = GetFromId(user_id)) {
+                player->set_position(pos);
+            }
+            UpdatePlayerPosition(user_id, pos);
+        }
+    }
+}
+
 PlayerPtr PlayerManager::GetMyself()
 {
     if (auto command_manager = manager_accessor_->command_manager().lock()) {
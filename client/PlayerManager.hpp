@@ -37,6 +37,9 @@ class PlayerManager : public std::enable_shared_from_this<PlayerManager> {
         uint32_t GetCurrentUserRevision(uint32_t user_id);
         void ApplyRevisionPatch(const std::string& patch);
 
+        // ClientReceiveAccountSnapshot: パッチと位置の組を順に適用する
+        void ApplyAccountSnapshot(const std::string& snapshot);
+
         PlayerPtr GetFromId(unsigned int user_id);
         PlayerPtr GetMyself();
         std::vector<PlayerPtr> GetAll();
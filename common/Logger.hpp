@@ -8,13 +8,16 @@
 #include <boost/algorithm/string.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/thread/mutex.hpp>
 
 #ifdef _WIN32
-#define WriteDebugString(str) OutputDebugString(str.c_str()), \
+#define WriteDebugString(str) boost::mutex::scoped_lock lock(mutex_); \
+			OutputDebugString(str.c_str()), \
 			std::wcout << unicode::ToWString(str) << std::flush, \
 			ofs_ << unicode::ToString(str) << std::flush
 #else
-#define WriteDebugString(str) std::cout << unicode::ToString(out) << std::flush; \
+#define WriteDebugString(str) boost::mutex::scoped_lock lock(mutex_); \
+			std::cout << unicode::ToString(out) << std::flush; \
 			ofs_ << unicode::ToString(out) << std::flush;
 #endif
 
@@ -178,4 +181,5 @@ class Logger {
         }
 
 	std::ofstream ofs_;
+	boost::mutex mutex_;
 };
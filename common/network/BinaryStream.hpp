@@ -0,0 +1,227 @@
+//
+// BinaryStream.hpp
+//
+
+#pragma once
+
+#include <string>
+#include <cstring>
+#include <algorithm>
+#include <stdint.h>
+
+namespace network {
+    namespace Utils {
+        inline bool little_endian_check(int i)
+        {
+            return static_cast<bool>(*reinterpret_cast<char*>(&i));
+        }
+
+        inline bool little_endian()
+        {
+            return little_endian_check(1);
+        }
+    }
+
+    // 受信したバッファの一部をコピーせずに指す
+    // 元のバッファより長く保持しないこと
+    struct ByteView {
+        ByteView() : data(nullptr), size(0) {}
+        ByteView(const char* data_, size_t size_) : data(data_), size(size_) {}
+
+        std::string str() const { return std::string(data, size); }
+        bool empty() const { return size == 0; }
+
+        const char* data;
+        size_t size;
+    };
+
+    // 1つのバッファの末尾に直接書き込む
+    // 値はビッグエンディアン、文字列は int の長さを前置する (Utils::Serialize と同じ形式)
+    class BinaryWriter {
+        public:
+            explicit BinaryWriter(std::string* buffer) : buffer_(buffer) {}
+
+            void Reserve(size_t size)
+            {
+                buffer_->reserve(buffer_->size() + size);
+            }
+
+            template<class T>
+            BinaryWriter& Write(const T& value)
+            {
+                const char* bytes = reinterpret_cast<const char*>(&value);
+                if (Utils::little_endian()) {
+                    const size_t offset = buffer_->size();
+                    buffer_->resize(offset + sizeof(T));
+                    std::reverse_copy(bytes, bytes + sizeof(T), &(*buffer_)[offset]);
+                } else {
+                    buffer_->append(bytes, sizeof(T));
+                }
+                return *this;
+            }
+
+            BinaryWriter& Write(const std::string& value)
+            {
+                Write(static_cast<int>(value.size()));
+                buffer_->append(value);
+                return *this;
+            }
+
+            template<class T1, class T2>
+            BinaryWriter& Write(const T1& t1, const T2& t2)
+            {
+                return Write(t1).Write(t2);
+            }
+
+            template<class T1, class T2, class T3>
+            BinaryWriter& Write(const T1& t1, const T2& t2, const T3& t3)
+            {
+                return Write(t1).Write(t2).Write(t3);
+            }
+
+            template<class T1, class T2, class T3, class T4>
+            BinaryWriter& Write(const T1& t1, const T2& t2, const T3& t3, const T4& t4)
+            {
+                return Write(t1).Write(t2).Write(t3).Write(t4);
+            }
+
+            template<class T1, class T2, class T3, class T4, class T5>
+            BinaryWriter& Write(const T1& t1, const T2& t2, const T3& t3, const T4& t4, const T5& t5)
+            {
+                return Write(t1).Write(t2).Write(t3).Write(t4).Write(t5);
+            }
+
+            template<class T1, class T2, class T3, class T4, class T5, class T6>
+            BinaryWriter& Write(const T1& t1, const T2& t2, const T3& t3, const T4& t4, const T5& t5, const T6& t6)
+            {
+                return Write(t1).Write(t2).Write(t3).Write(t4).Write(t5).Write(t6);
+            }
+
+            // 長さを付けずにそのまま書き込む
+            BinaryWriter& WriteBytes(const char* data, size_t size)
+            {
+                buffer_->append(data, size);
+                return *this;
+            }
+
+        private:
+            std::string* buffer_;
+    };
+
+    // バッファをコピーせずに先頭から順に読む
+    // 足りない場合は失敗し、以降の読み込みも全て失敗する
+    class BinaryReader {
+        public:
+            BinaryReader(const char* data, size_t size) :
+                data_(data), size_(size), position_(0), failed_(false) {}
+
+            explicit BinaryReader(const std::string& data) :
+                data_(data.data()), size_(data.size()), position_(0), failed_(false) {}
+
+            explicit BinaryReader(const ByteView& data) :
+                data_(data.data), size_(data.size), position_(0), failed_(false) {}
+
+            template<class T>
+            bool Read(T* value)
+            {
+                if (!Require(sizeof(T))) {
+                    return false;
+                }
+                const char* bytes = data_ + position_;
+                if (Utils::little_endian()) {
+                    std::reverse_copy(bytes, bytes + sizeof(T), reinterpret_cast<char*>(value));
+                } else {
+                    std::memcpy(value, bytes, sizeof(T));
+                }
+                position_ += sizeof(T);
+                return true;
+            }
+
+            bool Read(std::string* value)
+            {
+                int size;
+                if (!Read(&size) || size < 0 || !Require(size)) {
+                    failed_ = true;
+                    return false;
+                }
+                value->assign(data_ + position_, size);
+                position_ += size;
+                return true;
+            }
+
+            // 文字列と同じ形式だが、コピーせずに元のバッファを指す
+            bool Read(ByteView* value)
+            {
+                int size;
+                if (!Read(&size) || size < 0 || !Require(size)) {
+                    failed_ = true;
+                    return false;
+                }
+                *value = ByteView(data_ + position_, size);
+                position_ += size;
+                return true;
+            }
+
+            template<class T1, class T2>
+            bool Read(T1* t1, T2* t2)
+            {
+                return Read(t1) && Read(t2);
+            }
+
+            template<class T1, class T2, class T3>
+            bool Read(T1* t1, T2* t2, T3* t3)
+            {
+                return Read(t1) && Read(t2) && Read(t3);
+            }
+
+            template<class T1, class T2, class T3, class T4>
+            bool Read(T1* t1, T2* t2, T3* t3, T4* t4)
+            {
+                return Read(t1) && Read(t2) && Read(t3) && Read(t4);
+            }
+
+            template<class T1, class T2, class T3, class T4, class T5>
+            bool Read(T1* t1, T2* t2, T3* t3, T4* t4, T5* t5)
+            {
+                return Read(t1) && Read(t2) && Read(t3) && Read(t4) && Read(t5);
+            }
+
+            template<class T1, class T2, class T3, class T4, class T5, class T6>
+            bool Read(T1* t1, T2* t2, T3* t3, T4* t4, T5* t5, T6* t6)
+            {
+                return Read(t1) && Read(t2) && Read(t3) && Read(t4) && Read(t5) && Read(t6);
+            }
+
+            bool Skip(size_t size)
+            {
+                if (!Require(size)) {
+                    return false;
+                }
+                position_ += size;
+                return true;
+            }
+
+            // 現在の読み込み位置
+            const char* current() const { return data_ + position_; }
+            size_t position() const { return position_; }
+            size_t remaining() const { return size_ - position_; }
+            bool failed() const { return failed_; }
+
+        private:
+            bool Require(size_t size)
+            {
+                if (failed_ || size_ - position_ < size) {
+                    failed_ = true;
+                    return false;
+                }
+                return true;
+            }
+
+        private:
+            const char* data_;
+            size_t size_;
+            size_t position_;
+            bool failed_;
+    };
+
+}
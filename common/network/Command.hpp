@@ -8,6 +8,7 @@
 #include <boost/shared_ptr.hpp>
 #include <boost/weak_ptr.hpp>
 #include <boost/asio.hpp>
+#include <boost/tuple/tuple.hpp>
 #include <stdint.h>
 #include "CommandHeader.hpp"
 #include "Utils.hpp"
@@ -99,6 +100,66 @@ typedef boost::weak_ptr<Session> SessionWeakPtr;
 			  Command(Header, Utils::Serialize(t1, t2, t3, t4, t5, t6)) {}
 	};
 	
+	namespace detail {
+		template<class T>
+		bool ReadField(BinaryReader* reader, T* value)
+		{
+			return reader->Read(value);
+		}
+
+		// x, y, z, theta, vy の順 (ServerUpdatePlayerPosition と同じ)
+		inline bool ReadField(BinaryReader* reader, PlayerPosition* pos)
+		{
+			return reader->Read(&pos->x, &pos->y, &pos->z, &pos->theta, &pos->vy);
+		}
+
+		// 最後の要素には tail が無い
+		template<class Head>
+		bool ReadFields(BinaryReader* reader, boost::tuples::cons<Head, boost::tuples::null_type>* fields)
+		{
+			return ReadField(reader, &fields->head);
+		}
+
+		template<class Head, class Tail>
+		bool ReadFields(BinaryReader* reader, boost::tuples::cons<Head, Tail>* fields)
+		{
+			return ReadField(reader, &fields->head) && ReadFields(reader, &fields->tail);
+		}
+	}
+
+	// 受信したコマンドの本文を型付きで読む
+	// 本文はコピーせず、文字列は ByteView として元のバッファを指すので Command より長く保持しないこと
+	// ヘッダが違う場合や本文が足りない場合は valid() が false になる 後ろに余分なデータがあっても良い
+	template<header::CommandHeader Header, class T1,
+		class T2 = boost::tuples::null_type, class T3 = boost::tuples::null_type,
+		class T4 = boost::tuples::null_type, class T5 = boost::tuples::null_type,
+		class T6 = boost::tuples::null_type>
+	class CommandView {
+		public:
+			typedef boost::tuple<T1, T2, T3, T4, T5, T6> Fields;
+
+			explicit CommandView(const Command& command) :
+				valid_(false)
+			{
+				if (command.header() == Header) {
+					BinaryReader reader(command.body());
+					valid_ = detail::ReadFields(&reader, &fields_);
+				}
+			}
+
+			bool valid() const { return valid_; }
+
+			template<int N>
+			const typename boost::tuples::element<N, Fields>::type& get() const
+			{
+				return boost::get<N>(fields_);
+			}
+
+		private:
+			Fields fields_;
+			bool valid_;
+	};
+
 	typedef CommandTemplate0<header::FatalConnectionError>					FatalConnectionError;
 	typedef CommandTemplate0<header::ServerStartEncryptedSession>			ServerStartEncryptedSession;
 	typedef CommandTemplate0<header::ClientStartEncryptedSession>			ClientStartEncryptedSession;
@@ -107,6 +168,8 @@ typedef boost::weak_ptr<Session> SessionWeakPtr;
 	typedef CommandTemplate0<header::ClientReceiveServerCrowdedError>		ClientReceiveServerCrowdedError;
 	typedef CommandTemplate0<header::ServerRequestedFullServerInfo>			ServerRequestedFullServerInfo;
 	typedef CommandTemplate0<header::ServerRequestedPlainFullServerInfo>	ServerRequestedPlainFullServerInfo;
+	typedef CommandTemplate0<header::ServerReceiveUDPTestPacketAck>			ServerReceiveUDPTestPacketAck;
+	typedef CommandTemplate0<header::ClientReceiveKeepAlive>				ClientReceiveKeepAlive;
 
 	typedef CommandTemplate1<header::ServerReceivePublicKey,
 		const std::string&>	ServerReceivePublicKey;
@@ -159,4 +222,77 @@ typedef boost::weak_ptr<Session> SessionWeakPtr;
 	typedef CommandTemplate1<header::UserFatalConnectionError,
 		uint32_t> UserFatalConnectionError;
 
+	typedef CommandTemplate6<header::ClientReceivePlayerEnterArea,
+		uint32_t, int16_t, int16_t, int16_t, uint8_t, uint8_t> ClientReceivePlayerEnterArea;
+
+	typedef CommandTemplate1<header::ClientReceivePlayerLeaveArea,
+		uint32_t> ClientReceivePlayerLeaveArea;
+
+	typedef CommandTemplate1<header::ClientEnableUDPPosition,
+		uint32_t> ClientEnableUDPPosition;
+
+	typedef CommandTemplate1<header::ServerReceiveCapabilities,
+		uint32_t> ServerReceiveCapabilities;
+
+	typedef CommandTemplate1<header::ClientReceiveCapabilities,
+		uint32_t> ClientReceiveCapabilities;
+
+	// 共通鍵から作った値 公開鍵に対応する秘密鍵を持っていることを示す
+	typedef CommandTemplate1<header::ServerReceiveKeyConfirmation,
+		const std::string&> ServerReceiveKeyConfirmation;
+
+	// サーバーの instance_id, 通し番号
+	typedef CommandTemplate2<header::ServerRequestedAccountChanges,
+		uint32_t, uint32_t> ServerRequestedAccountChanges;
+
+	// フィンガープリント, バージョン, UDPポート, 公開鍵, 再接続用のチケット, 乱数
+	typedef CommandTemplate6<header::ServerReceiveClientHello,
+		const std::string&, uint16_t, uint16_t, const std::string&, const std::string&,
+		const std::string&> ServerReceiveClientHello;
+
+	typedef CommandTemplate2<header::ClientReceiveSessionResumed,
+		uint32_t, const std::string&> ClientReceiveSessionResumed;
+
+	typedef CommandTemplate1<header::ClientReceiveSessionTicket,
+		const std::string&> ClientReceiveSessionTicket;
+
+	typedef CommandView<header::ServerReceiveJSON,
+		ByteView> ServerReceiveJSONView;
+
+	typedef CommandView<header::ServerUpdatePlayerPosition,
+		PlayerPosition> ServerUpdatePlayerPositionView;
+
+	typedef CommandView<header::ServerUpdatePlayerPositionSequenced,
+		uint32_t, uint16_t, PlayerPosition> ServerUpdatePlayerPositionSequencedView;
+
+	typedef CommandView<header::ServerReceiveClientInfo,
+		ByteView, uint16_t, uint16_t> ServerReceiveClientInfoView;
+
+	typedef CommandView<header::ServerReceivePublicKey,
+		ByteView> ServerReceivePublicKeyView;
+
+	typedef CommandView<header::ServerReceiveCapabilities,
+		uint32_t> ServerReceiveCapabilitiesView;
+
+	typedef CommandView<header::ServerReceiveAccountInitializeData,
+		ByteView> ServerReceiveAccountInitializeDataView;
+
+	typedef CommandView<header::ServerRequestedAccountRevisionPatch,
+		uint32_t, uint32_t> ServerRequestedAccountRevisionPatchView;
+
+	typedef CommandView<header::ServerUpdateAccountProperty,
+		AccountProperty, ByteView> ServerUpdateAccountPropertyView;
+
+	typedef CommandView<header::UserFatalConnectionError,
+		uint32_t> UserFatalConnectionErrorView;
+
+	typedef CommandView<header::ServerRequestedAccountChanges,
+		uint32_t, uint32_t> ServerRequestedAccountChangesView;
+
+	typedef CommandView<header::ServerReceiveKeyConfirmation,
+		ByteView> ServerReceiveKeyConfirmationView;
+
+	typedef CommandView<header::ServerReceiveClientHello,
+		ByteView, uint16_t, uint16_t, ByteView, ByteView, ByteView> ServerReceiveClientHelloView;
+
 }
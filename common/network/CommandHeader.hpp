@@ -32,8 +32,27 @@ namespace header {
         ClientReceiveJSON =                         0x15,
         ServerRequestedFullServerInfo =             0x16,
         ClientReceiveFullServerInfo =               0x17,
+        ClientReceivePlayerEnterArea =              0x18,
+        ClientReceivePlayerLeaveArea =              0x19,
+        ClientUpdatePlayerPositionSnapshot =        0x1A,
+        ServerReceiveUDPTestPacketAck =             0x1B,
+        ClientEnableUDPPosition =                   0x1C,
+        ServerUpdatePlayerPositionSequenced =       0x1D,
+        ClientUpdatePlayerPositionSequenced =       0x1E,
+        ClientUpdatePlayerPositionDelta =           0x1F,
 		
 		ServerReceiveWriteLimit =					0x20,
+        ServerReceiveCapabilities =                 0x21,
+        ClientReceiveCapabilities =                 0x22,
+        ClientReceiveAccountSnapshot =              0x23,
+        ClientReceiveAccountRevisionPush =          0x24,
+        ServerRequestedAccountChanges =             0x25,
+        ClientReceiveAccountChanges =               0x26,
+        ClientReceiveKeepAlive =                    0x27,
+        ServerReceiveClientHello =                  0x28,
+        ClientReceiveSessionResumed =               0x29,
+        ClientReceiveSessionTicket =                0x2A,
+        ServerReceiveKeyConfirmation =              0x2B,
 		
         ServerRequestedPlainFullServerInfo =        0x40,
         ClientReceivePlainFullServerInfo =			0x41,
@@ -41,7 +60,22 @@ namespace header {
 		ServerRequstedStatus =						0xE0,
 
         LZ4_COMPRESS_HEADER =                       0xF0,
-        ENCRYPT_HEADER =                            0xF1
+        ENCRYPT_HEADER =                            0xF1,
+        LZ4_STREAM_COMPRESS_HEADER =                0xF2,
+        LENGTH_PREFIXED_FRAMING_HEADER =            0xF3,
+        ENCRYPT_GCM_HEADER =                        0xF4
+    };
+
+}
+
+// ServerReceiveCapabilities / ClientReceiveCapabilities で交換する機能
+namespace capability {
+    enum Capability {
+        STREAM_COMPRESSION =                        0x00000001,
+        LENGTH_PREFIXED_FRAMING =                   0x00000002,
+        ACCOUNT_SNAPSHOT =                          0x00000004,    // 参加時に全員の情報を1つのコマンドで受け取る
+        ACCOUNT_PUSH =                              0x00000008,    // 更新通知の代わりに差分を直接受け取る
+        AUTHENTICATED_ENCRYPTION =                  0x00000010     // AES-GCM で暗号化する
     };
 
 }
@@ -2,10 +2,13 @@
 // Encrypter.cpp
 //
 
+#include <cstring>
 #include <boost/format.hpp>
+#include <boost/make_shared.hpp>
 #include <sha.h>
 #include <whrlpool.h>
 #include <osrng.h>
+#include <cpu.h>
 #include "Encrypter.hpp"
 #include "Utils.hpp"
 
@@ -19,7 +22,32 @@ const int Encrypter::TRIP_LENGTH = 12;
 
 using namespace CryptoPP;
 
-Encrypter::Encrypter()
+namespace {
+
+// 最後の2ブロック分だけを残す
+void KeepTail(std::string* tail, const char* data, size_t size)
+{
+    const size_t limit = AES::BLOCKSIZE * 2;
+    if (size >= limit) {
+        tail->assign(data + size - limit, limit);
+    } else {
+        tail->append(data, size);
+        if (tail->size() > limit) {
+            tail->erase(0, tail->size() - limit);
+        }
+    }
+}
+
+}
+
+Encrypter::Encrypter() :
+    public_key_ready_(false),
+    private_key_ready_(false),
+    key_owner_(true),
+    encrypted_size_(0),
+    decrypted_size_(0),
+    send_sequence_(0),
+    receive_sequence_(0)
 {
     AutoSeededRandomPool rnd;
     
@@ -33,36 +61,162 @@ Encrypter::Encrypter()
 
     aes_encrypt_.SetKeyWithIV(common_key, sizeof(common_key), common_key_iv);
     aes_decrypt_.SetKeyWithIV(common_key, sizeof(common_key), common_key_iv);
-
-    InvertibleRSAFunction params;
-    params.GenerateRandomWithKeySize(rnd, 3072);
-
-    private_key_ = RSA::PrivateKey(params);
-    public_key_ = RSA::PublicKey(params);
+    SetCipherKey();
 }
 
 Encrypter::~Encrypter()
 {
 }
 
+void Encrypter::PrepareKeyPair()
+{
+    if (public_key_ready_ && private_key_ready_) {
+        return;
+    }
+
+    AutoSeededRandomPool rnd;
+    InvertibleRSAFunction params;
+    params.GenerateRandomWithKeySize(rnd, 3072);
+
+    if (!private_key_ready_) {
+        private_key_ = RSA::PrivateKey(params);
+        private_key_ready_ = true;
+    }
+    if (!public_key_ready_) {
+        public_key_ = RSA::PublicKey(params);
+        public_key_ready_ = true;
+    }
+}
+
 std::string Encrypter::Encrypt(const std::string& in)
 {
-     std::unique_ptr<char[]> outbuf(new char [in.size()]);
-     aes_encrypt_.ProcessData((byte*)outbuf.get(), (const byte*)in.data(), in.size());
-     std::string out((const char*)outbuf.get(), in.size());
+     std::string out(in);
+     if (!out.empty()) {
+         EncryptInPlace(&out[0], out.size());
+     }
      return out;
 }
 
 std::string Encrypter::Decrypt(const std::string& in)
 {
-     std::unique_ptr<char[]> outbuf(new char [in.size()]);
-     aes_decrypt_.ProcessData((byte*)outbuf.get(), (const byte*)in.data(), in.size());
-     std::string out((const char*)outbuf.get(), in.size());
+     std::string out(in);
+     if (!out.empty()) {
+         DecryptInPlace(&out[0], out.size());
+     }
      return out;
 }
 
+void Encrypter::EncryptInPlace(char* data, size_t size)
+{
+    aes_encrypt_.ProcessData((byte*)data, (const byte*)data, size);
+    KeepTail(&encrypted_tail_, data, size);
+    encrypted_size_ += size;
+}
+
+void Encrypter::DecryptInPlace(char* data, size_t size)
+{
+    KeepTail(&decrypted_tail_, data, size);
+    decrypted_size_ += size;
+    aes_decrypt_.ProcessData((byte*)data, (const byte*)data, size);
+}
+
+void Encrypter::SealInPlace(char* data, size_t size, char* tag)
+{
+    byte nonce[12];
+    MakeNonce(true, send_sequence_++, nonce);
+    gcm_encrypt_.EncryptAndAuthenticate((byte*)data, (byte*)tag, ENCRYPTER_TAG_SIZE,
+            nonce, sizeof(nonce), nullptr, 0, (const byte*)data, size);
+}
+
+bool Encrypter::OpenInPlace(char* data, size_t size, const char* tag)
+{
+    byte nonce[12];
+    MakeNonce(false, receive_sequence_, nonce);
+    if (!gcm_decrypt_.DecryptAndVerify((byte*)data, (const byte*)tag, ENCRYPTER_TAG_SIZE,
+            nonce, sizeof(nonce), nullptr, 0, (const byte*)data, size)) {
+        return false;
+    }
+    receive_sequence_++;
+    return true;
+}
+
+bool Encrypter::HardwareAESAvailable()
+{
+#if CRYPTOPP_BOOL_X86 || CRYPTOPP_BOOL_X64
+    return HasAESNI();
+#else
+    return false;
+#endif
+}
+
+void Encrypter::SetCipherKey()
+{
+    // CFB と同じ鍵を別のモードで使わないよう、GCM には共通鍵から作った鍵を使う
+    byte gcm_key[SHA256::DIGESTSIZE];
+    const std::string key_in = common_key_ + "gcm";
+    SHA256().CalculateDigest(gcm_key, (const byte*)key_in.data(), key_in.size());
+
+    gcm_encrypt_.SetKeyWithIV(gcm_key, common_key_.size(),
+            (const byte*)common_key_iv_.data(), 12);
+    gcm_decrypt_.SetKeyWithIV(gcm_key, common_key_.size(),
+            (const byte*)common_key_iv_.data(), 12);
+    send_sequence_ = 0;
+    receive_sequence_ = 0;
+
+    encrypted_size_ = 0;
+    decrypted_size_ = 0;
+    encrypted_tail_.clear();
+    decrypted_tail_.clear();
+}
+
+void Encrypter::RestoreStream(bool encrypt, const std::string& tail, uint64_t size)
+{
+    // CFB では最後に完了したブロックの暗号文から次の鍵ストリームを作る
+    const size_t partial = size % AES::BLOCKSIZE;
+    std::string feedback = common_key_iv_;
+    if (size >= AES::BLOCKSIZE) {
+        feedback = tail.substr(tail.size() - partial - AES::BLOCKSIZE, AES::BLOCKSIZE);
+    }
+
+    const byte* key = (const byte*)common_key_.data();
+    const std::string cipher = tail.substr(tail.size() - partial);
+    std::string plain(partial, '\0');
+    if (encrypt) {
+        // 途中のブロックは、同じ暗号文になる平文を暗号化し直して進める
+        CFB_Mode<AES>::Decryption decrypt;
+        decrypt.SetKeyWithIV(key, common_key_.size(), (const byte*)feedback.data());
+        aes_encrypt_.SetKeyWithIV(key, common_key_.size(), (const byte*)feedback.data());
+        if (partial > 0) {
+            decrypt.ProcessData((byte*)&plain[0], (const byte*)cipher.data(), partial);
+            std::string discard(partial, '\0');
+            aes_encrypt_.ProcessData((byte*)&discard[0], (const byte*)plain.data(), partial);
+        }
+    } else {
+        aes_decrypt_.SetKeyWithIV(key, common_key_.size(), (const byte*)feedback.data());
+        if (partial > 0) {
+            aes_decrypt_.ProcessData((byte*)&plain[0], (const byte*)cipher.data(), partial);
+        }
+    }
+}
+
+void Encrypter::MakeNonce(bool send, uint64_t sequence, unsigned char* nonce) const
+{
+    // IVの先頭4バイトと、方向を表す1ビットと、64ビットの通し番号
+    std::memcpy(nonce, common_key_iv_.data(), 4);
+    if (send == key_owner_) {
+        nonce[0] ^= 0x80;
+    }
+    for (int i = 0; i < 8; i++) {
+        nonce[4 + i] = static_cast<byte>(sequence >> (56 - 8 * i));
+    }
+}
+
 std::string Encrypter::GetPublicKey()
 {
+    if (!public_key_ready_) {
+        PrepareKeyPair();
+    }
+
     ByteQueue queue;
     public_key_.Save(queue);
 
@@ -79,10 +233,15 @@ void Encrypter::SetPublicKey(const std::string& in)
     ByteQueue queue;
     queue.Put((const byte*)in.data(), in.size());
     public_key_.Load(queue);
+    public_key_ready_ = true;
 }
 
 std::string Encrypter::GetPrivateKey()
 {
+    if (!private_key_ready_) {
+        PrepareKeyPair();
+    }
+
     ByteQueue queue;
     private_key_.Save(queue);
 
@@ -99,6 +258,7 @@ void Encrypter::SetPrivateKey(const std::string& in)
     ByteQueue queue;
     queue.Put((const byte*)in.data(), in.size());
     private_key_.Load(queue);
+    private_key_ready_ = true;
 }
 
 void Encrypter::SetPairKey(const std::string& pub, const std::string& pri)
@@ -120,10 +280,112 @@ void Encrypter::SetCryptedCommonKey(const std::string& in)
 
     aes_encrypt_.SetKeyWithIV((const byte*)common_key_.data(), common_key_.size(), (const byte*)common_key_iv_.data());
     aes_decrypt_.SetKeyWithIV((const byte*)common_key_.data(), common_key_.size(), (const byte*)common_key_iv_.data());
+
+    key_owner_ = false;
+    SetCipherKey();
+}
+
+std::string Encrypter::GetResumptionSecret() const
+{
+    const std::string in = "resumption" + common_key_ + common_key_iv_;
+    byte digest[SHA256::DIGESTSIZE];
+    SHA256().CalculateDigest(digest, (const byte*)in.data(), in.size());
+    return std::string((const char*)digest, sizeof(digest));
+}
+
+std::string Encrypter::GetKeyConfirmation() const
+{
+    const std::string in = "confirmation" + common_key_ + common_key_iv_;
+    byte digest[SHA256::DIGESTSIZE];
+    SHA256().CalculateDigest(digest, (const byte*)in.data(), in.size());
+    return std::string((const char*)digest, sizeof(digest));
+}
+
+std::string Encrypter::AcceptResumption(const std::string& secret, const std::string& client_random)
+{
+    // クライアントの乱数が短くても、サーバーの乱数で鍵は毎回変わる
+    const std::string server_random = GetRandomBytes(ENCRYPTER_RANDOM_SIZE);
+    key_owner_ = true;
+    DeriveCommonKey(secret, client_random + server_random);
+    return server_random;
+}
+
+void Encrypter::Resume(const std::string& secret, const std::string& client_random,
+        const std::string& server_random)
+{
+    key_owner_ = false;
+    DeriveCommonKey(secret, client_random + server_random);
+}
+
+std::string Encrypter::SaveState() const
+{
+    std::string state;
+    BinaryWriter(&state)
+        .Write(common_key_, common_key_iv_, static_cast<uint8_t>(key_owner_), send_sequence_, receive_sequence_)
+        .Write(encrypted_size_, encrypted_tail_, decrypted_size_, decrypted_tail_);
+    return state;
+}
+
+bool Encrypter::LoadState(const std::string& state)
+{
+    std::string key, iv, encrypted_tail, decrypted_tail;
+    uint8_t key_owner;
+    uint64_t send_sequence, receive_sequence, encrypted_size, decrypted_size;
+    BinaryReader reader(state);
+    if (!reader.Read(&key, &iv, &key_owner, &send_sequence, &receive_sequence) ||
+            !reader.Read(&encrypted_size, &encrypted_tail, &decrypted_size, &decrypted_tail)) {
+        return false;
+    }
+
+    // CFB の状態を作り直すには、最後の完了したブロックと途中のブロックの暗号文が要る
+    auto required = [](uint64_t size) -> size_t {
+        return size < AES::BLOCKSIZE ? size : AES::BLOCKSIZE + size % AES::BLOCKSIZE;
+    };
+    if (key.size() != AES::DEFAULT_KEYLENGTH || iv.size() != AES::BLOCKSIZE ||
+            encrypted_tail.size() < required(encrypted_size) ||
+            decrypted_tail.size() < required(decrypted_size)) {
+        return false;
+    }
+
+    common_key_ = key;
+    common_key_iv_ = iv;
+    key_owner_ = key_owner != 0;
+    SetCipherKey();
+    send_sequence_ = send_sequence;
+    receive_sequence_ = receive_sequence;
+
+    RestoreStream(true, encrypted_tail, encrypted_size);
+    RestoreStream(false, decrypted_tail, decrypted_size);
+    encrypted_size_ = encrypted_size;
+    decrypted_size_ = decrypted_size;
+    encrypted_tail_ = encrypted_tail;
+    decrypted_tail_ = decrypted_tail;
+    return true;
+}
+
+void Encrypter::DeriveCommonKey(const std::string& secret, const std::string& salt)
+{
+    // 同じチケットを使っても、乱数が違えば鍵とIVは毎回変わる
+    byte digest[SHA256::DIGESTSIZE];
+    const std::string key_in = secret + salt + "key";
+    SHA256().CalculateDigest(digest, (const byte*)key_in.data(), key_in.size());
+    common_key_ = std::string((const char*)digest, AES::DEFAULT_KEYLENGTH);
+
+    const std::string iv_in = secret + salt + "iv";
+    SHA256().CalculateDigest(digest, (const byte*)iv_in.data(), iv_in.size());
+    common_key_iv_ = std::string((const char*)digest, AES::BLOCKSIZE);
+
+    aes_encrypt_.SetKeyWithIV((const byte*)common_key_.data(), common_key_.size(), (const byte*)common_key_iv_.data());
+    aes_decrypt_.SetKeyWithIV((const byte*)common_key_.data(), common_key_.size(), (const byte*)common_key_iv_.data());
+    SetCipherKey();
 }
 
 std::string Encrypter::PublicEncrypt(const std::string& in)
 {
+    if (!public_key_ready_) {
+        PrepareKeyPair();
+    }
+
     AutoSeededRandomPool rng;
     RSAES_OAEP_SHA_Encryptor encryptor(public_key_);
 
@@ -143,6 +405,10 @@ std::string Encrypter::PublicEncrypt(const std::string& in)
 
 std::string Encrypter::PublicDecrypt(const std::string& in)
 {
+    if (!private_key_ready_) {
+        PrepareKeyPair();
+    }
+
     AutoSeededRandomPool rng;
     RSAES_OAEP_SHA_Decryptor decryptor(private_key_);
 
@@ -172,6 +438,16 @@ std::string Encrypter::GetHash(const std::string& in)
     return std::string((char*)outbuf.get(), 64);
 }
 
+std::string Encrypter::GetRandomBytes(size_t size)
+{
+    AutoSeededRandomPool rnd;
+    std::string out(size, '\0');
+    if (size > 0) {
+        rnd.GenerateBlock((byte*)&out[0], size);
+    }
+    return out;
+}
+
 std::string Encrypter::GetTripHash(const std::string& in)
 {
     std::unique_ptr<byte[]> outbuf(new byte [64]);
@@ -5,11 +5,16 @@
 #pragma once
 
 #include <string>
+#include <stdint.h>
 
 #include <modes.h>
 #include <aes.h>
+#include <gcm.h>
 #include <rsa.h>
 
+#define ENCRYPTER_TAG_SIZE (12)
+#define ENCRYPTER_RANDOM_SIZE (16)
+
 namespace network {
 
 class Encrypter {
@@ -20,6 +25,20 @@ class Encrypter {
         std::string Encrypt(const std::string&);
         std::string Decrypt(const std::string&);
 
+        // AES-CFB でその場で暗号化・復号する
+        void EncryptInPlace(char* data, size_t size);
+        void DecryptInPlace(char* data, size_t size);
+
+        // AES-GCM でその場で暗号化し、tag に ENCRYPTER_TAG_SIZE バイトの認証タグを書く
+        // nonce は送信と受信で別々の通し番号から作るので、フレームの順序を変えないこと
+        void SealInPlace(char* data, size_t size, char* tag);
+
+        // その場で復号して認証タグを確かめる 改ざんされている場合は false
+        bool OpenInPlace(char* data, size_t size, const char* tag);
+
+        // AES-NI が使える場合は CryptoPP が自動的に使う
+        static bool HardwareAESAvailable();
+
         std::string PublicEncrypt(const std::string&);
         std::string PublicDecrypt(const std::string&);
 
@@ -36,23 +55,66 @@ class Encrypter {
         std::string GetCryptedCommonKey();
         void SetCryptedCommonKey(const std::string&);
 
+        // 再接続用のチケットに入れる秘密 現在の共通鍵から作る
+        std::string GetResumptionSecret() const;
+
+        // 共通鍵を受け取れたことを示す値 公開鍵で暗号化した共通鍵を復号できた相手だけが作れる
+        std::string GetKeyConfirmation() const;
+
+        // チケットの秘密と双方の乱数から新しい共通鍵を作る
+        // サーバー側は乱数を生成して返し、クライアント側は受け取った乱数を渡す
+        std::string AcceptResumption(const std::string& secret, const std::string& client_random);
+        void Resume(const std::string& secret, const std::string& client_random,
+                const std::string& server_random);
+
+        // 共通鍵と送受信の途中の状態 別のプロセスで同じ接続の続きを暗号化・復号する
+        // 公開鍵暗号の鍵は含まないので、鍵交換が終わってから使う
+        std::string SaveState() const;
+        bool LoadState(const std::string& state);
+
         std::string GetPublicKeyFingerPrint();
         static std::string GetHash(const std::string&);
         static std::string GetTrip(const std::string&);
+        static std::string GetRandomBytes(size_t size);
 
     private:
         std::string GetCommonKey();
         static std::string GetTripHash(const std::string&);
 
+        void SetCipherKey();
+        void RestoreStream(bool encrypt, const std::string& tail, uint64_t size);
+        void DeriveCommonKey(const std::string& secret, const std::string& salt);
+        void MakeNonce(bool send, uint64_t sequence, unsigned char* nonce) const;
+
+        // 必要になった時点で鍵ペアを用意する
+        void PrepareKeyPair();
+
     private:
         const static int TRIP_LENGTH;
 
+        bool public_key_ready_;
+        bool private_key_ready_;
+
         std::string common_key_;
         std::string common_key_iv_;
 
+        // 共通鍵を作った側か 送信と受信の nonce が重ならないように使う
+        bool key_owner_;
+
         CryptoPP::CFB_Mode<CryptoPP::AES>::Encryption aes_encrypt_;
         CryptoPP::CFB_Mode<CryptoPP::AES>::Decryption aes_decrypt_;
 
+        // CFB の途中の状態を作り直せるよう、処理したバイト数と最後の2ブロック分の暗号文を残す
+        uint64_t encrypted_size_;
+        uint64_t decrypted_size_;
+        std::string encrypted_tail_;
+        std::string decrypted_tail_;
+
+        CryptoPP::GCM<CryptoPP::AES>::Encryption gcm_encrypt_;
+        CryptoPP::GCM<CryptoPP::AES>::Decryption gcm_decrypt_;
+        uint64_t send_sequence_;
+        uint64_t receive_sequence_;
+
         CryptoPP::RSA::PrivateKey private_key_;
         CryptoPP::RSA::PublicKey public_key_;
 };
@@ -0,0 +1,201 @@
+//
+// PositionCodec.cpp
+//
+
+#include "PositionCodec.hpp"
+#include "Utils.hpp"
+#include <climits>
+
+namespace network {
+
+namespace {
+
+bool FitsInt8(int value)
+{
+    return value >= SCHAR_MIN && value <= SCHAR_MAX;
+}
+
+bool FitsInt16(int value)
+{
+    return value >= SHRT_MIN && value <= SHRT_MAX;
+}
+
+int ReadInt16(const char* data)
+{
+    return static_cast<int16_t>((static_cast<uint8_t>(data[0]) << 8) | static_cast<uint8_t>(data[1]));
+}
+
+}
+
+std::string PositionCodec::Encode(uint32_t user_id, const PlayerPosition& pos)
+{
+    boost::mutex::scoped_lock lock(mutex_);
+
+    auto it = baselines_.find(user_id);
+    std::string data = EncodeDelta(pos, it != baselines_.end() ? &it->second : nullptr);
+    baselines_[user_id] = pos;
+    return data;
+}
+
+size_t PositionCodec::Decode(uint32_t user_id, const char* data, size_t size, PlayerPosition* pos)
+{
+    boost::mutex::scoped_lock lock(mutex_);
+
+    auto it = baselines_.find(user_id);
+    size_t read = DecodeDelta(data, size, it != baselines_.end() ? &it->second : nullptr, pos);
+    if (read > 0) {
+        baselines_[user_id] = *pos;
+    }
+    return read;
+}
+
+void PositionCodec::Reset(uint32_t user_id)
+{
+    boost::mutex::scoped_lock lock(mutex_);
+    baselines_.erase(user_id);
+}
+
+void PositionCodec::ResetAll()
+{
+    boost::mutex::scoped_lock lock(mutex_);
+    baselines_.clear();
+}
+
+std::string PositionCodec::SaveState()
+{
+    boost::mutex::scoped_lock lock(mutex_);
+
+    std::string state;
+    BinaryWriter writer(&state);
+    writer.Write(static_cast<uint32_t>(baselines_.size()));
+    for (auto it = baselines_.begin(); it != baselines_.end(); ++it) {
+        const PlayerPosition& pos = it->second;
+        writer.Write(it->first).Write(pos.x, pos.y, pos.z, pos.theta, pos.vy);
+    }
+    return state;
+}
+
+bool PositionCodec::LoadState(const std::string& state)
+{
+    boost::mutex::scoped_lock lock(mutex_);
+
+    BinaryReader reader(state);
+    uint32_t count;
+    if (!reader.Read(&count)) {
+        return false;
+    }
+
+    baselines_.clear();
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t user_id;
+        PlayerPosition pos;
+        if (!reader.Read(&user_id) || !reader.Read(&pos.x, &pos.y, &pos.z, &pos.theta, &pos.vy)) {
+            return false;
+        }
+        baselines_[user_id] = pos;
+    }
+    return true;
+}
+
+std::string PositionCodec::EncodeDelta(const PlayerPosition& pos, const PlayerPosition* base)
+{
+    if (base) {
+        const int dx = pos.x - base->x;
+        const int dy = pos.y - base->y;
+        const int dz = pos.z - base->z;
+
+        if (FitsInt16(dx) && FitsInt16(dy) && FitsInt16(dz)) {
+            const bool wide = !FitsInt8(dx) || !FitsInt8(dy) || !FitsInt8(dz);
+
+            uint8_t flags = wide ? FLAG_WIDE : 0;
+            if (dx != 0) flags |= FLAG_X;
+            if (dy != 0) flags |= FLAG_Y;
+            if (dz != 0) flags |= FLAG_Z;
+            if (pos.theta != base->theta) flags |= FLAG_THETA;
+            if (pos.vy != base->vy) flags |= FLAG_VY;
+
+            std::string data(1, static_cast<char>(flags));
+            const int deltas[] = {dx, dy, dz};
+            const uint8_t axes[] = {FLAG_X, FLAG_Y, FLAG_Z};
+            for (int i = 0; i < 3; i++) {
+                if (flags & axes[i]) {
+                    data += wide ? Utils::Serialize(static_cast<int16_t>(deltas[i])) :
+                        Utils::Serialize(static_cast<int8_t>(deltas[i]));
+                }
+            }
+            if (flags & FLAG_THETA) {
+                data += Utils::Serialize(static_cast<uint8_t>(pos.theta - base->theta));
+            }
+            if (flags & FLAG_VY) {
+                data += Utils::Serialize(pos.vy);
+            }
+            return data;
+        }
+    }
+
+    // 基準が無い場合や差分が大きすぎる場合
+    return Utils::Serialize(static_cast<uint8_t>(FLAG_ABSOLUTE),
+            pos.x, pos.y, pos.z, pos.theta, pos.vy);
+}
+
+size_t PositionCodec::DecodeDelta(const char* data, size_t size,
+        const PlayerPosition* base, PlayerPosition* pos)
+{
+    if (size < 1) {
+        return 0;
+    }
+
+    const uint8_t flags = static_cast<uint8_t>(data[0]);
+    size_t offset = 1;
+
+    if (flags & FLAG_ABSOLUTE) {
+        if (size < offset + 8) {
+            return 0;
+        }
+        pos->x = ReadInt16(data + offset);
+        pos->y = ReadInt16(data + offset + 2);
+        pos->z = ReadInt16(data + offset + 4);
+        pos->theta = static_cast<uint8_t>(data[offset + 6]);
+        pos->vy = static_cast<int8_t>(data[offset + 7]);
+        return offset + 8;
+    }
+
+    // 基準を失っている場合は復号できない
+    if (!base) {
+        return 0;
+    }
+
+    PlayerPosition result = *base;
+    const size_t width = (flags & FLAG_WIDE) ? 2 : 1;
+    int16_t* values[] = {&result.x, &result.y, &result.z};
+    const uint8_t axes[] = {FLAG_X, FLAG_Y, FLAG_Z};
+    for (int i = 0; i < 3; i++) {
+        if (flags & axes[i]) {
+            if (size < offset + width) {
+                return 0;
+            }
+            const int delta = width == 2 ? ReadInt16(data + offset) : static_cast<int8_t>(data[offset]);
+            *values[i] = static_cast<int16_t>(*values[i] + delta);
+            offset += width;
+        }
+    }
+    if (flags & FLAG_THETA) {
+        if (size < offset + 1) {
+            return 0;
+        }
+        result.theta = static_cast<uint8_t>(result.theta + static_cast<uint8_t>(data[offset]));
+        offset++;
+    }
+    if (flags & FLAG_VY) {
+        if (size < offset + 1) {
+            return 0;
+        }
+        result.vy = static_cast<int8_t>(data[offset]);
+        offset++;
+    }
+
+    *pos = result;
+    return offset;
+}
+
+}
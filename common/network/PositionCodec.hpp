@@ -0,0 +1,51 @@
+//
+// PositionCodec.hpp
+//
+
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <stdint.h>
+#include <boost/thread.hpp>
+#include "../database/AccountProperty.hpp"
+
+namespace network {
+
+// 相手ごとに前回送った位置を基準として、差分だけを符号化する
+class PositionCodec {
+    public:
+        enum Flag {
+            FLAG_ABSOLUTE =  0x01,   // 基準を使わずに全ての値を送る
+            FLAG_X =         0x02,
+            FLAG_Y =         0x04,
+            FLAG_Z =         0x08,
+            FLAG_THETA =     0x10,
+            FLAG_VY =        0x20,
+            FLAG_WIDE =      0x40    // x, y, z の差分を2バイトで送る
+        };
+
+        // 基準を更新して符号化した値を返す 変化が無ければ1バイト
+        std::string Encode(uint32_t user_id, const PlayerPosition& pos);
+
+        // 復号して基準を更新する 読み込んだバイト数を返し、失敗した場合は0
+        size_t Decode(uint32_t user_id, const char* data, size_t size, PlayerPosition* pos);
+
+        // 基準を捨てて、次は絶対値で送る 送信側と受信側で同じ順序で呼ぶこと
+        void Reset(uint32_t user_id);
+        void ResetAll();
+
+        // 全員の基準 別のプロセスに引き継ぐ
+        std::string SaveState();
+        bool LoadState(const std::string& state);
+
+        static std::string EncodeDelta(const PlayerPosition& pos, const PlayerPosition* base);
+        static size_t DecodeDelta(const char* data, size_t size,
+                const PlayerPosition* base, PlayerPosition* pos);
+
+    private:
+        std::unordered_map<uint32_t, PlayerPosition> baselines_;
+        boost::mutex mutex_;
+};
+
+}
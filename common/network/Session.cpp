@@ -8,14 +8,39 @@
 #include "Utils.hpp"
 #include "../Logger.hpp"
 #include <boost/make_shared.hpp>
+#include <boost/foreach.hpp>
 #include <string>
+#include <cstring>
 
 namespace network {
 
     Session::Session(boost::asio::io_service& io_service_tcp) :
       io_service_tcp_(io_service_tcp),
       socket_tcp_(io_service_tcp),
+      strand_(io_service_tcp),
       encryption_(false),
+      authenticated_encryption_(false),
+      encrypted_receive_(false),
+      length_prefixed_send_(false),
+      length_prefixed_receive_(false),
+      receiving_(false),
+      suspending_(false),
+      suspended_(false),
+      writing_frame_count_(0),
+      flush_timer_(io_service_tcp),
+      flush_window_(0),
+      flush_scheduled_(false),
+      write_count_(0),
+      written_frame_count_(0),
+      written_byte_count_(0),
+      udp_port_(0),
+      udp_enabled_(false),
+      udp_token_(0),
+      udp_send_sequence_(0),
+      udp_receive_sequence_(0),
+      udp_received_(false),
+      capabilities_(0),
+      account_synced_(false),
       online_(true),
       login_(false),
       read_start_time_(time(nullptr) - BYTE_AVERAGE_REFRESH_SECONDS),
@@ -26,6 +51,7 @@ namespace network {
       compressed_byte_sum_(0),
 	  write_average_limit_(999999),
       id_(0),
+      pending_id_(0),
 	  channel_(0)
     {
 
@@ -43,13 +69,13 @@ namespace network {
 
     void Session::Send(const Command& command)
     {
-        auto msg = Serialize(command, command.plain());
-        write_byte_sum_ += msg.size();
-        UpdateWriteByteAverage();
-
-		Logger::Debug(_T("%d byte/s"), GetWriteByteAverage());
+        // 暗号化の状態を共有するため、シリアライズもストランド上で行う
+        strand_.post(boost::bind(&Session::DoWriteTCP, this, command, shared_from_this()));
+    }
 
-        io_service_tcp_.post(boost::bind(&Session::DoWriteTCP, this, msg, shared_from_this()));
+    void Session::Send(const FramePtr& frame)
+    {
+        strand_.post(boost::bind(&Session::DoWriteFrame, this, frame, shared_from_this()));
     }
 
     void Session::SyncSend(const Command& command)
@@ -107,7 +133,235 @@ namespace network {
 
     void Session::EnableEncryption()
     {
+        // 送信済みのコマンドより後に暗号化を開始する
+        strand_.post(boost::bind(&Session::DoEnableEncryption, this, shared_from_this()));
+    }
+
+    void Session::DoEnableEncryption(SessionPtr session_holder)
+    {
+        encryption_ = true;
+    }
+
+    void Session::EnableStreamCompression()
+    {
+        // 送信済みのコマンドより後に圧縮を開始する
+        strand_.post(boost::bind(&Session::DoEnableStreamCompression, this, shared_from_this()));
+    }
+
+    void Session::DoEnableStreamCompression(SessionPtr session_holder)
+    {
+        if (!stream_compressor_) {
+            stream_compressor_.reset(new StreamCompressor());
+        }
+    }
+
+    void Session::EnableLengthPrefixedFraming()
+    {
+        // 送信済みのコマンドより後に切り替える
+        strand_.post(boost::bind(&Session::DoEnableLengthPrefixedFraming, this, shared_from_this()));
+    }
+
+    void Session::DoEnableLengthPrefixedFraming(SessionPtr session_holder)
+    {
+        if (!length_prefixed_send_) {
+            SealQueuedFrames();
+            // 切り替えの通知だけは従来の形式で送る
+            QueueWriteTCP(Utils::Encode(Utils::Serialize(
+                static_cast<uint8_t>(header::LENGTH_PREFIXED_FRAMING_HEADER))), session_holder);
+            length_prefixed_send_ = true;
+        }
+    }
+
+    void Session::EnableAuthenticatedEncryption()
+    {
+        // 送信済みのコマンドより後に切り替える
+        strand_.post(boost::bind(&Session::DoEnableAuthenticatedEncryption, this, shared_from_this()));
+    }
+
+    void Session::DoEnableAuthenticatedEncryption(SessionPtr session_holder)
+    {
+        SealQueuedFrames();
+        authenticated_encryption_ = true;
+    }
+
+    void Session::Suspend(const std::function<void()>& callback)
+    {
+        strand_.post(boost::bind(&Session::DoSuspend, this, callback, shared_from_this()));
+    }
+
+    void Session::DoSuspend(std::function<void()> callback, SessionPtr session_holder)
+    {
+        suspending_ = true;
+        suspend_callback_ = callback;
+
+        // 書き込み中に受信を取り消すと書き込みも途中で止まるので、完了を待つ
+        if (writing_queue_.empty()) {
+            StopReceive();
+        }
+    }
+
+    void Session::StopReceive()
+    {
+        if (receiving_) {
+            boost::system::error_code error;
+            socket_tcp_.cancel(error);
+        }
+        CheckSuspended();
+    }
+
+    void Session::CheckSuspended()
+    {
+        if (!suspending_ || suspended_ || receiving_ || !writing_queue_.empty()) {
+            return;
+        }
+
+        suspended_ = true;
+        if (suspend_callback_) {
+            auto callback = suspend_callback_;
+            suspend_callback_ = nullptr;
+            callback();
+        }
+    }
+
+    void Session::Resume()
+    {
+        strand_.post(boost::bind(&Session::DoResume, this, shared_from_this()));
+    }
+
+    void Session::DoResume(SessionPtr session_holder)
+    {
+        suspending_ = false;
+        suspended_ = false;
+        suspend_callback_ = nullptr;
+        if (!online_) {
+            return;
+        }
+
+        if (writing_queue_.empty()) {
+            StartWriteTCP(session_holder);
+        }
+
+        // 受信バッファに残っているフレームから処理する
+        if (!receiving_) {
+            ReceiveTCP(boost::system::error_code());
+        }
+    }
+
+    std::string Session::SaveState()
+    {
+        // 鍵交換の途中の接続は引き継がない
+        if (!suspended_ || !online_ || !encryption_ || id_ <= 0) {
+            return std::string();
+        }
+
+        std::string state;
+        BinaryWriter writer(&state);
+        writer.Write(static_cast<uint32_t>(id_), channel_, global_ip_, udp_port_, capabilities_, write_average_limit_);
+        writer.Write(static_cast<uint8_t>(authenticated_encryption_),
+            static_cast<uint8_t>(length_prefixed_send_), static_cast<uint8_t>(length_prefixed_receive_));
+        writer.Write(static_cast<uint8_t>(udp_enabled_), udp_token_,
+            udp_endpoint_.address().to_string(), udp_endpoint_.port());
+        writer.Write(udp_send_sequence_, udp_receive_sequence_, static_cast<uint8_t>(udp_received_));
+
+        writer.Write(encrypter_.SaveState(), position_codec_.SaveState());
+        writer.Write(static_cast<uint8_t>(stream_compressor_ != nullptr),
+            stream_compressor_ ? stream_compressor_->SaveState() : std::string());
+        writer.Write(static_cast<uint8_t>(stream_decompressor_ != nullptr),
+            stream_decompressor_ ? stream_decompressor_->SaveState() : std::string());
+
+        // 読み込んだがまだフレームになっていないバイト列と、送信待ちのフレーム
+        writer.Write(std::string(boost::asio::buffer_cast<const char*>(receive_buf_.data()), receive_buf_.size()));
+        writer.Write(static_cast<uint32_t>(send_queue_.size()));
+        BOOST_FOREACH(const std::string& msg, send_queue_) {
+            writer.Write(msg);
+        }
+        writer.Write(static_cast<uint32_t>(seal_queue_.size()));
+        BOOST_FOREACH(const std::string& msg, seal_queue_) {
+            writer.Write(msg);
+        }
+
+        return state;
+    }
+
+    bool Session::LoadState(const std::string& state)
+    {
+        BinaryReader reader(state);
+
+        uint32_t id;
+        uint8_t authenticated_encryption, length_prefixed_send, length_prefixed_receive;
+        if (!reader.Read(&id, &channel_, &global_ip_, &udp_port_, &capabilities_, &write_average_limit_) ||
+                !reader.Read(&authenticated_encryption, &length_prefixed_send, &length_prefixed_receive)) {
+            return false;
+        }
+        id_ = id;
         encryption_ = true;
+        authenticated_encryption_ = authenticated_encryption != 0;
+        encrypted_receive_ = true;
+        length_prefixed_send_ = length_prefixed_send != 0;
+        length_prefixed_receive_ = length_prefixed_receive != 0;
+
+        uint8_t udp_enabled, udp_received;
+        std::string udp_address;
+        uint16_t udp_endpoint_port;
+        if (!reader.Read(&udp_enabled, &udp_token_, &udp_address, &udp_endpoint_port) ||
+                !reader.Read(&udp_send_sequence_, &udp_receive_sequence_, &udp_received)) {
+            return false;
+        }
+        boost::system::error_code error;
+        auto address = boost::asio::ip::address::from_string(udp_address, error);
+        if (error) {
+            return false;
+        }
+        udp_endpoint_ = udp::endpoint(address, udp_endpoint_port);
+        udp_enabled_ = udp_enabled != 0;
+        udp_received_ = udp_received != 0;
+
+        std::string encrypter_state, position_state, compressor_state, decompressor_state;
+        uint8_t compressor, decompressor;
+        if (!reader.Read(&encrypter_state, &position_state) ||
+                !reader.Read(&compressor, &compressor_state, &decompressor, &decompressor_state) ||
+                !encrypter_.LoadState(encrypter_state) || !position_codec_.LoadState(position_state)) {
+            return false;
+        }
+        if (compressor) {
+            stream_compressor_.reset(new StreamCompressor());
+            if (!stream_compressor_->LoadState(compressor_state)) {
+                return false;
+            }
+        }
+        if (decompressor) {
+            stream_decompressor_.reset(new StreamDecompressor());
+            if (!stream_decompressor_->LoadState(decompressor_state)) {
+                return false;
+            }
+        }
+
+        std::string received;
+        uint32_t send_count, seal_count;
+        if (!reader.Read(&received, &send_count)) {
+            return false;
+        }
+        receive_buf_.sputn(received.data(), received.size());
+        for (uint32_t i = 0; i < send_count; i++) {
+            send_queue_.push_back(std::string());
+            if (!reader.Read(&send_queue_.back())) {
+                return false;
+            }
+        }
+        if (!reader.Read(&seal_count)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < seal_count; i++) {
+            seal_queue_.push_back(std::string());
+            if (!reader.Read(&seal_queue_.back())) {
+                return false;
+            }
+        }
+
+        // Resume までは送受信しない
+        suspending_ = true;
+        suspended_ = true;
+        return true;
     }
 
     Encrypter& Session::encrypter()
@@ -120,6 +374,11 @@ namespace network {
         return socket_tcp_;
     }
 
+    boost::asio::io_service::strand& Session::strand()
+    {
+        return strand_;
+    }
+
     UserID Session::id() const
     {
         return id_;
@@ -130,6 +389,16 @@ namespace network {
         id_ = id;
     }
 
+    UserID Session::pending_id() const
+    {
+        return pending_id_;
+    }
+
+    void Session::set_pending_id(UserID id)
+    {
+        pending_id_ = id;
+    }
+
 	unsigned char Session::channel() const
 	{
 		return channel_;
@@ -159,6 +428,91 @@ namespace network {
         global_ip_ = global_ip;
     }
 
+    bool Session::udp_enabled() const
+    {
+        return udp_enabled_;
+    }
+
+    void Session::set_udp_enabled(bool enabled)
+    {
+        // UDP で送る間は差分の基準が更新されないので、切り替えのたびに捨てる
+        if (udp_enabled_ != enabled) {
+            position_codec_.ResetAll();
+        }
+        udp_enabled_ = enabled;
+    }
+
+    uint32_t Session::udp_token() const
+    {
+        return udp_token_;
+    }
+
+    void Session::set_udp_token(uint32_t token)
+    {
+        udp_token_ = token;
+    }
+
+    uint32_t Session::capabilities() const
+    {
+        return capabilities_;
+    }
+
+    void Session::set_capabilities(uint32_t capabilities)
+    {
+        capabilities_ = capabilities;
+    }
+
+    bool Session::account_synced() const
+    {
+        return account_synced_;
+    }
+
+    void Session::set_account_synced(bool synced)
+    {
+        account_synced_ = synced;
+    }
+
+    const udp::endpoint& Session::udp_endpoint() const
+    {
+        return udp_endpoint_;
+    }
+
+    void Session::set_udp_endpoint(const udp::endpoint& endpoint)
+    {
+        udp_endpoint_ = endpoint;
+    }
+
+    PositionCodec& Session::position_codec()
+    {
+        return position_codec_;
+    }
+
+    uint16_t Session::NextUDPSequence()
+    {
+        return ++udp_send_sequence_;
+    }
+
+    bool Session::AcceptUDPSequence(uint16_t sequence)
+    {
+        // 一周しても比較できるように差分の符号で判定する
+        if (udp_received_ && static_cast<int16_t>(sequence - udp_receive_sequence_) <= 0) {
+            return false;
+        }
+        udp_received_ = true;
+        udp_receive_sequence_ = sequence;
+        return true;
+    }
+
+    bool Session::AcceptUDPSequence(uint16_t sequence, UserID player_id)
+    {
+        auto it = udp_player_sequences_.find(player_id);
+        if (it != udp_player_sequences_.end() && static_cast<int16_t>(sequence - it->second) <= 0) {
+            return false;
+        }
+        udp_player_sequences_[player_id] = sequence;
+        return true;
+    }
+
     void Session::set_udp_port(uint16_t udp_port)
     {
         udp_port_ = udp_port;
@@ -194,50 +548,231 @@ namespace network {
 		write_average_limit_ = limit;
 	}
 
-    std::string Session::Serialize(const Command& command, bool plain)
+    int Session::flush_window() const
     {
-        assert(command.header() < 0xFF);
-        auto header = static_cast<uint8_t>(command.header());
-        std::string body = command.body();
+        return flush_window_;
+    }
 
-        std::string msg = Utils::Serialize(header) + body;
+    void Session::set_flush_window(int msec)
+    {
+        flush_window_ = msec;
+    }
+
+    uint64_t Session::write_count() const
+    {
+        return write_count_;
+    }
 
+    uint64_t Session::written_frame_count() const
+    {
+        return written_frame_count_;
+    }
+
+    uint64_t Session::written_byte_count() const
+    {
+        return written_byte_count_;
+    }
+
+    double Session::frames_per_write() const
+    {
+        return write_count_ > 0 ? 1.0 * written_frame_count_ / write_count_ : 0;
+    }
+
+    double Session::bytes_per_write() const
+    {
+        return write_count_ > 0 ? 1.0 * written_byte_count_ / write_count_ : 0;
+    }
+
+    std::string Session::Serialize(const Command& command, bool plain)
+    {
 		if (plain) {
+			assert(command.header() < 0xFF);
+			auto header = static_cast<uint8_t>(command.header());
+			std::string msg = Utils::Serialize(header) + command.body();
+
 			auto length = Utils::Serialize(static_cast<unsigned int>(msg.size()));
 			return length + msg;
 		} else {
-			// 圧縮
-			if (body.size() >= COMPRESS_MIN_LENGTH) {
-				auto compressed = Utils::LZ4Compress(msg);
-				if (msg.size() > compressed.size() + sizeof(uint8_t)) {
-					assert(msg.size() < 65535);
-					msg = Utils::Serialize(static_cast<uint8_t>(header::LZ4_COMPRESS_HEADER),
-						static_cast<uint16_t>(msg.size()))
-						+ compressed;
-				}
+			return Seal(Prepare(command));
+		}
+
+    }
+
+    std::string Session::Prepare(const Command& command)
+    {
+		if (stream_compressor_) {
+			// 履歴を使って圧縮するので、ここでは単体で圧縮しない
+			assert(command.header() < 0xFF);
+			auto header = static_cast<uint8_t>(command.header());
+			return Utils::Serialize(header) + command.body();
+		} else {
+			return Compose(command)->data();
+		}
+    }
+
+    FramePtr Session::Compose(const Command& command)
+    {
+        assert(command.header() < 0xFF);
+        auto header = static_cast<uint8_t>(command.header());
+        const std::string& body = command.body();
+
+        auto frame = boost::make_shared<SharedFrame>();
+        std::string& msg = frame->plain;
+        msg = Utils::Serialize(header) + body;
+
+		// 圧縮
+		if (body.size() >= COMPRESS_MIN_LENGTH) {
+			auto compressed = Utils::LZ4Compress(msg);
+			if (msg.size() > compressed.size() + sizeof(uint8_t)) {
+				assert(msg.size() < 65535);
+				frame->compressed = Utils::Serialize(static_cast<uint8_t>(header::LZ4_COMPRESS_HEADER),
+					static_cast<uint16_t>(msg.size()))
+					+ compressed;
 			}
+		}
+
+		return frame;
+    }
 
-			// 暗号化
-			if (encryption_) {
-				msg = Utils::Serialize(static_cast<uint8_t>(header::ENCRYPT_HEADER))
-					+ encrypter_.Encrypt(msg);
+    std::string Session::Seal(const std::string& frame)
+    {
+		// 接続ごとの履歴を使って圧縮
+		std::string compressed;
+		if (stream_compressor_) {
+			compressed = StreamCompress(frame);
+			if (compressed.empty()) {
+				return std::string();
 			}
-			return Utils::Encode(msg);
 		}
+		const std::string& msg = stream_compressor_ ? compressed : frame;
+
+		// 暗号化
+		if (encryption_) {
+			std::string out;
+			SealFrame(msg, &out);
+			return out;
+		} else {
+			return Frame(msg);
+		}
+    }
+
+    size_t Session::SealedSize(size_t size) const
+    {
+        return sizeof(uint8_t) + size + (authenticated_encryption_ ? ENCRYPTER_TAG_SIZE : 0);
+    }
 
+    void Session::SealFrame(const std::string& msg, std::string* out)
+    {
+        const size_t sealed_size = SealedSize(msg.size());
+
+        // 長さを前置する場合は出力先に平文を書き、その場で暗号化する
+        // 区切り文字の場合は暗号文をエスケープするので、作業用のバッファで暗号化する
+        std::string* buffer = &seal_buffer_;
+        size_t offset = 0;
+        if (length_prefixed_send_) {
+            out->append(Utils::SerializeVarint(sealed_size));
+            buffer = out;
+            offset = out->size();
+        }
+
+        buffer->resize(offset + sealed_size);
+        char* sealed = &(*buffer)[offset];
+        std::memcpy(sealed + 1, msg.data(), msg.size());
+        if (authenticated_encryption_) {
+            sealed[0] = static_cast<char>(header::ENCRYPT_GCM_HEADER);
+            encrypter_.SealInPlace(sealed + 1, msg.size(), sealed + 1 + msg.size());
+        } else {
+            sealed[0] = static_cast<char>(header::ENCRYPT_HEADER);
+            encrypter_.EncryptInPlace(sealed + 1, msg.size());
+        }
+
+        if (!length_prefixed_send_) {
+            out->append(Utils::Encode(seal_buffer_));
+        }
     }
 
-    Command Session::Deserialize(const std::string& msg)
+    std::string Session::Frame(const std::string& msg)
     {
-        std::string decoded_msg = Utils::Decode(msg);
+        if (length_prefixed_send_) {
+            return Utils::SerializeVarint(msg.size()) + msg;
+        } else {
+            return Utils::Encode(msg);
+        }
+    }
+
+    std::string Session::StreamCompress(const std::string& msg)
+    {
+        std::string out = Utils::Serialize(static_cast<uint8_t>(header::LZ4_STREAM_COMPRESS_HEADER))
+            + Utils::SerializeVarint(msg.size());
+        out.reserve(out.size() + msg.size());
+
+        // 履歴が相手とずれるので、失敗した場合は接続を切って何も送らない
+        if (!stream_compressor_->Compress(msg.data(), msg.size(), &out)) {
+            Logger::Error(_T("Stream compression failed"));
+            Close();
+            return std::string();
+        }
+        return out;
+    }
+
+    Command Session::Deserialize(const char* data, size_t size)
+    {
+        std::string decoded_msg = length_prefixed_receive_ ?
+            std::string(data, size) : Utils::Decode(data, size);
 
         uint8_t header;
         Utils::Deserialize(decoded_msg, &header);
 
         // 復号
         if (header == header::ENCRYPT_HEADER) {
+            encrypter_.DecryptInPlace(&decoded_msg[sizeof(header)], decoded_msg.size() - sizeof(header));
             decoded_msg.erase(0, sizeof(header));
-            decoded_msg = encrypter_.Decrypt(decoded_msg);
+            Utils::Deserialize(decoded_msg, &header);
+            encrypted_receive_ = true;
+        } else if (header == header::ENCRYPT_GCM_HEADER) {
+            // 改ざんされたフレームは以降の nonce もずれるので接続を切る
+            const size_t size = decoded_msg.size() - sizeof(header) - ENCRYPTER_TAG_SIZE;
+            if (decoded_msg.size() <= sizeof(header) + ENCRYPTER_TAG_SIZE ||
+                    !encrypter_.OpenInPlace(&decoded_msg[sizeof(header)], size,
+                        decoded_msg.data() + sizeof(header) + size)) {
+                Logger::Error(_T("Message authentication failed"));
+                FatalError();
+                Close();
+                return FatalConnectionError();
+            }
+            decoded_msg.resize(sizeof(header) + size);
+            decoded_msg.erase(0, sizeof(header));
+            Utils::Deserialize(decoded_msg, &header);
+            encrypted_receive_ = true;
+        } else if (encrypted_receive_) {
+            // 暗号化の後に混ぜられた平文は第三者のものとみなして接続を切る
+            Logger::Error(_T("Plaintext frame after encryption"));
+            FatalError();
+            Close();
+            return FatalConnectionError();
+        }
+
+        // 接続ごとの履歴を使って伸長
+        if (header == header::LZ4_STREAM_COMPRESS_HEADER) {
+            if (!stream_decompressor_) {
+                stream_decompressor_.reset(new StreamDecompressor());
+            }
+
+            uint32_t original_size = 0;
+            size_t read = Utils::DeserializeVarint(decoded_msg.data() + sizeof(header),
+                    decoded_msg.size() - sizeof(header), &original_size);
+            size_t offset = sizeof(header) + read;
+
+            std::string msg;
+            if (read == 0 || !stream_decompressor_->Uncompress(decoded_msg.data() + offset,
+                    decoded_msg.size() - offset, original_size, &msg) || msg.empty()) {
+                // 以降のメッセージも伸長できないので接続を切る
+                Logger::Error(_T("Stream decompression failed"));
+                FatalError();
+                Close();
+                return FatalConnectionError();
+            }
+            decoded_msg.swap(msg);
             Utils::Deserialize(decoded_msg, &header);
         }
 
@@ -255,91 +790,246 @@ namespace network {
 		return Command(static_cast<header::CommandHeader>(header), body, shared_from_this());
     }
 
+    void Session::Receive()
+    {
+        receiving_ = true;
+        if (length_prefixed_receive_) {
+            boost::asio::async_read(socket_tcp_,
+                receive_buf_, boost::asio::transfer_at_least(1),
+                strand_.wrap(boost::bind(
+                  &Session::ReceiveTCP, shared_from_this(),
+                  boost::asio::placeholders::error)));
+        } else {
+            boost::asio::async_read_until(socket_tcp_,
+                receive_buf_, NETWORK_UTILS_DELIMITOR,
+                strand_.wrap(boost::bind(
+                  &Session::ReceiveTCP, shared_from_this(),
+                  boost::asio::placeholders::error)));
+        }
+    }
+
     void Session::ReceiveTCP(const boost::system::error_code& error)
     {
+        receiving_ = false;
         if (!error) {
-            std::string buffer(boost::asio::buffer_cast<const char*>(receive_buf_.data()),receive_buf_.size());
-            auto length = buffer.find_last_of(NETWORK_UTILS_DELIMITOR);
+            // 受信バッファをコピーせずに走査し、区切り文字ごとにフレームを取り出す
+            const char* buffer = boost::asio::buffer_cast<const char*>(receive_buf_.data());
+            const size_t buffer_size = receive_buf_.size();
+
+            size_t begin = 0;
+            while (begin < buffer_size) {
+                if (length_prefixed_receive_) {
+                    // 長さを読んで本体をそのまま切り出す
+                    uint32_t length = 0;
+                    size_t read = Utils::DeserializeVarint(buffer + begin, buffer_size - begin, &length);
+                    if ((read == 0 && buffer_size - begin >= 5) || length > FRAME_MAX_LENGTH) {
+                        Logger::Error(_T("Invalid frame length"));
+                        FatalError();
+                        Close();
+                        CheckSuspended();
+                        return;
+                    }
+
+                    // 長さか本体が届いていないフレームは次の受信に持ち越す
+                    if (read == 0 || buffer_size - begin - read < length) {
+                        break;
+                    }
 
-            if (length != std::string::npos) {
+                    read_byte_sum_ += length;
+                    UpdateReadByteAverage();
 
-                receive_buf_.consume(length+1);
-                buffer.erase(length+1);
+                    FetchTCP(buffer + begin + read, length);
+                    begin += read + length;
 
-                while (!buffer.empty()) {
-                    std::string msg;
-					msg.reserve(buffer.size());
+                } else {
+                    const char* end = static_cast<const char*>(
+                        std::memchr(buffer + begin, NETWORK_UTILS_DELIMITOR, buffer_size - begin));
 
-                    while (!buffer.empty() && buffer[0]!=NETWORK_UTILS_DELIMITOR)
-                    {
-                        msg += buffer[0];
-                        buffer.erase(0,1);
+                    // 区切り文字が届いていないフレームは次の受信に持ち越す
+                    if (!end) {
+                        break;
                     }
-                    buffer.erase(0,1);
 
-                    read_byte_sum_ += msg.size();
+                    size_t length = end - (buffer + begin);
+                    read_byte_sum_ += length;
                     UpdateReadByteAverage();
 
-                    FetchTCP(msg);
+                    // 相手が長さを前置したフレームに切り替えた
+                    if (length == 1 && static_cast<uint8_t>(buffer[begin]) == header::LENGTH_PREFIXED_FRAMING_HEADER) {
+                        length_prefixed_receive_ = true;
+                    } else {
+                        FetchTCP(buffer + begin, length);
+                    }
+                    begin += length + 1;
                 }
+            }
+            receive_buf_.consume(begin);
 
-                boost::asio::async_read_until(socket_tcp_,
-                    receive_buf_, NETWORK_UTILS_DELIMITOR,
-                    boost::bind(
-                      &Session::ReceiveTCP, shared_from_this(),
-                      boost::asio::placeholders::error));
+            // 引き継ぎのために止める場合は次を受信しない
+            if (suspending_) {
+                CheckSuspended();
+                return;
+            }
+            Receive();
 
+        } else {
+            if (!suspending_ || error != boost::asio::error::operation_aborted) {
+                FatalError();
             }
+            CheckSuspended();
+        }
+    }
 
+    void Session::DoWriteTCP(const Command command, SessionPtr session_holder)
+    {
+        // 暗号化する場合は圧縮までにして、暗号化は書き込みの直前にまとめて行う
+        if (encryption_ && !command.plain()) {
+            const std::string frame = Prepare(command);
+            QueueWriteTCP(stream_compressor_ ? StreamCompress(frame) : frame, session_holder, false);
         } else {
-            FatalError();
+            QueueWriteTCP(Serialize(command, command.plain()), session_holder);
+        }
+    }
+
+    void Session::DoWriteFrame(FramePtr frame, SessionPtr session_holder)
+    {
+        // 履歴で圧縮する場合は、単体で圧縮したものを展開せずに元のフレームを使う
+        const std::string& msg = stream_compressor_ ? frame->plain : frame->data();
+        if (encryption_) {
+            QueueWriteTCP(stream_compressor_ ? StreamCompress(msg) : msg, session_holder, false);
+        } else {
+            QueueWriteTCP(Seal(msg), session_holder);
+        }
+    }
+
+    void Session::QueueWriteTCP(const std::string& msg, SessionPtr session_holder, bool sealed)
+    {
+        // 圧縮に失敗して接続を切った
+        if (msg.empty()) {
+            return;
+        }
+
+        write_byte_sum_ += sealed ? msg.size() : SealedSize(msg.size());
+        UpdateWriteByteAverage();
+
+		Logger::Debug(_T("%d byte/s"), GetWriteByteAverage());
+
+        if (sealed) {
+            send_queue_.push_back(msg);
+        } else {
+            seal_queue_.push_back(msg);
+        }
+
+        // 送信中なら完了後にまとめて送る
+        if (!writing_queue_.empty() || flush_scheduled_) {
+            return;
+        }
+
+        if (flush_window_ > 0) {
+            flush_scheduled_ = true;
+            flush_timer_.expires_from_now(boost::posix_time::milliseconds(flush_window_));
+            flush_timer_.async_wait(strand_.wrap(boost::bind(&Session::FlushTCP, this,
+                boost::asio::placeholders::error, session_holder)));
+        } else {
+            StartWriteTCP(session_holder);
+        }
+    }
+
+    void Session::FlushTCP(const boost::system::error_code& error, SessionPtr session_holder)
+    {
+        flush_scheduled_ = false;
+        if (writing_queue_.empty()) {
+            StartWriteTCP(session_holder);
         }
     }
 
-    void Session::DoWriteTCP(const std::string msg, SessionPtr session_holder)
+    void Session::StartWriteTCP(SessionPtr session_holder)
     {
-        bool write_in_progress = !send_queue_.empty();
-        send_queue_.push(msg);
-        if (!write_in_progress && !send_queue_.empty())
-        {
-           
-          auto s = boost::make_shared<std::string>(msg.data(), msg.size());
+        if (suspending_ || (send_queue_.empty() && seal_queue_.empty())) {
+            return;
+        }
 
-          boost::asio::async_write(socket_tcp_,
-              boost::asio::buffer(s->data(), s->size()),
-              boost::bind(&Session::WriteTCP, this,
-                boost::asio::placeholders::error, s, session_holder));
+        // 溜まっているフレームを一度の書き込みで送る
+        writing_queue_.reserve(send_queue_.size() + 1);
+        BOOST_FOREACH(std::string& msg, send_queue_) {
+            writing_queue_.push_back(std::string());
+            writing_queue_.back().swap(msg);
+        }
+        writing_frame_count_ = send_queue_.size() + seal_queue_.size();
+        send_queue_.clear();
+
+        // 切り替え前に封をしたフレームより後に、まとめて暗号化して続ける
+        if (!seal_queue_.empty()) {
+            size_t size = 0;
+            BOOST_FOREACH(const std::string& msg, seal_queue_) {
+                size += SealedSize(msg.size()) + sizeof(uint32_t);
+            }
+            writing_queue_.push_back(std::string());
+            std::string& sealed = writing_queue_.back();
+            sealed.reserve(length_prefixed_send_ ? size : size + size / 4);
+            BOOST_FOREACH(const std::string& msg, seal_queue_) {
+                SealFrame(msg, &sealed);
+            }
+            seal_queue_.clear();
         }
+
+        std::vector<boost::asio::const_buffer> buffers;
+        buffers.reserve(writing_queue_.size());
+        BOOST_FOREACH(const std::string& msg, writing_queue_) {
+            buffers.push_back(boost::asio::buffer(msg.data(), msg.size()));
+        }
+
+        boost::asio::async_write(socket_tcp_, buffers,
+            strand_.wrap(boost::bind(&Session::WriteTCP, this,
+              boost::asio::placeholders::error,
+              boost::asio::placeholders::bytes_transferred, session_holder)));
+    }
+
+    void Session::SealQueuedFrames()
+    {
+        // 方式を切り替える前に、溜まっているフレームを今の方式で封をする
+        BOOST_FOREACH(const std::string& msg, seal_queue_) {
+            send_queue_.push_back(std::string());
+            SealFrame(msg, &send_queue_.back());
+        }
+        seal_queue_.clear();
     }
 
     void Session::WriteTCP(const boost::system::error_code& error,
-		boost::shared_ptr<std::string> holder, SessionPtr session_holder)
+		size_t bytes_transferred, SessionPtr session_holder)
     {
         if (!error) {
-            if (!send_queue_.empty()) {
-                  send_queue_.pop();
-                  if (!send_queue_.empty())
-                  {
-
-                    boost::shared_ptr<std::string> s = 
-                        boost::make_shared<std::string>(send_queue_.front().data(), send_queue_.front().size());
-
-                    boost::asio::async_write(socket_tcp_,
-                        boost::asio::buffer(s->data(), s->size()),
-                        boost::bind(&Session::WriteTCP, this,
-                          boost::asio::placeholders::error, s, session_holder));
-                  }
+            write_count_++;
+            written_frame_count_ += writing_frame_count_;
+            written_byte_count_ += bytes_transferred;
+
+            writing_queue_.clear();
+
+            // 引き継ぎのために止める場合は、書き込みが終わってから受信を止める
+            if (suspending_) {
+                StopReceive();
+                return;
             }
+            StartWriteTCP(session_holder);
         } else {
+            writing_queue_.clear();
             FatalError(session_holder);
+            if (suspending_) {
+                StopReceive();
+            }
         }
     }
 
-    void Session::FetchTCP(const std::string& msg)
+    void Session::FetchTCP(const char* data, size_t size)
     {
-        if (msg.size() >= sizeof(uint8_t)) {
+        if (size >= sizeof(uint8_t)) {
             if (on_receive_) {
-                (*on_receive_)(Deserialize(msg));
+                Command command = Deserialize(data, size);
+
+                // 伸長に失敗して切断した場合は通知しない
+                if (online_) {
+                    (*on_receive_)(command);
+                }
             }
         } else {
             Logger::Error(_T("Too short data"));
@@ -352,7 +1042,9 @@ namespace network {
             online_ = false;
             if (on_receive_) {
                 if (id_ > 0) {
-                    (*on_receive_)(UserFatalConnectionError(id_));
+                    // 同じユーザーが再接続している場合に区別できるよう、セッションを付ける
+                    (*on_receive_)(Command(header::UserFatalConnectionError,
+                        Utils::Serialize(static_cast<uint32_t>(id_)), shared_from_this()));
                 } else {
                     (*on_receive_)(FatalConnectionError());
                 }
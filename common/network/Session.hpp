@@ -11,14 +11,20 @@
 #include <boost/timer.hpp>
 #include <stdint.h>
 #include <string>
-#include <queue>
+#include <deque>
+#include <vector>
+#include <unordered_map>
 #include <memory>
 #include "Encrypter.hpp"
 #include "Command.hpp"
+#include "PositionCodec.hpp"
+#include "StreamCompressor.hpp"
 
 #define BYTE_AVERAGE_REFRESH_SECONDS (30)
 #define COMPRESSED_FLAG (0x00010000)
 #define COMPRESS_MIN_LENGTH (100)
+#define UDP_TEST_PACKET "MMO UDP Test Packet"
+#define FRAME_MAX_LENGTH (1 << 24)
 
 namespace network {
 
@@ -32,6 +38,16 @@ namespace network {
     typedef boost::weak_ptr<Session> SessionWeakPtr;
     typedef boost::shared_ptr<Session> SessionPtr;
 
+    // 暗号化前のフレーム 複数のセッションで共有する
+    // 接続ごとの履歴で圧縮するセッションは、単体で圧縮する前の plain を使う
+    struct SharedFrame {
+        std::string plain;          // ヘッダと本文
+        std::string compressed;     // 単体で圧縮したもの 小さくならない場合は空
+
+        const std::string& data() const { return compressed.empty() ? plain : compressed; }
+    };
+    typedef boost::shared_ptr<const SharedFrame> FramePtr;
+
     class Session : public boost::enable_shared_from_this<Session> {
         public:
             Session(boost::asio::io_service& io_service_tcp);
@@ -40,11 +56,34 @@ namespace network {
             virtual void Start() = 0;
             virtual void Close();
             void Send(const Command&);
+            void Send(const FramePtr&);
             void SyncSend(const Command&);
             void UDPSend(const Command&);
 
             void EnableEncryption();
 
+            // 以降の送信を接続ごとの履歴を使って圧縮する
+            void EnableStreamCompression();
+
+            // 以降の送信を区切り文字ではなく長さを前置したフレームで行う
+            void EnableLengthPrefixedFraming();
+
+            // 以降の送信を AES-GCM で暗号化する 受信はフレームのヘッダで判別する
+            void EnableAuthenticatedEncryption();
+
+            // 別のプロセスに引き継ぐために送受信を止める
+            // 書き込み中のフレームを送り終えて受信を止めたら、ストランド上で callback を呼ぶ
+            // 送信待ちのフレームは送らずに残し、SaveState に含める
+            void Suspend(const std::function<void()>& callback);
+
+            // 止めた送受信を再開する 引き継いだ側は LoadState の後に呼ぶ
+            void Resume();
+
+            // 引き継ぎに必要な接続ごとの状態 Suspend で止まった後に呼ぶ
+            // 止まっていないか、鍵交換が終わっていない場合は空文字列
+            std::string SaveState();
+            bool LoadState(const std::string& state);
+
             double GetReadByteAverage() const;
             double GetWriteByteAverage() const;
 
@@ -52,12 +91,17 @@ namespace network {
 			void ResetWriteByteAverage();
 
             tcp::socket& tcp_socket();
+            boost::asio::io_service::strand& strand();
             Encrypter& encrypter();
 
             void set_on_receive(CallbackFuncPtr);
 
             UserID id() const;
             void set_id(UserID id);
+
+            // 鍵交換の相手のユーザーID 鍵の確認が終わるまでは id() は 0 のまま
+            UserID pending_id() const;
+            void set_pending_id(UserID id);
             bool online() const;
 
 			unsigned char channel() const;
@@ -68,28 +112,87 @@ namespace network {
             void set_global_ip(const std::string& global_ip);
             void set_udp_port(uint16_t udp_port);
 
+            // 位置情報をUDPで送受信する
+            bool udp_enabled() const;
+            void set_udp_enabled(bool enabled);
+            uint32_t udp_token() const;
+            void set_udp_token(uint32_t token);
+            const udp::endpoint& udp_endpoint() const;
+            void set_udp_endpoint(const udp::endpoint& endpoint);
+
+            // ServerReceiveCapabilities で有効になった機能
+            uint32_t capabilities() const;
+            void set_capabilities(uint32_t capabilities);
+
+            // 参加の前に ServerRequestedAccountChanges で変更を受け取ったか
+            bool account_synced() const;
+            void set_account_synced(bool synced);
+
+            // 位置情報の差分の基準
+            PositionCodec& position_codec();
+
+            uint16_t NextUDPSequence();
+            // 前回より古いシーケンス番号なら false
+            bool AcceptUDPSequence(uint16_t sequence);
+            // 複数のプレイヤーを含むパケット用 プレイヤーごとに前回と比べる
+            bool AcceptUDPSequence(uint16_t sequence, UserID player_id);
+
             int serialized_byte_sum() const;
             int compressed_byte_sum() const;
 
 			int write_average_limit() const;
 			void set_write_average_limit(int limit);
 
+            // 送信をまとめるために待つ時間(ミリ秒) 0で即時送信
+            int flush_window() const;
+            void set_flush_window(int msec);
+
+            // 送信システムコールあたりの統計
+            uint64_t write_count() const;
+            uint64_t written_frame_count() const;
+            uint64_t written_byte_count() const;
+            double frames_per_write() const;
+            double bytes_per_write() const;
+
             bool operator==(const Session&);
             bool operator!=(const Session&);
 
+            // ヘッダの付加と圧縮までを行う
+            static FramePtr Compose(const Command& command);
+
         protected:
             void UpdateReadByteAverage();
             void UpdateWriteByteAverage();
 
             std::string Serialize(const Command& command, bool plain);
-            Command Deserialize(const std::string& msg);
-
+            std::string Prepare(const Command& command);
+            std::string Seal(const std::string& frame);
+            size_t SealedSize(size_t size) const;
+            void SealFrame(const std::string& msg, std::string* out);
+            void SealQueuedFrames();
+            std::string StreamCompress(const std::string& msg);
+            std::string Frame(const std::string& msg);
+            Command Deserialize(const char* data, size_t size);
+
+            void Receive();
             void ReceiveTCP(const boost::system::error_code& error);
-            void DoWriteTCP(const std::string, SessionPtr session_holder);
+            void DoWriteTCP(const Command command, SessionPtr session_holder);
+            void DoWriteFrame(FramePtr frame, SessionPtr session_holder);
+            void QueueWriteTCP(const std::string& msg, SessionPtr session_holder, bool sealed = true);
+            void FlushTCP(const boost::system::error_code& error, SessionPtr session_holder);
+            void StartWriteTCP(SessionPtr session_holder);
             void WriteTCP(const boost::system::error_code& error,
-					 boost::shared_ptr<std::string> holder, SessionPtr session_holder);
-            void FetchTCP(const std::string&);
-
+					 size_t bytes_transferred, SessionPtr session_holder);
+            void FetchTCP(const char* data, size_t size);
+
+            void DoEnableEncryption(SessionPtr session_holder);
+            void DoEnableStreamCompression(SessionPtr session_holder);
+            void DoEnableLengthPrefixedFraming(SessionPtr session_holder);
+            void DoEnableAuthenticatedEncryption(SessionPtr session_holder);
+            void DoSuspend(std::function<void()> callback, SessionPtr session_holder);
+            void DoResume(SessionPtr session_holder);
+            void StopReceive();
+            void CheckSuspended();
             void FatalError(SessionPtr session_holder = SessionPtr());
 
         protected:
@@ -97,13 +200,50 @@ namespace network {
             boost::asio::io_service& io_service_tcp_;
             tcp::socket socket_tcp_;
 
+            // セッション内のハンドラを直列化
+            boost::asio::io_service::strand strand_;
+
             // 暗号化通信
             Encrypter encrypter_;
             bool encryption_;
+            bool authenticated_encryption_;
+
+            // 暗号化されたフレームを受信した後は平文のフレームを受け付けない
+            bool encrypted_receive_;
+
+            // 接続ごとの履歴を使った圧縮 伸長側は最初に受信したときに作る
+            std::unique_ptr<StreamCompressor> stream_compressor_;
+            std::unique_ptr<StreamDecompressor> stream_decompressor_;
+
+            // 長さを前置したフレーム 受信側は相手からの切り替えの通知で有効になる
+            bool length_prefixed_send_;
+            bool length_prefixed_receive_;
 
             // 送受信のためのバッファ
             boost::asio::streambuf receive_buf_;
-            std::queue<std::string> send_queue_;
+            bool receiving_;
+
+            // 引き継ぎのための停止
+            bool suspending_;
+            bool suspended_;
+            std::function<void()> suspend_callback_;
+
+            // 送信待ちのフレームと送信中のフレーム
+            std::deque<std::string> send_queue_;
+            std::vector<std::string> writing_queue_;
+            size_t writing_frame_count_;
+
+            // AES-GCM で送るフレーム 書き込みの直前に1つのバッファの中でまとめて暗号化する
+            std::deque<std::string> seal_queue_;
+            std::string seal_buffer_;
+
+            boost::asio::deadline_timer flush_timer_;
+            int flush_window_;
+            bool flush_scheduled_;
+
+            uint64_t write_count_;
+            uint64_t written_frame_count_;
+            uint64_t written_byte_count_;
 
             CallbackFuncPtr on_receive_;
 
@@ -111,6 +251,19 @@ namespace network {
             std::string global_ip_;
             uint16_t udp_port_;
 
+            bool udp_enabled_;
+            uint32_t udp_token_;
+            udp::endpoint udp_endpoint_;
+            uint16_t udp_send_sequence_;
+            uint16_t udp_receive_sequence_;
+            bool udp_received_;
+            std::unordered_map<UserID, uint16_t> udp_player_sequences_;
+
+            uint32_t capabilities_;
+            bool account_synced_;
+
+            PositionCodec position_codec_;
+
             bool online_;
             bool login_;
 
@@ -121,6 +274,7 @@ namespace network {
 			int write_average_limit_;
 
             UserID id_;
+            UserID pending_id_;
 			unsigned char channel_;
     };
 
@@ -0,0 +1,151 @@
+//
+// StreamCompressor.cpp
+//
+
+#include "StreamCompressor.hpp"
+#include "lz4/lz4.h"
+#include <cstring>
+#include <algorithm>
+
+#define STREAM_COMPRESS_MAX_LENGTH (1 << 24)
+
+namespace network {
+
+namespace {
+
+// よく使われるJSONのキーやモデル名 後ろにあるものほど近い距離で参照できる
+const char STREAM_COMPRESSION_DICTIONARY[] =
+    "\"stage\":\"\",\"name\":\"\",\"trip\":\"\",\"channel\":"
+    "\"char:\xe5\x88\x9d\xe9\x9f\xb3\xe3\x83\x9f\xe3\x82\xaf\""                   // 初音ミク
+    "\"char:\xe3\x82\xa2\xe3\x83\xb3\xe3\x83\x8e\xe3\x82\xa6\xe3\x83\xb3:"
+        "\xe3\x81\x8a\xe3\x81\xbc\xe3\x82\x8d(\xe3\x81\xb8\xe3\x81\x86\xe3\x81\x92\xe3\x82\x82\xe3\x82\x93)\xe5\xbc\x8f\"" // アンノウン:おぼろ(へうげもん)式
+    "\"stage:\xe3\x82\xb1\xe3\x83\xad\xe3\x83\xaa\xe3\x83\xb3\xe7\x94\xba\""     // ケロリン町
+    "\"stage:\xe3\x82\xb2\xe3\x82\xad\xe3\x83\x89\xe8\xa1\x97\""                 // ゲキド街
+    "{\"type\":\"system\",\"system\":\"\"}"
+    "{\"type\":\"chat\",\"private\":[],\"body\":\"\"}"
+    "{\"type\":\"chat\",\"body\":\"\"}"
+    "{\"id\":\"\",\"time\":\"2013-01-01T00:00:00\"}";
+
+}
+
+const std::string& GetStreamCompressionDictionary()
+{
+    static const std::string dictionary(STREAM_COMPRESSION_DICTIONARY,
+            sizeof(STREAM_COMPRESSION_DICTIONARY) - 1);
+    return dictionary;
+}
+
+StreamCompressor::StreamCompressor() :
+    stream_(LZ4_createStream())
+{
+    const std::string& dictionary = GetStreamCompressionDictionary();
+    if (stream_) {
+        LZ4_loadDict(stream_, dictionary.data(), dictionary.size());
+    }
+}
+
+StreamCompressor::~StreamCompressor()
+{
+    LZ4_freeStream(stream_);
+}
+
+bool StreamCompressor::Compress(const char* data, size_t size, std::string* out)
+{
+    if (!stream_ || size > STREAM_COMPRESS_MAX_LENGTH) {
+        return false;
+    }
+
+    // 出力先は使い回す
+    const size_t bound = LZ4_compressBound(size);
+    if (buffer_.size() < bound) {
+        buffer_.resize(bound);
+    }
+
+    int compressed_size = LZ4_compress_continue(stream_, data, buffer_.data(), size, bound);
+    if (compressed_size <= 0) {
+        return false;
+    }
+
+    out->append(buffer_.data(), compressed_size);
+    return true;
+}
+
+std::string StreamCompressor::SaveState() const
+{
+    if (!stream_) {
+        return std::string();
+    }
+
+    std::string history(LZ4_STREAM_HISTORY, '\0');
+    history.resize(LZ4_saveDict(stream_, &history[0], history.size()));
+    return history;
+}
+
+bool StreamCompressor::LoadState(const std::string& state)
+{
+    if (!stream_ || state.size() > LZ4_STREAM_HISTORY) {
+        return false;
+    }
+    return LZ4_loadDict(stream_, state.data(), state.size()) == static_cast<int>(state.size());
+}
+
+StreamDecompressor::StreamDecompressor() :
+    length_(0),
+    broken_(false)
+{
+    const std::string& dictionary = GetStreamCompressionDictionary();
+    const size_t size = std::min<size_t>(dictionary.size(), LZ4_STREAM_HISTORY);
+    history_.assign(dictionary.end() - size, dictionary.end());
+    length_ = size;
+}
+
+bool StreamDecompressor::Uncompress(const char* data, size_t size, size_t original_size, std::string* out)
+{
+    if (broken_ || original_size > STREAM_COMPRESS_MAX_LENGTH) {
+        broken_ = true;
+        return false;
+    }
+
+    // 参照される範囲の履歴だけを残して前に詰める
+    if (length_ + original_size > history_.size()) {
+        const size_t keep = std::min<size_t>(length_, LZ4_STREAM_HISTORY);
+        if (length_ > keep) {
+            std::memmove(history_.data(), history_.data() + length_ - keep, keep);
+            length_ = keep;
+        }
+        if (length_ + original_size > history_.size()) {
+            history_.resize(LZ4_STREAM_HISTORY + std::max<size_t>(original_size, LZ4_STREAM_HISTORY));
+        }
+    }
+
+    char* dest = history_.data() + length_;
+    const size_t prefix_size = std::min<size_t>(length_, LZ4_STREAM_HISTORY);
+    int result = LZ4_uncompress_withPrefix(data, dest, size, original_size, prefix_size);
+    if (result < 0 || static_cast<size_t>(result) != original_size) {
+        broken_ = true;
+        return false;
+    }
+
+    length_ += original_size;
+    out->assign(dest, original_size);
+    return true;
+}
+
+std::string StreamDecompressor::SaveState() const
+{
+    const size_t size = std::min<size_t>(length_, LZ4_STREAM_HISTORY);
+    return std::string(history_.data() + length_ - size, size);
+}
+
+bool StreamDecompressor::LoadState(const std::string& state)
+{
+    if (state.size() > LZ4_STREAM_HISTORY) {
+        return false;
+    }
+    history_.assign(state.begin(), state.end());
+    length_ = state.size();
+    broken_ = false;
+    return true;
+}
+
+}
@@ -0,0 +1,57 @@
+//
+// StreamCompressor.hpp
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace network {
+
+// 接続ごとに過去に送ったメッセージを履歴として持ち、それを参照しながら圧縮する
+// 履歴は共通の辞書で初期化するので、最初の小さなメッセージから圧縮が効く
+class StreamCompressor {
+    public:
+        StreamCompressor();
+        ~StreamCompressor();
+
+        // 圧縮した結果を out の末尾に追加する
+        bool Compress(const char* data, size_t size, std::string* out);
+
+        // 以降の圧縮が参照する履歴 LoadState で別のプロセスに引き継ぐ
+        std::string SaveState() const;
+        bool LoadState(const std::string& state);
+
+    private:
+        StreamCompressor(const StreamCompressor&);
+        StreamCompressor& operator=(const StreamCompressor&);
+
+    private:
+        void* stream_;
+        std::vector<char> buffer_;
+};
+
+// StreamCompressor で圧縮されたメッセージを、送られた順に伸長する
+class StreamDecompressor {
+    public:
+        StreamDecompressor();
+
+        // 伸長した結果を out に返す 失敗した場合は false を返し、以降の伸長もできない
+        bool Uncompress(const char* data, size_t size, size_t original_size, std::string* out);
+
+        // 以降の伸長が参照する履歴
+        std::string SaveState() const;
+        bool LoadState(const std::string& state);
+
+    private:
+        std::vector<char> history_;
+        size_t length_;
+        bool broken_;
+};
+
+// 両端で共通の初期履歴 変更する場合はプロトコルのバージョンを上げる
+const std::string& GetStreamCompressionDictionary();
+
+}
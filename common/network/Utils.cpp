@@ -12,9 +12,81 @@
 #include <boost/asio/ip/address.hpp>
 #include <boost/foreach.hpp>
 
+// NETWORK_UTILS_NO_SIMD を定義するとバイトスタッフィングを1バイトずつ処理する
+#if !defined(NETWORK_UTILS_NO_SIMD)
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define NETWORK_UTILS_AVX2
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define NETWORK_UTILS_SSE2
+#endif
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 namespace network {
     namespace Utils {
 
+        namespace {
+
+#if defined(NETWORK_UTILS_SSE2) || defined(NETWORK_UTILS_AVX2)
+            inline size_t CountTrailingZeros(uint32_t mask)
+            {
+#if defined(_MSC_VER)
+                unsigned long index;
+                _BitScanForward(&index, mask);
+                return index;
+#else
+                return __builtin_ctz(mask);
+#endif
+            }
+#endif
+
+            // a か b が最初に現れる位置を返す 見つからなければ size
+            size_t FindEither(const char* data, size_t size, char a, char b)
+            {
+                size_t i = 0;
+
+#if defined(NETWORK_UTILS_AVX2)
+                const __m256i va = _mm256_set1_epi8(a);
+                const __m256i vb = _mm256_set1_epi8(b);
+                for (; i + 32 <= size; i += 32) {
+                    const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+                    const uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(
+                        _mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb))));
+                    if (mask) {
+                        return i + CountTrailingZeros(mask);
+                    }
+                }
+#endif
+
+#if defined(NETWORK_UTILS_SSE2)
+                const __m128i xa = _mm_set1_epi8(a);
+                const __m128i xb = _mm_set1_epi8(b);
+                for (; i + 16 <= size; i += 16) {
+                    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+                    const uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(
+                        _mm_or_si128(_mm_cmpeq_epi8(v, xa), _mm_cmpeq_epi8(v, xb))));
+                    if (mask) {
+                        return i + CountTrailingZeros(mask);
+                    }
+                }
+#endif
+
+                for (; i < size; i++) {
+                    if (data[i] == a || data[i] == b) {
+                        return i;
+                    }
+                }
+                return size;
+            }
+
+        }
+
         std::string Encode(const std::string& in)
         {
             return ByteStuffingEncode(in) + static_cast<char>(NETWORK_UTILS_DELIMITOR);
@@ -25,38 +97,55 @@ namespace network {
             return ByteStuffingDecode(in);
         }
 
+        std::string Decode(const char* data, size_t size)
+        {
+            return ByteStuffingDecode(data, size);
+        }
+
         std::string ByteStuffingEncode(const std::string& in)
         {
             std::string out;
 			out.reserve(in.size() * 1.2);
 
-			BOOST_FOREACH(const char& c, in) {
-				if (c == 0x7e || c == 0x7d) {
-                    out += 0x7d;
-                    out += c ^ 0x20;
-                } else {
-                    out += c;
+            // エスケープが必要なバイトの間はまとめてコピーする
+            const char* data = in.data();
+            const size_t size = in.size();
+            size_t i = 0;
+            while (i < size) {
+                size_t next = i + FindEither(data + i, size - i, 0x7e, 0x7d);
+                out.append(data + i, next - i);
+                if (next == size) {
+                    break;
                 }
-			}
+                out += 0x7d;
+                out += data[next] ^ 0x20;
+                i = next + 1;
+            }
 
             return out;
         }
 
         std::string ByteStuffingDecode(const std::string& in)
         {
-            std::string out;
-			out.reserve(in.size());
-
-            bool escape = false;
+            return ByteStuffingDecode(in.data(), in.size());
+        }
 
-			BOOST_FOREACH(const char& c, in) {
-				if (escape) {
-                    out += c ^ 0x20;
-                    escape = false;
-                } else if (!(escape = (c == 0x7d))) {
-                    out += c;
+        std::string ByteStuffingDecode(const char* data, size_t size)
+        {
+            std::string out;
+			out.reserve(size);
+
+            // 末尾のエスケープ文字は捨てる
+            size_t i = 0;
+            while (i < size) {
+                size_t next = i + FindEither(data + i, size - i, 0x7d, 0x7d);
+                out.append(data + i, next - i);
+                if (next + 1 >= size) {
+                    break;
                 }
-			}
+                out += data[next + 1] ^ 0x20;
+                i = next + 2;
+            }
 
             return out;
         }
@@ -181,6 +270,31 @@ namespace network {
             return std::string(outbuf.get(), size);
         }
 
+        std::string SerializeVarint(uint32_t value)
+        {
+            std::string out;
+            while (value >= 0x80) {
+                out += static_cast<char>((value & 0x7F) | 0x80);
+                value >>= 7;
+            }
+            out += static_cast<char>(value);
+            return out;
+        }
+
+        size_t DeserializeVarint(const char* data, size_t size, uint32_t* value)
+        {
+            uint32_t result = 0;
+            for (size_t i = 0; i < size && i < 5; i++) {
+                const uint8_t c = static_cast<uint8_t>(data[i]);
+                result |= static_cast<uint32_t>(c & 0x7F) << (7 * i);
+                if (!(c & 0x80)) {
+                    *value = result;
+                    return i + 1;
+                }
+            }
+            return 0;
+        }
+
 		int wildcmp(const char *wild, const char *string) {
 			// Written by Jack Handy - <A href="mailto:jakkhandy@hotmail.com">jakkhandy@hotmail.com</A>
 			const char *cp = NULL, *mp = NULL;
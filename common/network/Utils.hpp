@@ -5,7 +5,9 @@
 
 #include <string>
 #include <tuple>
+#include <stdint.h>
 #include <boost/format.hpp>
+#include "BinaryStream.hpp"
 
 #define NETWORK_UTILS_DELIMITOR (0x7e)
 
@@ -13,9 +15,11 @@ namespace network {
     namespace Utils {
         std::string Encode(const std::string&);
         std::string Decode(const std::string&);
+        std::string Decode(const char* data, size_t size);
 
         std::string ByteStuffingEncode(const std::string&);
         std::string ByteStuffingDecode(const std::string&);
+        std::string ByteStuffingDecode(const char* data, size_t size);
 
         std::string Base64Encode(const std::string&);
         std::string Base64Decode(const std::string&);
@@ -23,47 +27,17 @@ namespace network {
         std::string LZ4Compress(const std::string& in);
         std::string LZ4Uncompress(const std::string& in, size_t size);
 
+        // 下位から7ビットずつ詰める可変長整数 読み込んだバイト数を返し、失敗した場合は0
+        std::string SerializeVarint(uint32_t value);
+        size_t DeserializeVarint(const char* data, size_t size, uint32_t* value);
+
         std::string ToHexString(const std::string&);
 		bool MatchWithWildcard(const std::string& pattern, const std::string& text);
 
         bool IsPrivateAddress(const std::string&);
 
-        inline bool little_endian_check(int i)
-        {
-            return static_cast<bool>(*reinterpret_cast<char*>(&i));
-        }
-
-        inline bool little_endian()
-        {
-            return little_endian_check(1);
-        }
-
-        inline std::string ConvertEndian(const std::string& in)
-        {
-            if (little_endian()) {
-                std::string out = in;
-                std::reverse(out.begin(), out.end());
-                return out;
-            } else {
-                return in;
-            }
-        }
-
         // Serialize
-        template<class T>
-        inline std::string GetSerializedValue(const T& t)
-        {
-            return ConvertEndian(std::string(reinterpret_cast<const char*>(&t), sizeof(t)));
-        }
-
-        template<>
-        inline std::string GetSerializedValue(const std::string& t)
-        {
-            int size = t.size();
-            return ConvertEndian(std::string(reinterpret_cast<const char*>(&size), sizeof(int))) +
-                    std::string(t);
-        }
-
+        // BinaryWriter で1つの文字列に書き込む
         inline std::string Serialize() {
             return std::string();
         }
@@ -71,160 +45,113 @@ namespace network {
         template<class T1>
         inline std::string Serialize(const T1& t1)
         {
-            return GetSerializedValue(t1);
+            std::string out;
+            BinaryWriter(&out).Write(t1);
+            return out;
         }
 
         template<class T1, class T2>
         inline std::string Serialize(const T1& t1, const T2& t2)
         {
-            return GetSerializedValue(t1) + GetSerializedValue(t2);
+            std::string out;
+            BinaryWriter(&out).Write(t1, t2);
+            return out;
         }
 
         template<class T1, class T2, class T3>
         inline std::string Serialize(const T1& t1, const T2& t2, const T3& t3)
         {
-            return GetSerializedValue(t1) + GetSerializedValue(t2) + GetSerializedValue(t3);
+            std::string out;
+            BinaryWriter(&out).Write(t1, t2, t3);
+            return out;
         }
 
         template<class T1, class T2, class T3, class T4>
         inline std::string Serialize(const T1& t1, const T2& t2, const T3& t3, const T4& t4)
         {
-            return GetSerializedValue(t1) + GetSerializedValue(t2)
-                + GetSerializedValue(t3) + GetSerializedValue(t4);
+            std::string out;
+            BinaryWriter(&out).Write(t1, t2, t3, t4);
+            return out;
         }
 
         template<class T1, class T2, class T3, class T4, class T5>
         inline std::string Serialize(const T1& t1, const T2& t2, const T3& t3, const T4& t4, const T5& t5)
         {
-            return GetSerializedValue(t1) + GetSerializedValue(t2)
-                + GetSerializedValue(t3) + GetSerializedValue(t4)
-                 + GetSerializedValue(t5);
+            std::string out;
+            BinaryWriter(&out).Write(t1, t2, t3, t4, t5);
+            return out;
         }
 
         template<class T1, class T2, class T3, class T4, class T5, class T6>
         inline std::string Serialize(const T1& t1, const T2& t2, const T3& t3, const T4& t4, const T5& t5, const T6& t6)
         {
-            return GetSerializedValue(t1) + GetSerializedValue(t2)
-                + GetSerializedValue(t3) + GetSerializedValue(t4)
-                 + GetSerializedValue(t5) + GetSerializedValue(t6);
+            std::string out;
+            BinaryWriter(&out).Write(t1, t2, t3, t4, t5, t6);
+            return out;
         }
 
         // Deserialize
-
-        template<class First>
-        inline First GetDeserializedValue(std::string& buffer)
-        {
-            const First value = *reinterpret_cast<const First*>(ConvertEndian(buffer.substr(0, sizeof(First))).data());
-            buffer.erase(0, sizeof(First));
-            return value;
-        }
-
-        template<>
-        inline std::string GetDeserializedValue<std::string>(std::string& buffer)
-        {
-            int size = *reinterpret_cast<const int*>(ConvertEndian(buffer.substr(0, sizeof(int))).data());
-            buffer.erase(0, sizeof(int));
-            std::string data(buffer.data(), size);
-            buffer.erase(0, size);
-            return data;
-        }
-
-        template<class First>
-        inline void GetDeserializedItems(std::string& buffer, First* first)
-        {
-            *first = GetDeserializedValue<First>(buffer);
-        }
+        // 読み込んだバイト数を返す 足りない場合は残り全てを読んだものとして扱う
 
         template<class T>
         inline T Deserialize(const std::string& data)
         {
-            std::string buffer(data);
-
 			T t;
-            GetDeserializedItems(buffer, &t);
-
+            BinaryReader(data).Read(&t);
 			return t;
         }
 
+        inline size_t GetReadSize(const BinaryReader& reader, const std::string& data)
+        {
+            return reader.failed() ? data.size() : reader.position();
+        }
+
         template<class T1>
         inline size_t Deserialize(const std::string& data, T1 t1)
         {
-            size_t original_size = data.size();
-            std::string buffer(data);
-
-            GetDeserializedItems(buffer, t1);
-
-            return original_size - buffer.size();
+            BinaryReader reader(data);
+            reader.Read(t1);
+            return GetReadSize(reader, data);
         }
 
         template<class T1, class T2>
         inline size_t Deserialize(const std::string& data, T1 t1, T2 t2)
         {
-            size_t original_size = data.size();
-            std::string buffer(data);
-
-            GetDeserializedItems(buffer, t1);
-            GetDeserializedItems(buffer, t2);
-
-            return original_size - buffer.size();
+            BinaryReader reader(data);
+            reader.Read(t1, t2);
+            return GetReadSize(reader, data);
         }
 
         template<class T1, class T2, class T3>
         inline size_t Deserialize(const std::string& data, T1 t1, T2 t2, T3 t3)
         {
-            size_t original_size = data.size();
-            std::string buffer(data);
-
-            GetDeserializedItems(buffer, t1);
-            GetDeserializedItems(buffer, t2);
-            GetDeserializedItems(buffer, t3);
-
-            return original_size - buffer.size();
+            BinaryReader reader(data);
+            reader.Read(t1, t2, t3);
+            return GetReadSize(reader, data);
         }
 
         template<class T1, class T2, class T3, class T4>
         inline size_t Deserialize(const std::string& data, T1 t1, T2 t2, T3 t3, T4 t4)
         {
-            size_t original_size = data.size();
-            std::string buffer(data);
-
-            GetDeserializedItems(buffer, t1);
-            GetDeserializedItems(buffer, t2);
-            GetDeserializedItems(buffer, t3);
-            GetDeserializedItems(buffer, t4);
-
-            return original_size - buffer.size();
+            BinaryReader reader(data);
+            reader.Read(t1, t2, t3, t4);
+            return GetReadSize(reader, data);
         }
 
         template<class T1, class T2, class T3, class T4, class T5>
         inline size_t Deserialize(const std::string& data, T1 t1, T2 t2, T3 t3, T4 t4, T5 t5)
         {
-            size_t original_size = data.size();
-            std::string buffer(data);
-
-            GetDeserializedItems(buffer, t1);
-            GetDeserializedItems(buffer, t2);
-            GetDeserializedItems(buffer, t3);
-            GetDeserializedItems(buffer, t4);
-            GetDeserializedItems(buffer, t5);
-
-            return original_size - buffer.size();
+            BinaryReader reader(data);
+            reader.Read(t1, t2, t3, t4, t5);
+            return GetReadSize(reader, data);
         }
 
         template<class T1, class T2, class T3, class T4, class T5, class T6>
         inline size_t Deserialize(const std::string& data, T1 t1, T2 t2, T3 t3, T4 t4, T5 t5, T6 t6)
         {
-            size_t original_size = data.size();
-            std::string buffer(data);
-
-            GetDeserializedItems(buffer, t1);
-            GetDeserializedItems(buffer, t2);
-            GetDeserializedItems(buffer, t3);
-            GetDeserializedItems(buffer, t4);
-            GetDeserializedItems(buffer, t5);
-            GetDeserializedItems(buffer, t6);
-
-            return original_size - buffer.size();
+            BinaryReader reader(data);
+            reader.Read(t1, t2, t3, t4, t5, t6);
+            return GetReadSize(reader, data);
         }
 
     }
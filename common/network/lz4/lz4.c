@@ -773,11 +773,17 @@ _output_error:
 }
 
 
-int LZ4_uncompress_unknownOutputSize(
+// LZ4_uncompress_lowLimitCtx :
+// -----------------
+// Same as LZ4_uncompress_unknownOutputSize(), but matches may refer down to 'lowLimit',
+// which must be at or before 'dest' (previously decoded data kept as history).
+
+static inline int LZ4_uncompress_lowLimitCtx(
 				const char* source,
 				char* dest,
 				int isize,
-				int maxOutputSize)
+				int maxOutputSize,
+				const char* lowLimit)
 {
 	// Local Variables
 	const BYTE* restrict ip = (const BYTE*) source;
@@ -817,7 +823,7 @@ int LZ4_uncompress_unknownOutputSize(
 
 		// get offset
 		LZ4_READ_LITTLEENDIAN_16(ref,cpy,ip); ip+=2;
-		if (ref < (BYTE* const)dest) goto _output_error;   // Error : offset creates reference outside of destination buffer
+		if (ref < (const BYTE*)lowLimit) goto _output_error;   // Error : offset creates reference outside of destination buffer
 
 		// get matchlength
 		if ((length=(token&ML_MASK)) == ML_MASK) { while (ip<iend) { int s = *ip++; length +=s; if (s==255) continue; break; } }
@@ -861,3 +867,281 @@ _output_error:
 	return (int) (-(((char*)ip)-source));
 }
 
+
+int LZ4_uncompress_unknownOutputSize(
+				const char* source,
+				char* dest,
+				int isize,
+				int maxOutputSize)
+{
+	return LZ4_uncompress_lowLimitCtx(source, dest, isize, maxOutputSize, dest);
+}
+
+
+int LZ4_uncompress_withPrefix(
+				const char* source,
+				char* dest,
+				int isize,
+				int maxOutputSize,
+				int prefixSize)
+{
+	return LZ4_uncompress_lowLimitCtx(source, dest, isize, maxOutputSize, dest - prefixSize);
+}
+
+
+
+//****************************
+// Streaming compression functions
+//****************************
+
+struct LZ4_streamState
+{
+	U32 hashTable[HASHTABLESIZE];	// offsets from 'buffer'
+	BYTE* buffer;					// history followed by the data being compressed
+	int capacity;
+	int length;
+};
+
+
+// LZ4_compressStreamCtx :
+// -----------------
+// Compress 'isize' bytes located at 'state->buffer + state->length'.
+// Matches may refer to history kept in the buffer, up to MAX_DISTANCE bytes back.
+// The hash table is kept in the state, so it is not rebuilt for each block.
+
+static inline int LZ4_compressStreamCtx(struct LZ4_streamState* state,
+				 char* dest,
+				 int isize,
+				 int maxOutputSize)
+{
+	U32* const HashTable = state->hashTable;
+	const BYTE* const base = state->buffer;
+	const BYTE* const lowLimit = base;
+
+	const BYTE* ip = base + state->length;
+	const BYTE* anchor = ip;
+	const BYTE* const iend = ip + isize;
+	const BYTE* const mflimit = iend - MFLIMIT;
+#define matchlimit (iend - LASTLITERALS)
+
+	BYTE* op = (BYTE*) dest;
+	BYTE* const oend = op + maxOutputSize;
+
+	int len, length;
+	const int skipStrength = SKIPSTRENGTH;
+	U32 forwardH;
+
+
+	// Init
+	if (isize<MINLENGTH) goto _last_literals;
+
+	// First Byte
+	HashTable[LZ4_HASH_VALUE(ip)] = (U32)(ip - base);
+	ip++; forwardH = LZ4_HASH_VALUE(ip);
+
+	// Main Loop
+	for ( ; ; )
+	{
+		int findMatchAttempts = (1U << skipStrength) + 3;
+		const BYTE* forwardIp = ip;
+		const BYTE* ref;
+		BYTE* token;
+
+		// Find a match
+		do {
+			U32 h = forwardH;
+			int step = findMatchAttempts++ >> skipStrength;
+			ip = forwardIp;
+			forwardIp = ip + step;
+
+			if unlikely(forwardIp > mflimit) { goto _last_literals; }
+
+			forwardH = LZ4_HASH_VALUE(forwardIp);
+			ref = base + HashTable[h];
+			HashTable[h] = (U32)(ip - base);
+
+		} while ((ref < ip - MAX_DISTANCE) || (A32(ref) != A32(ip)));
+
+		// Catch up
+		while ((ip>anchor) && (ref>lowLimit) && unlikely(ip[-1]==ref[-1])) { ip--; ref--; }
+
+		// Encode Literal length
+		length = (int)(ip - anchor);
+		token = op++;
+		if unlikely(op + length + (2 + 1 + LASTLITERALS) + (length>>8) >= oend) return 0; 		// Check output limit
+		if (length>=(int)RUN_MASK) { *token=(RUN_MASK<<ML_BITS); len = length-RUN_MASK; for(; len > 254 ; len-=255) *op++ = 255; *op++ = (BYTE)len; }
+		else *token = (length<<ML_BITS);
+
+		// Copy Literals
+		memcpy(op, anchor, length);
+		op += length;
+
+_next_match:
+		// Encode Offset
+		LZ4_WRITE_LITTLEENDIAN_16(op,(U16)(ip-ref));
+
+		// Start Counting
+		ip+=MINMATCH; ref+=MINMATCH;   // MinMatch verified
+		anchor = ip;
+		while likely(ip<matchlimit-(STEPSIZE-1))
+		{
+			UARCH diff = AARCH(ref) ^ AARCH(ip);
+			if (!diff) { ip+=STEPSIZE; ref+=STEPSIZE; continue; }
+			ip += LZ4_NbCommonBytes(diff);
+			goto _endCount;
+		}
+		if (LZ4_ARCH64) if ((ip<(matchlimit-3)) && (A32(ref) == A32(ip))) { ip+=4; ref+=4; }
+		if ((ip<(matchlimit-1)) && (A16(ref) == A16(ip))) { ip+=2; ref+=2; }
+		if ((ip<matchlimit) && (*ref == *ip)) ip++;
+_endCount:
+
+		// Encode MatchLength
+		len = (int)(ip - anchor);
+		if unlikely(op + (1 + LASTLITERALS) + (len>>8) >= oend) return 0; 		// Check output limit
+		if (len>=(int)ML_MASK) { *token+=ML_MASK; len-=ML_MASK; for(; len > 509 ; len-=510) { *op++ = 255; *op++ = 255; } if (len > 254) { len-=255; *op++ = 255; } *op++ = (BYTE)len; }
+		else *token += len;
+
+		// Test end of chunk
+		if (ip > mflimit) { anchor = ip;  break; }
+
+		// Fill table
+		HashTable[LZ4_HASH_VALUE(ip-2)] = (U32)(ip - 2 - base);
+
+		// Test next position
+		ref = base + HashTable[LZ4_HASH_VALUE(ip)];
+		HashTable[LZ4_HASH_VALUE(ip)] = (U32)(ip - base);
+		if ((ref > ip - (MAX_DISTANCE + 1)) && (A32(ref) == A32(ip))) { token = op++; *token=0; goto _next_match; }
+
+		// Prepare next loop
+		anchor = ip++;
+		forwardH = LZ4_HASH_VALUE(ip);
+	}
+
+_last_literals:
+	// Encode Last Literals
+	{
+		int lastRun = (int)(iend - anchor);
+		if (((char*)op - dest) + lastRun + 1 + ((lastRun-15)/255) >= maxOutputSize) return 0;
+		if (lastRun>=(int)RUN_MASK) { *op++=(RUN_MASK<<ML_BITS); lastRun-=RUN_MASK; for(; lastRun > 254 ; lastRun-=255) *op++ = 255; *op++ = (BYTE) lastRun; }
+		else *op++ = (lastRun<<ML_BITS);
+		memcpy(op, anchor, iend - anchor);
+		op += iend-anchor;
+	}
+
+	// End
+	return (int) (((char*)op)-dest);
+}
+
+
+// Make room for 'isize' more bytes, keeping at most LZ4_STREAM_HISTORY bytes of history.
+// return : 0 if OK, -1 if the allocation fails
+static int LZ4_reserveStream(struct LZ4_streamState* state, int isize)
+{
+	if (state->length + isize > state->capacity)
+	{
+		int keep = state->length < LZ4_STREAM_HISTORY ? state->length : LZ4_STREAM_HISTORY;
+		int shift = state->length - keep;
+		int i;
+
+		// Slide the history to the beginning of the buffer and rebase the hash table
+		if (shift > 0)
+		{
+			memmove(state->buffer, state->buffer + shift, keep);
+			for (i = 0; i < HASHTABLESIZE; i++)
+			{
+				state->hashTable[i] = state->hashTable[i] > (U32)shift ? state->hashTable[i] - shift : 0;
+			}
+			state->length = keep;
+		}
+
+		if (keep + isize > state->capacity)
+		{
+			int capacity = LZ4_STREAM_HISTORY + (isize > LZ4_STREAM_HISTORY ? isize : LZ4_STREAM_HISTORY);
+			BYTE* buffer = (BYTE*) realloc(state->buffer, capacity);
+			if (buffer == NULL) return -1;
+			state->buffer = buffer;
+			state->capacity = capacity;
+		}
+	}
+	return 0;
+}
+
+
+void* LZ4_createStream(void)
+{
+	struct LZ4_streamState* state = (struct LZ4_streamState*) malloc(sizeof(struct LZ4_streamState));
+	if (state == NULL) return NULL;
+	memset(state->hashTable, 0, sizeof(state->hashTable));
+	state->buffer = NULL;
+	state->capacity = 0;
+	state->length = 0;
+	return state;
+}
+
+
+void LZ4_freeStream(void* stream)
+{
+	struct LZ4_streamState* state = (struct LZ4_streamState*) stream;
+	if (state == NULL) return;
+	free(state->buffer);
+	free(state);
+}
+
+
+int LZ4_loadDict(void* stream, const char* dictionary, int dictSize)
+{
+	struct LZ4_streamState* state = (struct LZ4_streamState*) stream;
+	const BYTE* p;
+	const BYTE* dictEnd;
+
+	if (dictSize > LZ4_STREAM_HISTORY)
+	{
+		dictionary += dictSize - LZ4_STREAM_HISTORY;
+		dictSize = LZ4_STREAM_HISTORY;
+	}
+
+	memset(state->hashTable, 0, sizeof(state->hashTable));
+	state->length = 0;
+	if (LZ4_reserveStream(state, dictSize) < 0) return 0;
+
+	memcpy(state->buffer, dictionary, dictSize);
+	state->length = dictSize;
+
+	p = state->buffer;
+	dictEnd = state->buffer + dictSize;
+	while (p + MINMATCH <= dictEnd)
+	{
+		state->hashTable[LZ4_HASH_VALUE(p)] = (U32)(p - state->buffer);
+		p++;
+	}
+
+	return dictSize;
+}
+
+
+int LZ4_compress_continue(void* stream, const char* source, char* dest, int isize, int maxOutputSize)
+{
+	struct LZ4_streamState* state = (struct LZ4_streamState*) stream;
+	int result;
+
+	if (LZ4_reserveStream(state, isize) < 0) return 0;
+
+	memcpy(state->buffer + state->length, source, isize);
+	result = LZ4_compressStreamCtx(state, dest, isize, maxOutputSize);
+	state->length += isize;
+
+	return result;
+}
+
+
+int LZ4_saveDict(void* stream, char* safeBuffer, int maxDictSize)
+{
+	struct LZ4_streamState* state = (struct LZ4_streamState*) stream;
+	int dictSize = state->length;
+
+	if (dictSize > LZ4_STREAM_HISTORY) dictSize = LZ4_STREAM_HISTORY;
+	if (dictSize > maxDictSize) dictSize = maxDictSize;
+	if (dictSize > 0) memcpy(safeBuffer, state->buffer + state->length - dictSize, dictSize);
+
+	return dictSize;
+}
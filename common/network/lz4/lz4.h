@@ -112,6 +112,52 @@ LZ4_uncompress_unknownOutputSize() :
 */
 
 
+int LZ4_uncompress_withPrefix (const char* source, char* dest, int isize, int maxOutputSize, int prefixSize);
+
+/*
+LZ4_uncompress_withPrefix() :
+	Same as LZ4_uncompress_unknownOutputSize(), but matches may refer to the 'prefixSize' bytes
+	located just before 'dest' (data previously decoded from the same stream).
+	prefixSize : should be min(decoded size so far, LZ4_STREAM_HISTORY)
+*/
+
+
+//****************************
+// Streaming Functions
+//****************************
+
+#define LZ4_STREAM_HISTORY (1<<16)
+
+void* LZ4_createStream (void);
+void  LZ4_freeStream   (void* stream);
+int   LZ4_loadDict     (void* stream, const char* dictionary, int dictSize);
+int   LZ4_compress_continue (void* stream, const char* source, char* dest, int isize, int maxOutputSize);
+int   LZ4_saveDict     (void* stream, char* safeBuffer, int maxDictSize);
+
+/*
+LZ4_createStream() :
+	Allocates a compression stream, which keeps the hash table and the last LZ4_STREAM_HISTORY bytes
+	of previously compressed data. Successive blocks are compressed against this history.
+	return : a stream to be released with LZ4_freeStream(), or NULL if the allocation fails
+
+LZ4_loadDict() :
+	Resets the stream and uses 'dictionary' as history. Only its last LZ4_STREAM_HISTORY bytes are used.
+	return : the number of bytes loaded
+
+LZ4_compress_continue() :
+	Compresses 'isize' bytes from 'source', which may refer to previous blocks of the stream.
+	Blocks must be decoded in the same order, with LZ4_uncompress_withPrefix().
+	return : the number of bytes written in buffer 'dest'
+			 or 0 if the compression fails
+
+LZ4_saveDict() :
+	Copies the last (up to 'maxDictSize') bytes of history into 'safeBuffer'.
+	Loading them with LZ4_loadDict() into another stream continues the same stream,
+	since later blocks can only refer to this history.
+	return : the number of bytes copied
+*/
+
+
 #if defined (__cplusplus)
 }
 #endif
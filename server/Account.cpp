@@ -4,28 +4,62 @@
 
 #include "Account.hpp"
 #include "../common/network/Encrypter.hpp"
+#include <osrng.h>
 #include <iostream>
 #include <string.h>
+#include <algorithm>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <assert.h>
 
+#define ACCOUNT_CHANGE_LOG_CAPACITY (1 << 14)
+
 Account::Account() :
+change_log_floor_(0),
 revision_(0),
+instance_id_(0),
 max_user_id_(0)
 {
+    CryptoPP::AutoSeededRandomPool rnd;
+    while (instance_id_ == 0) {
+        rnd.GenerateBlock(reinterpret_cast<byte*>(&instance_id_), sizeof(instance_id_));
+    }
 }
 
 Account::~Account()
 {
 }
 
-void Account::LoadInitializeData(UserID user_id, std::string data)
+void Account::OpenIdentityStore(const std::string& path)
+{
+	if (path.empty()) {
+		return;
+	}
+
+	boost::unique_lock<boost::shared_mutex> lock(mutex_);
+	try {
+		identity_store_.reset(new IdentityStore(path));
+		max_user_id_ = std::max(max_user_id_, identity_store_->max_user_id());
+		Logger::Info("Identity store: %d users", identity_store_->size());
+	} catch (std::exception& e) {
+		Logger::Error("Cannot open identity store: %s", e.what());
+	}
+}
+
+void Account::CloseIdentityStore()
+{
+	boost::unique_lock<boost::shared_mutex> lock(mutex_);
+	identity_store_.reset();
+}
+
+void Account::LoadInitializeData(UserID user_id, const network::ByteView& data)
 {
-    std::string buffer(data);
+    network::BinaryReader reader(data);
 
-    while (buffer.size()) {
+    while (reader.remaining() > 0) {
         uint16_t property_int;
-        buffer.erase(0, network::Utils::Deserialize(buffer, &property_int));
+        if (!reader.Read(&property_int)) {
+            break;
+        }
 
         AccountProperty property = static_cast<AccountProperty>(property_int);
         switch (property) {
@@ -33,7 +67,9 @@ void Account::LoadInitializeData(UserID user_id, std::string data)
             case NAME:
             {
                 std::string value;
-                buffer.erase(0, network::Utils::Deserialize(buffer, &value));
+                if (!reader.Read(&value)) {
+                    break;
+                }
                 SetUserName(user_id, value);
             }
                 break;
@@ -41,7 +77,9 @@ void Account::LoadInitializeData(UserID user_id, std::string data)
             case TRIP:
             {
                 std::string value;
-                buffer.erase(0, network::Utils::Deserialize(buffer, &value));
+                if (!reader.Read(&value)) {
+                    break;
+                }
                 SetUserTrip(user_id, value);
             }
                 break;
@@ -49,7 +87,9 @@ void Account::LoadInitializeData(UserID user_id, std::string data)
             case MODEL_NAME:
             {
                 std::string value;
-                buffer.erase(0, network::Utils::Deserialize(buffer, &value));
+                if (!reader.Read(&value)) {
+                    break;
+                }
                 SetUserModelName(user_id, value);
             }
                 break;
@@ -60,49 +100,319 @@ void Account::LoadInitializeData(UserID user_id, std::string data)
     }
 }
 
+namespace {
+
+template <class Column>
+void WriteColumn(network::BinaryWriter* writer, const Column& column)
+{
+    writer->Write(column.value, column.revision, column.sequence, static_cast<uint8_t>(column.present));
+}
+
+template <class Column>
+bool ReadColumn(network::BinaryReader* reader, Column* column)
+{
+    uint8_t present;
+    if (!reader->Read(&column->value, &column->revision, &column->sequence, &present)) {
+        return false;
+    }
+    column->present = present != 0;
+    return true;
+}
+
+}
+
+std::string Account::SaveState() const
+{
+	boost::shared_lock<boost::shared_mutex> lock(mutex_);
+
+    std::string state;
+    network::BinaryWriter writer(&state);
+    writer.Write(revision_, instance_id_, max_user_id_, change_log_floor_);
+
+    uint32_t count = 0;
+    for (UserID user_id = 1; user_id < rows_.size(); user_id++) {
+        count += rows_[user_id].exists;
+    }
+    writer.Write(count);
+    for (UserID user_id = 1; user_id < rows_.size(); user_id++) {
+        const Row& row = rows_[user_id];
+        if (!row.exists) {
+            continue;
+        }
+        writer.Write(user_id, row.revision, row.finger_print);
+        WriteColumn(&writer, row.login);
+        WriteColumn(&writer, row.channel);
+        WriteColumn(&writer, row.udp_port);
+        WriteColumn(&writer, row.name);
+        WriteColumn(&writer, row.model_name);
+        WriteColumn(&writer, row.trip);
+        WriteColumn(&writer, row.ip_address);
+        WriteColumn(&writer, row.public_key);
+    }
+
+    writer.Write(static_cast<uint32_t>(position_map_.size()));
+    BOOST_FOREACH(const auto& pair, position_map_) {
+        const PlayerPosition& pos = pair.second;
+        writer.Write(pair.first).Write(pos.x, pos.y, pos.z, pos.theta, pos.vy);
+    }
+
+    writer.Write(static_cast<uint32_t>(change_log_.size()));
+    BOOST_FOREACH(const ChangeLogEntry& entry, change_log_) {
+        writer.Write(entry.sequence, entry.user_id, static_cast<uint16_t>(entry.property));
+    }
+
+    return state;
+}
+
+bool Account::LoadState(const std::string& state)
+{
+	boost::unique_lock<boost::shared_mutex> lock(mutex_);
+
+    network::BinaryReader reader(state);
+    UserID max_user_id;
+    uint32_t count;
+    if (!reader.Read(&revision_, &instance_id_, &max_user_id, &change_log_floor_, &count)) {
+        return false;
+    }
+    max_user_id_ = std::max(max_user_id_, max_user_id);
+
+    rows_.clear();
+    fingerprint_map_.clear();
+    for (uint32_t i = 0; i < count; i++) {
+        UserID user_id;
+        Row row;
+        if (!reader.Read(&user_id, &row.revision, &row.finger_print) || user_id == 0 ||
+                !ReadColumn(&reader, &row.login) ||
+                !ReadColumn(&reader, &row.channel) ||
+                !ReadColumn(&reader, &row.udp_port) ||
+                !ReadColumn(&reader, &row.name) ||
+                !ReadColumn(&reader, &row.model_name) ||
+                !ReadColumn(&reader, &row.trip) ||
+                !ReadColumn(&reader, &row.ip_address) ||
+                !ReadColumn(&reader, &row.public_key)) {
+            return false;
+        }
+
+        row.exists = true;
+        if (user_id >= rows_.size()) {
+            rows_.resize(user_id + 1);
+        }
+        rows_[user_id] = row;
+        if (!row.finger_print.empty()) {
+            fingerprint_map_[row.finger_print] = user_id;
+        }
+    }
+
+    position_map_.clear();
+    if (!reader.Read(&count)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        UserID user_id;
+        PlayerPosition pos;
+        if (!reader.Read(&user_id) || !reader.Read(&pos.x, &pos.y, &pos.z, &pos.theta, &pos.vy)) {
+            return false;
+        }
+        position_map_[user_id] = pos;
+    }
+
+    change_log_.clear();
+    if (!reader.Read(&count)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        ChangeLogEntry entry;
+        uint16_t property;
+        if (!reader.Read(&entry.sequence, &entry.user_id, &property)) {
+            return false;
+        }
+        entry.property = static_cast<AccountProperty>(property);
+        change_log_.push_back(entry);
+    }
+
+    return true;
+}
+
 uint32_t Account::GetCurrentRevision()
 {
+	boost::shared_lock<boost::shared_mutex> lock(mutex_);
     return revision_;
 }
 
+uint32_t Account::instance_id() const
+{
+    return instance_id_;
+}
+
+namespace {
+
+// パッチの1項目 プロパティ番号と値を Utils::Serialize と同じ形式で書く
+template <class Column>
+void WritePatchColumn(network::BinaryWriter* writer, AccountProperty property,
+        const Column& column, uint32_t revision, uint32_t sequence)
+{
+    if (column.revision > revision && column.sequence > sequence) {
+        writer->Write(static_cast<uint16_t>(property)).Write(column.value);
+    }
+}
+
+}
+
 std::string Account::GetUserRevisionPatch(UserID user_id, uint32_t revision)
 {
-    auto user_revison = GetUserRevision(user_id);
+	boost::shared_lock<boost::shared_mutex> lock(mutex_);
+
+    std::string patch;
+    const Row* row = FindRow(user_id);
+
+    if (row && row->revision > revision) {
+        patch.reserve(256);
+        AppendRevisionPatch(&patch, user_id, *row, revision);
+    }
+
+    return patch;
+}
+
+std::string Account::GetChannelSnapshot(unsigned char channel)
+{
+	boost::shared_lock<boost::shared_mutex> lock(mutex_);
+
+    std::string snapshot;
     std::string patch;
+    network::BinaryWriter writer(&snapshot);
 
-    if (user_revison > revision) {
-        patch += network::Utils::Serialize(user_id, user_revison);
+    for (UserID user_id = 1; user_id < rows_.size(); user_id++) {
+        const Row& row = rows_[user_id];
+        if (!row.exists || !row.login.value || row.channel.value != channel) {
+            continue;
+        }
 
-        UserMap::iterator usermap_it;
-        if ((usermap_it = user_map_.find(user_id)) != user_map_.end()) {
+        patch.clear();
+        AppendRevisionPatch(&patch, user_id, row, 0);
 
-            PropertyMap& property_map = usermap_it->second;
+        PlayerPosition pos;
+        auto it = position_map_.find(user_id);
+        if (it != position_map_.end()) {
+            pos = it->second;
+        }
 
-            BOOST_FOREACH (auto& property, property_map) {
-                if (property.second.revision > revision) {
-                    patch += network::Utils::Serialize((uint16_t)property.first) + property.second.value;
-                }
+        writer.Write(patch).Write(pos.x, pos.y, pos.z, pos.theta, pos.vy);
+    }
+
+    return snapshot;
+}
+
+std::string Account::GetChangesSince(uint32_t instance_id, uint32_t sequence)
+{
+	boost::shared_lock<boost::shared_mutex> lock(mutex_);
+
+    std::string changes;
+    std::string patch;
+    network::BinaryWriter writer(&changes);
+
+    // 再起動した場合は通し番号が 0 からやり直しになっている
+    const bool full = instance_id != instance_id_ ||
+        sequence < change_log_floor_ || sequence > revision_;
+    writer.Write(instance_id_, revision_).Write(static_cast<uint8_t>(full));
+
+    if (full) {
+        for (UserID user_id = 1; user_id < rows_.size(); user_id++) {
+            if (rows_[user_id].exists) {
+                patch.clear();
+                AppendRevisionPatch(&patch, user_id, rows_[user_id], 0);
+                writer.Write(patch);
             }
         }
+        return changes;
     }
 
-    return patch;
+    // sequence より後の記録から、まだ有効なものを持つユーザーを集める
+    std::vector<UserID> users;
+    for (auto it = change_log_.rbegin(); it != change_log_.rend() && it->sequence > sequence; ++it) {
+        const Row* row = FindRow(it->user_id);
+        if (row && GetColumnSequence(*row, it->property) == it->sequence) {
+            users.push_back(it->user_id);
+        }
+    }
+    std::sort(users.begin(), users.end());
+    users.erase(std::unique(users.begin(), users.end()), users.end());
+
+    BOOST_FOREACH(UserID user_id, users) {
+        patch.clear();
+        AppendRevisionPatch(&patch, user_id, rows_[user_id], 0, sequence);
+        writer.Write(patch);
+    }
+
+    return changes;
 }
 
-void Account::Remove(UserID user_id)
+void Account::AppendRevisionPatch(std::string* patch, UserID user_id, const Row& row,
+        uint32_t revision, uint32_t sequence) const
 {
-	// 30分後に削除
-	boost::thread t([this, user_id](){
+    network::BinaryWriter writer(patch);
+    writer.Write(user_id, row.revision);
+
+    // プロパティ番号の小さい順
+    WritePatchColumn(&writer, LOGIN, row.login, revision, sequence);
+    WritePatchColumn(&writer, CHANNEL, row.channel, revision, sequence);
+    WritePatchColumn(&writer, NAME, row.name, revision, sequence);
+    WritePatchColumn(&writer, MODEL_NAME, row.model_name, revision, sequence);
+    WritePatchColumn(&writer, TRIP, row.trip, revision, sequence);
+    WritePatchColumn(&writer, IP_ADDRESS, row.ip_address, revision, sequence);
+    WritePatchColumn(&writer, UDP_PORT, row.udp_port, revision, sequence);
+}
 
-		boost::this_thread::sleep(boost::posix_time::minutes(30));
+uint32_t Account::GetColumnSequence(const Row& row, AccountProperty property) const
+{
+    switch (property) {
+        case LOGIN:         return row.login.sequence;
+        case CHANNEL:       return row.channel.sequence;
+        case NAME:          return row.name.sequence;
+        case MODEL_NAME:    return row.model_name.sequence;
+        case TRIP:          return row.trip.sequence;
+        case IP_ADDRESS:    return row.ip_address.sequence;
+        case UDP_PORT:      return row.udp_port.sequence;
+        default:            return 0;
+    }
+}
 
-		char login;
-		Get(user_id, LOGIN, &login);
-		if (!login) {
-			boost::unique_lock<boost::recursive_mutex> lock(mutex_);
-			user_map_.erase(user_id);
-		}
-	});
+void Account::AppendChangeLog(UserID user_id, AccountProperty property, uint32_t sequence)
+{
+    ChangeLogEntry entry = {sequence, user_id, property};
+    change_log_.push_back(entry);
+
+    if (change_log_.size() < ACCOUNT_CHANGE_LOG_CAPACITY) {
+        return;
+    }
+
+    // 上書きされた記録を取り除く
+    std::deque<ChangeLogEntry> compacted;
+    BOOST_FOREACH(const ChangeLogEntry& logged, change_log_) {
+        const Row* row = FindRow(logged.user_id);
+        if (row && GetColumnSequence(*row, logged.property) == logged.sequence) {
+            compacted.push_back(logged);
+        }
+    }
+    change_log_.swap(compacted);
+
+    // それでも多い場合は古いものから捨てて、半分まで減らす
+    while (change_log_.size() > ACCOUNT_CHANGE_LOG_CAPACITY / 2) {
+        change_log_floor_ = change_log_.front().sequence;
+        change_log_.pop_front();
+    }
+}
+
+void Account::Remove(UserID user_id)
+{
+	boost::unique_lock<boost::shared_mutex> lock(mutex_);
+
+	// ログインし直している場合は残す
+	// ファイルに残したユーザーは、次にログインした時に読み込み直す
+	const Row* row = FindRow(user_id);
+	if (row && !row->login.value) {
+		fingerprint_map_.erase(row->finger_print);
+		rows_[user_id] = Row();
+	}
 }
 
 /*
@@ -137,20 +447,63 @@ void Account::ApplyRevisionPatch(const std::string& patch)
 
 UserID Account::GetUserIdFromFingerPrint(const std::string& finger_print)
 {
-	return 0;
-    //FingerprintMap::iterator it;
-    //if ((it = fingerprint_map_.find(finger_print)) != fingerprint_map_.end()) {
-    //    return it->second;
-    //} else {
-    //    return 0;
-    //}
+	boost::unique_lock<boost::shared_mutex> lock(mutex_);
+	return FindUserIdUnlocked(finger_print);
+}
+
+UserID Account::FindUserIdUnlocked(const std::string& finger_print)
+{
+    FingerprintMap::iterator it;
+    if ((it = fingerprint_map_.find(finger_print)) != fingerprint_map_.end()) {
+        return it->second;
+    }
+
+    IdentityStore::Identity identity;
+    if (!identity_store_ || !identity_store_->Find(finger_print, &identity)) {
+        return 0;
+    }
+
+    // ファイルから読み込んで、新しく登録した場合と同じように通知する
+    const UserID user_id = identity.user_id;
+    SetUnlocked(user_id, NAME, &Row::name,
+            identity.name.empty() ? std::string("???") : identity.name, true);
+    if (!identity.trip.empty()) {
+        SetUnlocked(user_id, TRIP, &Row::trip, identity.trip, true);
+    }
+    if (!identity.model_name.empty()) {
+        SetUnlocked(user_id, MODEL_NAME, &Row::model_name, identity.model_name, true);
+    }
+    SetUnlocked(user_id, PUBLIC_KEY, &Row::public_key, identity.public_key, false);
+    rows_[user_id].finger_print = finger_print;
+    fingerprint_map_[finger_print] = user_id;
+
+    return user_id;
+}
+
+void Account::StoreIdentity(UserID user_id)
+{
+    if (!identity_store_) {
+        return;
+    }
+
+	boost::shared_lock<boost::shared_mutex> lock(mutex_);
+    const Row* row = FindRow(user_id);
+    if (!row || row->finger_print.empty()) {
+        return;
+    }
+
+    IdentityStore::Identity identity;
+    identity.user_id = user_id;
+    identity.public_key = row->public_key.value;
+    identity.name = row->name.value;
+    identity.trip = row->trip.value;
+    identity.model_name = row->model_name.value;
+    identity_store_->Update(row->finger_print, identity);
 }
 
 std::string Account::GetPublicKey(UserID user_id)
 {
-    std::string value;
-    Get(user_id, PUBLIC_KEY, &value);
-    return value;
+    return Get(user_id, &Row::public_key);
 }
 
 UserID Account::RegisterPublicKey(const std::string& public_key)
@@ -158,14 +511,21 @@ UserID Account::RegisterPublicKey(const std::string& public_key)
     UserID user_id = 0;
     std::string finger_print = network::Encrypter::GetHash(public_key);
 
-    if (GetUserIdFromFingerPrint(finger_print) == 0) {
-        // ユーザーIDを発行
-        user_id = ++max_user_id_;
+	boost::unique_lock<boost::shared_mutex> lock(mutex_);
+    user_id = FindUserIdUnlocked(finger_print);
+    if (user_id == 0) {
+        // ユーザーIDを発行 ファイルに残す場合は再起動をまたいで重ならないように採番する
+        if (identity_store_) {
+            user_id = identity_store_->Register(finger_print, public_key);
+            max_user_id_ = std::max(max_user_id_, user_id);
+        } else {
+            user_id = ++max_user_id_;
+        }
         fingerprint_map_[finger_print] = user_id;
 
-        SetUserName(user_id, "???");
-        Set(user_id, PUBLIC_KEY, public_key, false);
-        Set(user_id, REVISION, (uint32_t)1, false);
+        SetUnlocked(user_id, NAME, &Row::name, std::string("???"), true);
+        SetUnlocked(user_id, PUBLIC_KEY, &Row::public_key, public_key, false);
+        rows_[user_id].finger_print = finger_print;
     }
 
     return user_id;
@@ -173,12 +533,12 @@ UserID Account::RegisterPublicKey(const std::string& public_key)
 
 void Account::LogIn(UserID user_id)
 {
-    Set(user_id, LOGIN, (char)1);
+    Set(user_id, LOGIN, &Row::login, (char)1);
 }
 
 void Account::LogOut(UserID user_id)
 {
-    Set(user_id, LOGIN, (char)0);
+    Set(user_id, LOGIN, &Row::login, (char)0);
 }
 
 void Account::LogOutAll()
@@ -190,92 +550,104 @@ void Account::LogOutAll()
 
 std::string Account::GetUserName(UserID user_id) const
 {
-    std::string name;
-    Get(user_id, NAME, &name);
-    return name;
+    return Get(user_id, &Row::name);
+}
+
+bool Account::GetUserName(UserID user_id, std::string* name) const
+{
+    return Get(user_id, &Row::name, name);
 }
 
 void Account::SetUserName(UserID user_id, const std::string& name)
 {
     if (name.size() > 0 && name.size() <= 32) {
-        Set(user_id, NAME, name);
+        Set(user_id, NAME, &Row::name, name);
+        StoreIdentity(user_id);
     }
 }
 
 std::string Account::GetUserTrip(UserID user_id) const
 {
-    std::string trip;
-    Get(user_id, TRIP, &trip);
-    return trip;
+    return Get(user_id, &Row::trip);
+}
+
+bool Account::GetUserTrip(UserID user_id, std::string* trip) const
+{
+    return Get(user_id, &Row::trip, trip);
 }
 
 void Account::SetUserTrip(UserID user_id, const std::string& trip)
 {
     if (trip.size() > 0 && trip.size() <= 256) {
-        Set(user_id, TRIP, network::Encrypter::GetTrip(trip));
+        Set(user_id, TRIP, &Row::trip, network::Encrypter::GetTrip(trip));
     } else {
-		Set(user_id, TRIP, std::string());
+		Set(user_id, TRIP, &Row::trip, std::string());
 	}
+    StoreIdentity(user_id);
 }
 
 std::string Account::GetUserModelName(UserID user_id) const
 {
-    std::string name;
-    Get(user_id, MODEL_NAME, &name);
-    return name;
+    return Get(user_id, &Row::model_name);
+}
+
+bool Account::GetUserModelName(UserID user_id, std::string* name) const
+{
+    return Get(user_id, &Row::model_name, name);
 }
 
 void Account::SetUserModelName(UserID user_id, const std::string& name)
 {
     if (name.size() > 0 && name.size() <= 64) {
-        Set(user_id, MODEL_NAME, name);
+        Set(user_id, MODEL_NAME, &Row::model_name, name);
+        StoreIdentity(user_id);
     }
 }
 
 std::string Account::GetUserIPAddress(UserID user_id) const
 {
-    std::string ip_address;
-    Get(user_id, IP_ADDRESS, &ip_address);
-    return ip_address;
+    return Get(user_id, &Row::ip_address);
+}
+
+bool Account::GetUserIPAddress(UserID user_id, std::string* ip_address) const
+{
+    return Get(user_id, &Row::ip_address, ip_address);
 }
 void Account::SetUserIPAddress(UserID user_id, const std::string& ip_address)
 {
-    Set(user_id, IP_ADDRESS, ip_address);
+    Set(user_id, IP_ADDRESS, &Row::ip_address, ip_address);
 }
 
 uint16_t Account::GetUserUDPPort(UserID user_id) const
 {
-    uint16_t udp_port = 0;
-    Get(user_id, UDP_PORT, &udp_port);
-    return udp_port;
+    return Get(user_id, &Row::udp_port);
 }
 
 void Account::SetUserUDPPort(UserID user_id, uint16_t udp_port)
 {
-    Set(user_id, UDP_PORT, udp_port);
+    Set(user_id, UDP_PORT, &Row::udp_port, udp_port);
 }
 
 uint32_t Account::GetUserRevision(UserID user_id) const
 {
-    uint32_t revision = 0;
-    Get(user_id, REVISION, &revision);
-    return revision;
+	boost::shared_lock<boost::shared_mutex> lock(mutex_);
+    const Row* row = FindRow(user_id);
+    return row ? row->revision : 0;
 }
 
 void Account::SetUserChannel(UserID user_id, unsigned char channel)
 {
-    Set(user_id, CHANNEL, channel);
+    Set(user_id, CHANNEL, &Row::channel, channel);
 }
 
 unsigned char Account::GetUserChannel(UserID user_id) const
 {
-    unsigned char channel = 0;
-    Get(user_id, CHANNEL, &channel);
-    return channel;
+    return Get(user_id, &Row::channel);
 }
 
 void Account::SetUserPosition(UserID user_id, const PlayerPosition& pos)
 {
+	boost::unique_lock<boost::shared_mutex> lock(mutex_);
     auto it = position_map_.find(user_id);
     if (it == position_map_.end()) {
         position_map_[user_id] = PlayerPosition();
@@ -285,6 +657,7 @@ void Account::SetUserPosition(UserID user_id, const PlayerPosition& pos)
 
 PlayerPosition Account::GetUserPosition(UserID user_id) const
 {
+	boost::shared_lock<boost::shared_mutex> lock(mutex_);
     auto it = position_map_.find(user_id);
     if (it == position_map_.end()) {
         return PlayerPosition();
@@ -294,10 +667,11 @@ PlayerPosition Account::GetUserPosition(UserID user_id) const
 
 std::vector<UserID> Account::GetIDList() const
 {
+	boost::shared_lock<boost::shared_mutex> lock(mutex_);
     std::vector<UserID> list;
-    for (auto it = user_map_.begin(); it != user_map_.end(); ++it) {
-		if (it->first != 0) {
-			list.push_back(it->first);
+    for (UserID user_id = 1; user_id < rows_.size(); user_id++) {
+		if (rows_[user_id].exists) {
+			list.push_back(user_id);
 		}
     }
     return list;
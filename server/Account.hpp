@@ -7,11 +7,14 @@
 #include <string>
 #include <map>
 #include <list>
+#include <vector>
+#include <deque>
 #include <unordered_map>
 #include <stdint.h>
 #include "../common/database/AccountProperty.hpp"
 #include "../common/network/Utils.hpp"
 #include "../common/Logger.hpp"
+#include "IdentityStore.hpp"
 #include <boost/thread.hpp>
 
 typedef uint32_t UserID;
@@ -22,19 +25,42 @@ class Account {
         Account();
         ~Account();
 
-        void LoadInitializeData(UserID user_id, std::string data);
+        // 公開鍵と名前などをファイルに残して、再起動後も同じユーザーIDを使う
+        void OpenIdentityStore(const std::string& path);
+        void CloseIdentityStore();
 
+        // 全員の行と変更の記録 別のプロセスに引き継ぐ
+        // 読み込む場合は OpenIdentityStore の後に呼ぶ
+        std::string SaveState() const;
+        bool LoadState(const std::string& state);
+
+        void LoadInitializeData(UserID user_id, const network::ByteView& data);
+
+        // 全体の変更の通し番号
         uint32_t GetCurrentRevision();
+        // 通し番号を数え直していないかを確かめる値 引き継いだプロセスでは同じ
+        uint32_t instance_id() const;
         std::string GetUserRevisionPatch(UserID user_id, uint32_t revision);
 
+        // チャンネルにログインしている全員の、リビジョン0からのパッチと最後の位置
+        std::string GetChannelSnapshot(unsigned char channel);
+
+        // 通し番号 sequence より後の変更 (ClientReceiveAccountChanges)
+        // 変更の記録が残っていない場合や instance_id が違う場合は
+        // 全員のリビジョン0からのパッチを返す
+        std::string GetChangesSince(uint32_t instance_id, uint32_t sequence);
+
+        // 未登録の場合は 0 ファイルに残っているユーザーはここで読み込む
         UserID GetUserIdFromFingerPrint(const std::string&);
         std::string GetPublicKey(UserID);
+        // 登録済みの公開鍵の場合は既存のユーザーIDを返す
         UserID RegisterPublicKey(const std::string&);
 
         void LogIn(UserID);
         void LogOut(UserID);
         void LogOutAll();
 
+		// ログアウトしたままのアカウントを削除する
 		void Remove(UserID);
 
         std::string GetUserName(UserID) const;
@@ -46,10 +72,17 @@ class Account {
 
         std::string GetUserIPAddress(UserID) const;
         void SetUserIPAddress(UserID, const std::string&);
+
+        // 呼び出し側のバッファに共有ロックの中でコピーする 容量が足りていれば確保しない
+        // ユーザーがいない場合は空にして false を返す
+        bool GetUserName(UserID, std::string*) const;
+        bool GetUserTrip(UserID, std::string*) const;
+        bool GetUserModelName(UserID, std::string*) const;
+        bool GetUserIPAddress(UserID, std::string*) const;
         uint16_t GetUserUDPPort(UserID) const;
         void SetUserUDPPort(UserID, uint16_t);
         uint32_t GetUserRevision(UserID) const;
-		
+
         void SetUserChannel(UserID, unsigned char);
         unsigned char GetUserChannel(UserID) const;
 
@@ -59,67 +92,143 @@ class Account {
         std::vector<UserID> GetIDList() const;
 
     private:
+        // 値と、最後に変更されたときのリビジョンと全体の通し番号
         template <class T>
-        void Set(UserID user_id, AccountProperty property, T value, bool revision = true)
+        struct Column {
+            Column() : value(), revision(0), sequence(0), present(false) {}
+            T value;
+            uint32_t revision;
+            uint32_t sequence;
+            bool present;
+        };
+
+        // ユーザーIDを添字とする1行 よく読まれる小さな値を先頭に置く
+        struct Row {
+            Row() : exists(false), revision(0) {}
+            bool exists;
+            uint32_t revision;
+            Column<char> login;
+            Column<unsigned char> channel;
+            Column<uint16_t> udp_port;
+            Column<std::string> name;
+            Column<std::string> model_name;
+            Column<std::string> trip;
+            Column<std::string> ip_address;
+            Column<std::string> public_key;
+            std::string finger_print;
+        };
+
+        // 呼び出し側で mutex_ をロックしておくこと
+        const Row* FindRow(UserID user_id) const
+        {
+            if (user_id < rows_.size() && rows_[user_id].exists) {
+                return &rows_[user_id];
+            }
+            return nullptr;
+        }
+
+        // revision と sequence の両方より後に変更されたプロパティを書く
+        void AppendRevisionPatch(std::string* patch, UserID user_id, const Row& row,
+                uint32_t revision, uint32_t sequence = 0) const;
+
+        // 呼び出し側で mutex_ をロックしておくこと
+        UserID FindUserIdUnlocked(const std::string& finger_print);
+
+        // 名前などの変更をファイルに残す
+        void StoreIdentity(UserID user_id);
+
+        uint32_t GetColumnSequence(const Row& row, AccountProperty property) const;
+        void AppendChangeLog(UserID user_id, AccountProperty property, uint32_t sequence);
+
+        template <class T>
+        void Set(UserID user_id, AccountProperty property, Column<T> Row::*column,
+                const T& value, bool revision = true)
         {
 			if (user_id == 0) {
 				Logger::Error(_T("Invalid session id"));
 				return;
 			}
 
-            T old_value;
-            if (!Get(user_id, property, &old_value) || old_value != value) {
-				boost::unique_lock<boost::recursive_mutex> lock(mutex_);
+			boost::unique_lock<boost::shared_mutex> lock(mutex_);
+            SetUnlocked(user_id, property, column, value, revision);
+        }
 
-                if (user_map_.find(user_id) == user_map_.end()) {
-                    user_map_[user_id] = PropertyMap();
-                }
+        template <class T>
+        void SetUnlocked(UserID user_id, AccountProperty property, Column<T> Row::*column,
+                const T& value, bool revision)
+        {
+            if (user_id >= rows_.size()) {
+                rows_.resize(user_id + 1);
+            }
+
+            // 削除された行は初期値に戻してあるので、そのまま使える
+            Row& row = rows_[user_id];
+            Column<T>& target = row.*column;
+            if (target.present && target.value == value) {
+                return;
+            }
 
-                user_map_[user_id][property].value = network::Utils::Serialize(value);
+            row.exists = true;
+            target.value = value;
+            target.present = true;
 
-                if (revision) {
-                    uint32_t new_revision = GetUserRevision(user_id) + 1;
-                    Logger::Debug("Userdata Update %d %d Revision: %d",
-                              user_id, property, new_revision);
+            if (revision) {
+                uint32_t new_revision = row.revision + 1;
+                Logger::Debug("Userdata Update %d %d Revision: %d",
+                          user_id, property, new_revision);
 
-                    user_map_[user_id][property].revision = new_revision;
-                    Set(user_id, REVISION, new_revision, false);
-                }
+                target.revision = new_revision;
+                target.sequence = ++revision_;
+                row.revision = new_revision;
+                AppendChangeLog(user_id, property, target.sequence);
             }
         }
 
         template <class T>
-        bool Get(UserID user_id, AccountProperty property, T* value) const
+        T Get(UserID user_id, Column<T> Row::*column) const
         {
-            UserMap::const_iterator usermap_it;
-            if ((usermap_it = user_map_.find(user_id)) != user_map_.end()) {
-                PropertyMap::const_iterator property_it;
-                if ((property_it = usermap_it->second.find(property)) != usermap_it->second.end()) {
-                    network::Utils::Deserialize(property_it->second.value, value);
-                    return true;
-                }
+			boost::shared_lock<boost::shared_mutex> lock(mutex_);
+            if (const Row* row = FindRow(user_id)) {
+                return (row->*column).value;
             }
-            return false;
+            return T();
         }
 
-        struct PropertyValue {
-            PropertyValue() : revision(0) {}
-            uint32_t revision;
-            std::string value;
-        };
+        template <class T>
+        bool Get(UserID user_id, Column<T> Row::*column, T* value) const
+        {
+			boost::shared_lock<boost::shared_mutex> lock(mutex_);
+            if (const Row* row = FindRow(user_id)) {
+                *value = (row->*column).value;
+                return true;
+            }
+            *value = T();
+            return false;
+        }
 
-        typedef std::map<AccountProperty, PropertyValue> PropertyMap;
-        typedef std::map<UserID, PropertyMap> UserMap;
-        UserMap user_map_;
+        typedef std::vector<Row> RowList;
+        RowList rows_;
 
         typedef std::unordered_map<std::string, UserID> FingerprintMap;
         FingerprintMap fingerprint_map_;
+        std::unique_ptr<IdentityStore> identity_store_;
 
         typedef std::map<UserID, PlayerPosition> PositionMap;
         PositionMap position_map_;
 
+        // 通し番号の順に並んだ変更の記録
+        // 同じプロパティが再び変更された古い記録は、あふれた時にまとめて取り除く
+        struct ChangeLogEntry {
+            uint32_t sequence;
+            UserID user_id;
+            AccountProperty property;
+        };
+        std::deque<ChangeLogEntry> change_log_;
+        uint32_t change_log_floor_;     // これ以前の変更は記録に残っていない
+
         uint32_t revision_;
+        uint32_t instance_id_;
         UserID max_user_id_;
 
-		boost::recursive_mutex mutex_;
+		mutable boost::shared_mutex mutex_;
 };
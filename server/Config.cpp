@@ -60,6 +60,20 @@ void Config::Load()
 	receive_limit_1_ =	pt_.get<int>("receive_limit_1", 60);
 	receive_limit_2_ =	pt_.get<int>("receive_limit_2", 100);
 
+	io_threads_ =		pt_.get<int>("io_threads", 0);
+	write_flush_window_ = pt_.get<int>("write_flush_window", 0);
+	interest_radius_ =	pt_.get<int>("interest_radius", 0);
+	position_tick_rate_ = pt_.get<int>("position_tick_rate", 0);
+	udp_position_ =		pt_.get<bool>("udp_position", false);
+	position_delta_ =	pt_.get<bool>("position_delta", false);
+	stream_compression_ =	pt_.get<bool>("stream_compression", false);
+	keepalive_interval_ =	pt_.get<int>("keepalive_interval", 0);
+	crypto_threads_ =	pt_.get<int>("crypto_threads", 1);
+	crypto_queue_size_ =	pt_.get<int>("crypto_queue_size", 64);
+	session_ticket_lifetime_ =	pt_.get<int>("session_ticket_lifetime", 1800);
+	identity_store_ =	pt_.get<std::string>("identity_store", "accounts");
+	handoff_socket_ =	pt_.get<std::string>("handoff_socket", "");
+
 	auto patterns =		pt_.get_child("blocking_address_patterns", ptree());
 	BOOST_FOREACH(const auto& item, patterns) {
 		blocking_address_patterns_.push_back(item.second.get_value<std::string>());
@@ -75,13 +89,10 @@ void Config::Load()
 	}
 }
 
-void Config::Reload()
+bool Config::IsModified() const
 {
-	if (exists(CONFIG_JSON) &&
-		timestamp_ < last_write_time(CONFIG_JSON)) {
-		Config::Load();
-		Logger::Info(_T("Configuration reloaded."));
-	}
+	return exists(CONFIG_JSON) &&
+		timestamp_ < last_write_time(CONFIG_JSON);
 }
 
 //
@@ -128,6 +139,71 @@ int Config::receive_limit_2() const
 	return receive_limit_2_;
 }
 
+int Config::io_threads() const
+{
+	return io_threads_;
+}
+
+int Config::write_flush_window() const
+{
+	return write_flush_window_;
+}
+
+int Config::interest_radius() const
+{
+	return interest_radius_;
+}
+
+int Config::position_tick_rate() const
+{
+	return position_tick_rate_;
+}
+
+bool Config::udp_position() const
+{
+	return udp_position_;
+}
+
+bool Config::position_delta() const
+{
+	return position_delta_;
+}
+
+bool Config::stream_compression() const
+{
+	return stream_compression_;
+}
+
+int Config::keepalive_interval() const
+{
+	return keepalive_interval_;
+}
+
+int Config::crypto_threads() const
+{
+	return crypto_threads_;
+}
+
+int Config::crypto_queue_size() const
+{
+	return crypto_queue_size_;
+}
+
+int Config::session_ticket_lifetime() const
+{
+	return session_ticket_lifetime_;
+}
+
+const std::string& Config::identity_store() const
+{
+	return identity_store_;
+}
+
+const std::string& Config::handoff_socket() const
+{
+	return handoff_socket_;
+}
+
 const std::list<std::string>& Config::blocking_address_patterns() const
 {
 	return blocking_address_patterns_;
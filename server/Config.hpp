@@ -14,7 +14,10 @@ class Config
 {
     public:
 		Config();
-		void Reload();
+
+		// 読み込んだ後に config.json が更新されたか
+		// 読み込み直す場合は新しい Config を作る 作った後は変更しない
+		bool IsModified() const;
 
     private:
 		void Load();
@@ -29,6 +32,20 @@ class Config
 
 		int receive_limit_1_;
 		int receive_limit_2_;
+
+		int io_threads_;
+		int write_flush_window_;
+		int interest_radius_;
+		int position_tick_rate_;
+		bool udp_position_;
+		bool position_delta_;
+		bool stream_compression_;
+		int keepalive_interval_;
+		int crypto_threads_;
+		int crypto_queue_size_;
+		int session_ticket_lifetime_;
+		std::string identity_store_;
+		std::string handoff_socket_;
 		
 		std::list<std::string> blocking_address_patterns_;
 		std::list<std::string> lobby_servers_;
@@ -48,6 +65,20 @@ class Config
 		int receive_limit_1() const;
 		int receive_limit_2() const;
 
+		int io_threads() const;
+		int write_flush_window() const;
+		int interest_radius() const;
+		int position_tick_rate() const;
+		bool udp_position() const;
+		bool position_delta() const;
+		bool stream_compression() const;
+		int keepalive_interval() const;
+		int crypto_threads() const;
+		int crypto_queue_size() const;
+		int session_ticket_lifetime() const;
+		const std::string& identity_store() const;
+		const std::string& handoff_socket() const;
+
 		const std::list<std::string>& blocking_address_patterns() const;
 		const std::list<std::string>& lobby_servers() const;
 
@@ -57,3 +88,5 @@ class Config
 		static const char* CONFIG_JSON;
 		time_t timestamp_;
 };
+
+typedef std::shared_ptr<const Config> ConfigPtr;
@@ -0,0 +1,145 @@
+//
+// CryptoPool.cpp
+//
+
+#include "CryptoPool.hpp"
+#include "../common/Logger.hpp"
+#include <algorithm>
+
+namespace network {
+
+using namespace boost::posix_time;
+
+CryptoPool::CryptoPool(size_t threads, size_t capacity) :
+    capacity_(std::max<size_t>(1, capacity)),
+    thread_count_(std::max<size_t>(1, threads)),
+    executed_count_(0),
+    rejected_count_(0),
+    queue_msec_sum_(0),
+    max_queue_msec_(0),
+    exec_msec_sum_(0),
+    max_exec_msec_(0),
+    running_(true)
+{
+    for (size_t i = 0; i < thread_count_; i++) {
+        threads_.create_thread(boost::bind(&CryptoPool::Run, this));
+    }
+}
+
+CryptoPool::~CryptoPool()
+{
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        running_ = false;
+    }
+    condition_.notify_all();
+    threads_.join_all();
+}
+
+bool CryptoPool::Post(const Job& job)
+{
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        if (tasks_.size() >= capacity_) {
+            rejected_count_++;
+            return false;
+        }
+
+        Task task;
+        task.job = job;
+        task.queued_time = microsec_clock::universal_time();
+        tasks_.push_back(task);
+    }
+    condition_.notify_one();
+    return true;
+}
+
+void CryptoPool::Run()
+{
+    while (true) {
+        Task task;
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            while (running_ && tasks_.empty()) {
+                condition_.wait(lock);
+            }
+            if (!running_) {
+                break;
+            }
+            task = tasks_.front();
+            tasks_.pop_front();
+        }
+
+        auto start_time = microsec_clock::universal_time();
+        try {
+            task.job();
+        } catch (std::exception& e) {
+            Logger::Error("Crypto job failed: %s", e.what());
+        }
+        auto end_time = microsec_clock::universal_time();
+
+        double queue_msec = (start_time - task.queued_time).total_microseconds() / 1000.0;
+        double exec_msec = (end_time - start_time).total_microseconds() / 1000.0;
+
+        boost::mutex::scoped_lock lock(mutex_);
+        executed_count_++;
+        queue_msec_sum_ += queue_msec;
+        max_queue_msec_ = std::max(max_queue_msec_, queue_msec);
+        exec_msec_sum_ += exec_msec;
+        max_exec_msec_ = std::max(max_exec_msec_, exec_msec);
+    }
+}
+
+size_t CryptoPool::depth() const
+{
+    boost::mutex::scoped_lock lock(mutex_);
+    return tasks_.size();
+}
+
+size_t CryptoPool::capacity() const
+{
+    return capacity_;
+}
+
+size_t CryptoPool::threads() const
+{
+    return thread_count_;
+}
+
+int CryptoPool::executed_count() const
+{
+    boost::mutex::scoped_lock lock(mutex_);
+    return executed_count_;
+}
+
+int CryptoPool::rejected_count() const
+{
+    boost::mutex::scoped_lock lock(mutex_);
+    return rejected_count_;
+}
+
+double CryptoPool::average_queue_msec() const
+{
+    boost::mutex::scoped_lock lock(mutex_);
+    return executed_count_ > 0 ? queue_msec_sum_ / executed_count_ : 0;
+}
+
+double CryptoPool::max_queue_msec() const
+{
+    boost::mutex::scoped_lock lock(mutex_);
+    return max_queue_msec_;
+}
+
+double CryptoPool::average_exec_msec() const
+{
+    boost::mutex::scoped_lock lock(mutex_);
+    return executed_count_ > 0 ? exec_msec_sum_ / executed_count_ : 0;
+}
+
+double CryptoPool::max_exec_msec() const
+{
+    boost::mutex::scoped_lock lock(mutex_);
+    return max_exec_msec_;
+}
+
+}
@@ -0,0 +1,68 @@
+//
+// CryptoPool.hpp
+//
+
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <functional>
+#include <boost/thread.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+namespace network {
+
+// ハンドシェイクの公開鍵暗号の処理を、通信スレッドとは別のスレッドで行う
+// 待ち行列は capacity 個までで、あふれた処理は受け付けない
+class CryptoPool {
+    public:
+        typedef std::function<void()> Job;
+
+        CryptoPool(size_t threads, size_t capacity);
+        ~CryptoPool();
+
+        // 待ち行列が一杯の場合は false
+        bool Post(const Job& job);
+
+        size_t depth() const;
+        size_t capacity() const;
+        size_t threads() const;
+        int executed_count() const;
+        int rejected_count() const;
+
+        // 待ち行列で待った時間と、実行にかかった時間
+        double average_queue_msec() const;
+        double max_queue_msec() const;
+        double average_exec_msec() const;
+        double max_exec_msec() const;
+
+    private:
+        void Run();
+
+    private:
+        struct Task {
+            Job job;
+            boost::posix_time::ptime queued_time;
+        };
+
+        const size_t capacity_;
+        const size_t thread_count_;
+
+        std::deque<Task> tasks_;
+
+        int executed_count_;
+        int rejected_count_;
+        double queue_msec_sum_;
+        double max_queue_msec_;
+        double exec_msec_sum_;
+        double max_exec_msec_;
+
+        bool running_;
+        mutable boost::mutex mutex_;
+        boost::condition_variable condition_;
+        boost::thread_group threads_;
+};
+
+typedef std::shared_ptr<CryptoPool> CryptoPoolPtr;
+
+}
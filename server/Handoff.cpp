@@ -0,0 +1,256 @@
+//
+// Handoff.cpp
+//
+
+#include "Handoff.hpp"
+#include "../common/network/Utils.hpp"
+#include <cstring>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#endif
+
+namespace network {
+
+HandoffChannel::HandoffChannel() :
+    fd_(-1)
+{
+}
+
+HandoffChannel::HandoffChannel(int fd) :
+    fd_(fd)
+{
+}
+
+HandoffChannel::~HandoffChannel()
+{
+    if (fd_ >= 0) {
+        CloseAll(std::vector<int>(1, fd_));
+    }
+}
+
+#ifdef __linux__
+
+bool HandoffChannel::Connect(const std::string& path)
+{
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+        return false;
+    }
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, path.data(), path.size());
+
+    fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd_ < 0) {
+        return false;
+    }
+    if (connect(fd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        close(fd_);
+        fd_ = -1;
+        return false;
+    }
+    return true;
+}
+
+bool HandoffChannel::PeerIsSameUser() const
+{
+    return IsSameUser(fd_);
+}
+
+bool HandoffChannel::IsSameUser(int fd)
+{
+    ucred credentials;
+    socklen_t length = sizeof(credentials);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) != 0) {
+        return false;
+    }
+    return credentials.uid == geteuid();
+}
+
+void HandoffChannel::SetTimeout(int msec)
+{
+    timeval timeout;
+    timeout.tv_sec = msec / 1000;
+    timeout.tv_usec = (msec % 1000) * 1000;
+    setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd_, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+bool HandoffChannel::Send(const std::string& payload, const std::vector<int>& fds)
+{
+    if (fd_ < 0 || fds.size() > HANDOFF_MAX_FDS || payload.size() > HANDOFF_MAX_PAYLOAD_SIZE) {
+        return false;
+    }
+
+    std::string length = Utils::Serialize(static_cast<uint32_t>(payload.size()));
+    iovec iov;
+    iov.iov_base = &length[0];
+    iov.iov_len = length.size();
+
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    msghdr message;
+    std::memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    if (!fds.empty()) {
+        std::memset(control, 0, sizeof(control));
+        message.msg_control = control;
+        message.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+        std::memcpy(CMSG_DATA(cmsg), &fds[0], sizeof(int) * fds.size());
+    }
+
+    // ファイルディスクリプタは最初の1バイトに付いて届く
+    ssize_t sent = sendmsg(fd_, &message, MSG_NOSIGNAL);
+    if (sent <= 0) {
+        return false;
+    }
+    return WriteAll(length.data() + sent, length.size() - sent) &&
+        WriteAll(payload.data(), payload.size());
+}
+
+bool HandoffChannel::Receive(std::string* payload, std::vector<int>* fds)
+{
+    if (fd_ < 0) {
+        return false;
+    }
+
+    char length[sizeof(uint32_t)];
+    iovec iov;
+    iov.iov_base = length;
+    iov.iov_len = sizeof(length);
+
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    msghdr message;
+    std::memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    ssize_t received = recvmsg(fd_, &message, MSG_CMSG_CLOEXEC);
+    if (received <= 0) {
+        return false;
+    }
+
+    std::vector<int> received_fds;
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            const size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const int* data = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+            received_fds.insert(received_fds.end(), data, data + count);
+        }
+    }
+
+    uint32_t size;
+    if ((message.msg_flags & MSG_CTRUNC) ||
+            !ReadAll(length + received, sizeof(length) - received) ||
+            !Utils::Deserialize(std::string(length, sizeof(length)), &size) ||
+            size > HANDOFF_MAX_PAYLOAD_SIZE) {
+        CloseAll(received_fds);
+        return false;
+    }
+
+    payload->resize(size);
+    if (size > 0 && !ReadAll(&(*payload)[0], size)) {
+        CloseAll(received_fds);
+        return false;
+    }
+
+    if (fds) {
+        fds->swap(received_fds);
+    } else {
+        CloseAll(received_fds);
+    }
+    return true;
+}
+
+void HandoffChannel::CloseAll(const std::vector<int>& fds)
+{
+    for (size_t i = 0; i < fds.size(); i++) {
+        close(fds[i]);
+    }
+}
+
+bool HandoffChannel::WriteAll(const char* data, size_t size)
+{
+    while (size > 0) {
+        ssize_t sent = send(fd_, data, size, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+bool HandoffChannel::ReadAll(char* data, size_t size)
+{
+    while (size > 0) {
+        ssize_t received = recv(fd_, data, size, 0);
+        if (received <= 0) {
+            return false;
+        }
+        data += received;
+        size -= received;
+    }
+    return true;
+}
+
+#else
+
+bool HandoffChannel::Connect(const std::string& path)
+{
+    return false;
+}
+
+bool HandoffChannel::PeerIsSameUser() const
+{
+    return false;
+}
+
+bool HandoffChannel::IsSameUser(int fd)
+{
+    return false;
+}
+
+void HandoffChannel::SetTimeout(int msec)
+{
+}
+
+bool HandoffChannel::Send(const std::string& payload, const std::vector<int>& fds)
+{
+    return false;
+}
+
+bool HandoffChannel::Receive(std::string* payload, std::vector<int>* fds)
+{
+    return false;
+}
+
+void HandoffChannel::CloseAll(const std::vector<int>& fds)
+{
+}
+
+bool HandoffChannel::WriteAll(const char* data, size_t size)
+{
+    return false;
+}
+
+bool HandoffChannel::ReadAll(char* data, size_t size)
+{
+    return false;
+}
+
+#endif
+
+}
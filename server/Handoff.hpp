@@ -0,0 +1,51 @@
+//
+// Handoff.hpp
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <boost/noncopyable.hpp>
+
+#define HANDOFF_VERSION (2)
+#define HANDOFF_MAX_FDS (2)
+#define HANDOFF_MAX_PAYLOAD_SIZE (64 << 20)
+
+namespace network {
+
+// 再起動のために、ソケットと状態を UNIX ドメインソケットで新しいプロセスに渡す
+// 1つの記録は長さ(4バイト)と本文で、ファイルディスクリプタは長さと一緒に送る
+// Linux 以外では常に失敗する
+class HandoffChannel : boost::noncopyable {
+    public:
+        HandoffChannel();
+        // 受け付けた接続 閉じるのはこのオブジェクト
+        explicit HandoffChannel(int fd);
+        ~HandoffChannel();
+
+        bool Connect(const std::string& path);
+
+        // 相手のプロセスが同じユーザーで動いているか
+        bool PeerIsSameUser() const;
+        static bool IsSameUser(int fd);
+
+        // 送受信を待つ時間の上限
+        void SetTimeout(int msec);
+
+        bool Send(const std::string& payload, const std::vector<int>& fds = std::vector<int>());
+
+        // 受け取ったファイルディスクリプタは呼び出し側で閉じる
+        bool Receive(std::string* payload, std::vector<int>* fds = nullptr);
+
+        static void CloseAll(const std::vector<int>& fds);
+
+    private:
+        bool WriteAll(const char* data, size_t size);
+        bool ReadAll(char* data, size_t size);
+
+    private:
+        int fd_;
+};
+
+}
@@ -0,0 +1,358 @@
+//
+// IdentityStore.cpp
+//
+
+#include "IdentityStore.hpp"
+#include "../common/network/Utils.hpp"
+#include "../common/Logger.hpp"
+#include <fstream>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+#include <boost/filesystem.hpp>
+
+#define IDENTITY_STORE_INDEX_MAGIC "MMOIDX01"
+#define IDENTITY_STORE_DATA_MAGIC "MMODAT01"
+#define IDENTITY_STORE_MAGIC_SIZE (8)
+#define IDENTITY_STORE_DATA_HEADER_SIZE (16)
+#define IDENTITY_STORE_INITIAL_CAPACITY (1024)
+#define IDENTITY_STORE_INITIAL_DATA_SIZE (1 << 20)
+
+using namespace boost::interprocess;
+
+// path.idx の先頭 続けて capacity 個のスロットが並ぶ
+struct IdentityStore::Header {
+    char magic[IDENTITY_STORE_MAGIC_SIZE];
+    uint32_t capacity;      // 2の累乗
+    uint32_t count;
+    uint32_t max_user_id;
+    uint32_t reserved;
+    uint64_t data_size;     // path.dat の書き込みが終わった位置
+};
+
+// offset が 0 のスロットは空き
+struct IdentityStore::Slot {
+    uint64_t hash;
+    uint64_t offset;
+};
+
+namespace {
+
+uint64_t HashFingerPrint(const std::string& finger_print)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < finger_print.size(); i++) {
+        hash = (hash ^ static_cast<uint8_t>(finger_print[i])) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// 0 で埋めたファイルを作る
+void CreateZeroFile(const std::string& path, uint64_t size)
+{
+    std::filebuf file;
+    file.open(path.c_str(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+    file.close();
+    boost::filesystem::resize_file(path, size);
+}
+
+}
+
+IdentityStore::IdentityStore(const std::string& path) :
+    index_path_(path + ".idx"),
+    data_path_(path + ".dat")
+{
+    if (!boost::filesystem::exists(data_path_)) {
+        CreateZeroFile(data_path_, IDENTITY_STORE_INITIAL_DATA_SIZE);
+        MapData();
+        std::memcpy(data_region_->get_address(), IDENTITY_STORE_DATA_MAGIC, IDENTITY_STORE_MAGIC_SIZE);
+    } else {
+        MapData();
+    }
+
+    if (data_region_->get_size() < IDENTITY_STORE_DATA_HEADER_SIZE ||
+            std::memcmp(data_region_->get_address(), IDENTITY_STORE_DATA_MAGIC, IDENTITY_STORE_MAGIC_SIZE) != 0) {
+        throw std::runtime_error("Invalid identity store: " + data_path_);
+    }
+
+    if (boost::filesystem::exists(index_path_)) {
+        MapIndex();
+    }
+    if (!IndexValid()) {
+        Logger::Info("Rebuild identity index: %s", index_path_);
+        RebuildIndex();
+    }
+}
+
+IdentityStore::~IdentityStore()
+{
+    if (index_region_) {
+        index_region_->flush();
+    }
+    if (data_region_) {
+        data_region_->flush();
+    }
+}
+
+bool IdentityStore::Find(const std::string& finger_print, Identity* identity)
+{
+    boost::mutex::scoped_lock lock(mutex_);
+    const uint32_t index = FindSlot(finger_print, HashFingerPrint(finger_print), identity);
+    return slots()[index].offset != 0;
+}
+
+uint32_t IdentityStore::Register(const std::string& finger_print, const std::string& public_key)
+{
+    boost::mutex::scoped_lock lock(mutex_);
+    Identity identity;
+    identity.user_id = ++header()->max_user_id;
+    identity.public_key = public_key;
+
+    const uint64_t hash = HashFingerPrint(finger_print);
+    uint32_t index = FindSlot(finger_print, hash);
+    if (slots()[index].offset == 0 && (header()->count + 1) * 4 > header()->capacity * 3) {
+        GrowIndex();
+        index = FindSlot(finger_print, hash);
+    }
+
+    // 記録を書き終えてからスロットを向ける
+    const uint64_t offset = AppendRecord(finger_print, identity);
+    Slot& slot = slots()[index];
+    if (slot.offset == 0) {
+        slot.hash = hash;
+        header()->count++;
+    }
+    slot.offset = offset;
+
+    return identity.user_id;
+}
+
+void IdentityStore::Update(const std::string& finger_print, const Identity& identity)
+{
+    boost::mutex::scoped_lock lock(mutex_);
+    Identity stored;
+    const uint32_t index = FindSlot(finger_print, HashFingerPrint(finger_print), &stored);
+    if (slots()[index].offset == 0) {
+        return;
+    }
+
+    if (stored.user_id == identity.user_id &&
+            stored.public_key == identity.public_key &&
+            stored.name == identity.name &&
+            stored.trip == identity.trip &&
+            stored.model_name == identity.model_name) {
+        return;
+    }
+
+    const uint64_t offset = AppendRecord(finger_print, identity);
+    slots()[index].offset = offset;
+}
+
+uint32_t IdentityStore::max_user_id() const
+{
+    boost::mutex::scoped_lock lock(mutex_);
+    return header()->max_user_id;
+}
+
+size_t IdentityStore::size() const
+{
+    boost::mutex::scoped_lock lock(mutex_);
+    return header()->count;
+}
+
+IdentityStore::Header* IdentityStore::header() const
+{
+    return static_cast<Header*>(index_region_->get_address());
+}
+
+IdentityStore::Slot* IdentityStore::slots() const
+{
+    return reinterpret_cast<Slot*>(header() + 1);
+}
+
+void IdentityStore::MapIndex()
+{
+    index_region_.reset();
+    index_file_.reset(new file_mapping(index_path_.c_str(), read_write));
+    index_region_.reset(new mapped_region(*index_file_, read_write));
+}
+
+void IdentityStore::MapData()
+{
+    data_region_.reset();
+    data_file_.reset(new file_mapping(data_path_.c_str(), read_write));
+    data_region_.reset(new mapped_region(*data_file_, read_write));
+}
+
+bool IdentityStore::IndexValid() const
+{
+    if (!index_region_ || index_region_->get_size() < sizeof(Header)) {
+        return false;
+    }
+
+    const Header* h = header();
+    return std::memcmp(h->magic, IDENTITY_STORE_INDEX_MAGIC, IDENTITY_STORE_MAGIC_SIZE) == 0 &&
+        h->capacity > 0 && (h->capacity & (h->capacity - 1)) == 0 &&
+        index_region_->get_size() >= sizeof(Header) + h->capacity * sizeof(Slot) &&
+        h->count < h->capacity &&
+        h->data_size >= IDENTITY_STORE_DATA_HEADER_SIZE &&
+        h->data_size <= data_region_->get_size();
+}
+
+void IdentityStore::CreateIndex(const std::string& path, uint32_t capacity)
+{
+    CreateZeroFile(path, sizeof(Header) + capacity * sizeof(Slot));
+
+    file_mapping file(path.c_str(), read_write);
+    mapped_region region(file, read_write);
+    Header* h = static_cast<Header*>(region.get_address());
+    std::memcpy(h->magic, IDENTITY_STORE_INDEX_MAGIC, IDENTITY_STORE_MAGIC_SIZE);
+    h->capacity = capacity;
+    h->data_size = IDENTITY_STORE_DATA_HEADER_SIZE;
+}
+
+void IdentityStore::RebuildIndex()
+{
+    index_region_.reset();
+    index_file_.reset();
+    CreateIndex(index_path_, IDENTITY_STORE_INITIAL_CAPACITY);
+    MapIndex();
+
+    // 同じフィンガープリントは後の記録で上書きする
+    uint64_t offset = IDENTITY_STORE_DATA_HEADER_SIZE;
+    std::string finger_print;
+    Identity identity;
+    uint32_t record_size;
+    while (ReadRecord(offset, &finger_print, &identity, &record_size)) {
+        const uint64_t hash = HashFingerPrint(finger_print);
+        uint32_t index = FindSlot(finger_print, hash);
+        if (slots()[index].offset == 0) {
+            if ((header()->count + 1) * 4 > header()->capacity * 3) {
+                GrowIndex();
+                index = FindSlot(finger_print, hash);
+            }
+            slots()[index].hash = hash;
+            header()->count++;
+        }
+        slots()[index].offset = offset;
+        header()->max_user_id = std::max(header()->max_user_id, identity.user_id);
+        offset += record_size;
+    }
+    header()->data_size = offset;
+}
+
+void IdentityStore::GrowIndex()
+{
+    // 倍の大きさの表を別のファイルに作ってから置き換える
+    const uint32_t capacity = header()->capacity * 2;
+    const uint32_t mask = capacity - 1;
+    const std::string temp_path = index_path_ + ".tmp";
+    CreateIndex(temp_path, capacity);
+    {
+        file_mapping temp_file(temp_path.c_str(), read_write);
+        mapped_region temp_region(temp_file, read_write);
+        Header* temp_header = static_cast<Header*>(temp_region.get_address());
+        *temp_header = *header();
+        temp_header->capacity = capacity;
+
+        Slot* temp_slots = reinterpret_cast<Slot*>(temp_header + 1);
+        const Slot* old_slots = slots();
+        for (uint32_t i = 0; i < header()->capacity; i++) {
+            if (old_slots[i].offset == 0) {
+                continue;
+            }
+            uint32_t index = old_slots[i].hash & mask;
+            while (temp_slots[index].offset != 0) {
+                index = (index + 1) & mask;
+            }
+            temp_slots[index] = old_slots[i];
+        }
+        temp_region.flush();
+    }
+
+    index_region_.reset();
+    index_file_.reset();
+    boost::filesystem::rename(temp_path, index_path_);
+    MapIndex();
+}
+
+void IdentityStore::ReserveData(size_t size)
+{
+    const uint64_t required = header()->data_size + size;
+    uint64_t capacity = data_region_->get_size();
+    if (required <= capacity) {
+        return;
+    }
+
+    while (capacity < required) {
+        capacity *= 2;
+    }
+    data_region_.reset();
+    data_file_.reset();
+    boost::filesystem::resize_file(data_path_, capacity);
+    MapData();
+}
+
+uint32_t IdentityStore::FindSlot(const std::string& finger_print, uint64_t hash,
+        Identity* identity) const
+{
+    // 線形探査 ハッシュが一致したら記録のフィンガープリントで確かめる
+    const uint32_t mask = header()->capacity - 1;
+    const Slot* s = slots();
+    uint32_t index = hash & mask;
+    std::string stored_finger_print;
+    Identity stored;
+    while (s[index].offset != 0) {
+        if (s[index].hash == hash &&
+                ReadRecord(s[index].offset, &stored_finger_print, &stored) &&
+                stored_finger_print == finger_print) {
+            if (identity) {
+                *identity = stored;
+            }
+            return index;
+        }
+        index = (index + 1) & mask;
+    }
+    return index;
+}
+
+bool IdentityStore::ReadRecord(uint64_t offset, std::string* finger_print, Identity* identity,
+        uint32_t* record_size) const
+{
+    // 本文の長さ | ユーザーID, フィンガープリント, 公開鍵, 名前, トリップ, モデル名
+    const uint64_t size = data_region_->get_size();
+    uint32_t body_size;
+    if (offset + sizeof(body_size) > size) {
+        return false;
+    }
+    const char* data = static_cast<const char*>(data_region_->get_address()) + offset;
+    std::memcpy(&body_size, data, sizeof(body_size));
+    if (body_size == 0 || offset + sizeof(body_size) + body_size > size) {
+        return false;
+    }
+
+    network::BinaryReader reader(data + sizeof(body_size), body_size);
+    if (!reader.Read(&identity->user_id, finger_print, &identity->public_key,
+                &identity->name, &identity->trip, &identity->model_name)) {
+        return false;
+    }
+    if (record_size) {
+        *record_size = sizeof(body_size) + body_size;
+    }
+    return true;
+}
+
+uint64_t IdentityStore::AppendRecord(const std::string& finger_print, const Identity& identity)
+{
+    const std::string body = network::Utils::Serialize(identity.user_id, finger_print,
+            identity.public_key, identity.name, identity.trip, identity.model_name);
+    const uint32_t body_size = body.size();
+    ReserveData(sizeof(body_size) + body.size());
+
+    const uint64_t offset = header()->data_size;
+    char* data = static_cast<char*>(data_region_->get_address()) + offset;
+    std::memcpy(data, &body_size, sizeof(body_size));
+    std::memcpy(data + sizeof(body_size), body.data(), body.size());
+    header()->data_size = offset + sizeof(body_size) + body.size();
+    return offset;
+}
@@ -0,0 +1,79 @@
+//
+// IdentityStore.hpp
+//
+
+#pragma once
+
+#include <string>
+#include <memory>
+#include <stdint.h>
+#include <boost/thread.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+// 公開鍵のフィンガープリントからユーザーを引く、再起動しても残る索引
+// 記録は path.dat に追記するだけで書き換えず、path.idx のハッシュ表が各ユーザーの最新の記録を指す
+// どちらもメモリにマップするので、起動時に記録を読み直す必要はない
+// path.idx が無いか壊れている場合だけ、path.dat を先頭から読んで作り直す
+class IdentityStore {
+    public:
+        // 再起動後も引き継ぐユーザーの情報
+        struct Identity {
+            Identity() : user_id(0) {}
+            uint32_t user_id;
+            std::string public_key;
+            std::string name;
+            std::string trip;
+            std::string model_name;
+        };
+
+        explicit IdentityStore(const std::string& path);
+        ~IdentityStore();
+
+        // 見つからない場合は false
+        bool Find(const std::string& finger_print, Identity* identity);
+
+        // 新しいユーザーIDを発行して記録する
+        uint32_t Register(const std::string& finger_print, const std::string& public_key);
+
+        // 記録されている内容と違う場合だけ追記する
+        void Update(const std::string& finger_print, const Identity& identity);
+
+        uint32_t max_user_id() const;
+        size_t size() const;
+
+    private:
+        struct Header;
+        struct Slot;
+
+        Header* header() const;
+        Slot* slots() const;
+
+        void MapIndex();
+        void MapData();
+        bool IndexValid() const;
+        void CreateIndex(const std::string& path, uint32_t capacity);
+        void RebuildIndex();
+        void GrowIndex();
+        void ReserveData(size_t size);
+
+        // フィンガープリントのスロット 無い場合は挿入する位置
+        // 見つかった場合は identity に記録を読み込む
+        uint32_t FindSlot(const std::string& finger_print, uint64_t hash,
+                Identity* identity = nullptr) const;
+
+        bool ReadRecord(uint64_t offset, std::string* finger_print, Identity* identity,
+                uint32_t* record_size = nullptr) const;
+        uint64_t AppendRecord(const std::string& finger_print, const Identity& identity);
+
+    private:
+        const std::string index_path_;
+        const std::string data_path_;
+
+        std::unique_ptr<boost::interprocess::file_mapping> index_file_;
+        std::unique_ptr<boost::interprocess::mapped_region> index_region_;
+        std::unique_ptr<boost::interprocess::file_mapping> data_file_;
+        std::unique_ptr<boost::interprocess::mapped_region> data_region_;
+
+        mutable boost::mutex mutex_;
+};
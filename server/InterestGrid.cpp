@@ -0,0 +1,170 @@
+//
+// InterestGrid.cpp
+//
+
+#include "InterestGrid.hpp"
+#include <algorithm>
+#include <boost/foreach.hpp>
+
+namespace network {
+
+InterestGrid::InterestGrid(int radius) :
+    radius_(std::max(radius, 1)),
+    leave_radius_(radius_ + radius_ / 8)
+{
+}
+
+void InterestGrid::Update(UserID user_id, int channel, const PlayerPosition& pos, Result* result)
+{
+    boost::mutex::scoped_lock lock(mutex_);
+
+    const int cell_x = CellIndex(pos.x);
+    const int cell_z = CellIndex(pos.z);
+    const uint64_t cell = CellKey(channel, cell_x, cell_z);
+
+    // チャンネルが変わった場合は一度抜けてから入り直す
+    auto it = members_.find(user_id);
+    if (it != members_.end() && it->second.channel != channel) {
+        Leave(user_id, &it->second, result);
+        members_.erase(it);
+        it = members_.end();
+    }
+
+    if (it == members_.end()) {
+        Member member;
+        member.channel = channel;
+        member.pos = pos;
+        member.cell = cell;
+        it = members_.insert(std::make_pair(user_id, member)).first;
+        cells_[cell].push_back(user_id);
+    } else {
+        it->second.pos = pos;
+        if (it->second.cell != cell) {
+            RemoveFromCell(user_id, it->second.cell);
+            cells_[cell].push_back(user_id);
+            it->second.cell = cell;
+        }
+    }
+
+    Member& self = it->second;
+
+    // 範囲から出た相手
+    std::vector<UserID> visible(self.visible.begin(), self.visible.end());
+    BOOST_FOREACH(UserID other_id, visible) {
+        auto other = members_.find(other_id);
+        if (other == members_.end() || !InRange(pos, other->second.pos, leave_radius_)) {
+            self.visible.erase(other_id);
+            if (other != members_.end()) {
+                other->second.visible.erase(user_id);
+            }
+            result->left.push_back(other_id);
+        }
+    }
+
+    // 範囲に入った相手 セルの大きさは leave_radius_ なので周囲9セルを見れば足りる
+    for (int dx = -1; dx <= 1; dx++) {
+        for (int dz = -1; dz <= 1; dz++) {
+            auto cell_it = cells_.find(CellKey(channel, cell_x + dx, cell_z + dz));
+            if (cell_it == cells_.end()) {
+                continue;
+            }
+            BOOST_FOREACH(UserID other_id, cell_it->second) {
+                if (other_id == user_id || self.visible.count(other_id)) {
+                    continue;
+                }
+                auto& other = members_[other_id];
+                if (InRange(pos, other.pos, radius_)) {
+                    self.visible.insert(other_id);
+                    other.visible.insert(user_id);
+                    result->entered.push_back(std::make_pair(other_id, other.pos));
+                }
+            }
+        }
+    }
+
+    // 範囲に入った相手には入場の通知で位置を送るので除く
+    result->receivers.reserve(self.visible.size());
+    BOOST_FOREACH(UserID other_id, self.visible) {
+        bool entered = std::any_of(result->entered.begin(), result->entered.end(),
+            [other_id](const std::pair<UserID, PlayerPosition>& pair){
+                return pair.first == other_id;
+            });
+        if (!entered) {
+            result->receivers.push_back(other_id);
+        }
+    }
+}
+
+void InterestGrid::Remove(UserID user_id, Result* result)
+{
+    boost::mutex::scoped_lock lock(mutex_);
+
+    auto it = members_.find(user_id);
+    if (it != members_.end()) {
+        Leave(user_id, &it->second, result);
+        members_.erase(it);
+    }
+}
+
+std::vector<InterestGrid::UserID> InterestGrid::GetVisible(UserID user_id)
+{
+    boost::mutex::scoped_lock lock(mutex_);
+
+    auto it = members_.find(user_id);
+    if (it != members_.end()) {
+        return std::vector<UserID>(it->second.visible.begin(), it->second.visible.end());
+    }
+    return std::vector<UserID>();
+}
+
+int InterestGrid::radius() const
+{
+    return radius_;
+}
+
+uint64_t InterestGrid::CellKey(int channel, int cell_x, int cell_z) const
+{
+    return (static_cast<uint64_t>(channel & 0xFFFF) << 32) |
+        (static_cast<uint64_t>(static_cast<uint16_t>(cell_x)) << 16) |
+        static_cast<uint64_t>(static_cast<uint16_t>(cell_z));
+}
+
+int InterestGrid::CellIndex(int value) const
+{
+    return value >= 0 ? value / leave_radius_ : -((-value + leave_radius_ - 1) / leave_radius_);
+}
+
+bool InterestGrid::InRange(const PlayerPosition& a, const PlayerPosition& b, int radius) const
+{
+    const int64_t dx = a.x - b.x;
+    const int64_t dz = a.z - b.z;
+    return dx * dx + dz * dz <= static_cast<int64_t>(radius) * radius;
+}
+
+void InterestGrid::Leave(UserID user_id, Member* member, Result* result)
+{
+    BOOST_FOREACH(UserID other_id, member->visible) {
+        auto other = members_.find(other_id);
+        if (other != members_.end()) {
+            other->second.visible.erase(user_id);
+        }
+        result->left.push_back(other_id);
+    }
+    member->visible.clear();
+    RemoveFromCell(user_id, member->cell);
+}
+
+void InterestGrid::RemoveFromCell(UserID user_id, uint64_t cell)
+{
+    auto it = cells_.find(cell);
+    if (it == cells_.end()) {
+        return;
+    }
+    auto& users = it->second;
+    users.erase(std::remove(users.begin(), users.end(), user_id), users.end());
+    if (users.empty()) {
+        cells_.erase(it);
+    }
+}
+
+}
@@ -0,0 +1,65 @@
+//
+// InterestGrid.hpp
+//
+
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <stdint.h>
+#include <boost/thread.hpp>
+#include "../common/database/AccountProperty.hpp"
+
+namespace network {
+
+// チャンネルごとにプレイヤーを格子に分けて、互いに見える範囲のプレイヤーを管理する
+class InterestGrid {
+    public:
+        typedef uint32_t UserID;
+
+        struct Result {
+            std::vector<UserID> receivers;  // 移動を通知する相手
+            std::vector<std::pair<UserID, PlayerPosition>> entered; // 範囲に入った相手と位置
+            std::vector<UserID> left;       // 範囲から出た相手
+        };
+
+        InterestGrid(int radius);
+
+        // 位置を更新し、通知先と範囲の出入りを result に返す
+        void Update(UserID user_id, int channel, const PlayerPosition& pos, Result* result);
+        void Remove(UserID user_id, Result* result);
+
+        // 互いに見えている相手の一覧
+        std::vector<UserID> GetVisible(UserID user_id);
+
+        int radius() const;
+
+    private:
+        struct Member {
+            int channel;
+            PlayerPosition pos;
+            uint64_t cell;
+            std::unordered_set<UserID> visible;
+        };
+
+        uint64_t CellKey(int channel, int cell_x, int cell_z) const;
+        int CellIndex(int value) const;
+        bool InRange(const PlayerPosition& a, const PlayerPosition& b, int radius) const;
+
+        void Leave(UserID user_id, Member* member, Result* result);
+        void RemoveFromCell(UserID user_id, uint64_t cell);
+
+    private:
+        const int radius_;
+
+        // 境界付近で出入りを繰り返さないよう、出る判定は少し広く取る
+        const int leave_radius_;
+
+        std::unordered_map<UserID, Member> members_;
+        std::unordered_map<uint64_t, std::vector<UserID>> cells_;
+
+        boost::mutex mutex_;
+};
+
+}
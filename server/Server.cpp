@@ -5,6 +5,8 @@
 #include "Server.hpp"
 #include "version.hpp"
 #include <algorithm>
+#include <unordered_set>
+#include <stdexcept>
 #include <boost/make_shared.hpp>
 #include <boost/foreach.hpp>
 #include <boost/archive/text_oarchive.hpp>
@@ -12,16 +14,50 @@
 #include "../common/Logger.hpp"
 #include "../common/network/Command.hpp"
 #include "../common/network/Utils.hpp"
+#include <osrng.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
 
 namespace network {
 
     Server::Server() :
-            endpoint_(tcp::v4(), config_.port()),
-            acceptor_(io_service_, endpoint_),
-            socket_udp_(io_service_, udp::endpoint(udp::v4(), config_.port())),
+            config_(std::make_shared<const Config>()),
+            session_ticket_(config_->session_ticket_lifetime()),
+            timers_(io_service_, TIMER_TICK_MSEC),
+            endpoint_(tcp::v4(), config_->port()),
+            acceptor_(io_service_),
+            socket_udp_(io_service_),
+            udp_strand_(io_service_),
             udp_packet_count_(0),
-			recent_chat_log_(10)
+            position_tick_timer_(io_service_),
+            position_tick_msec_(0),
+			recent_chat_log_(10),
+            handoff_requested_(false),
+            handoff_pending_count_(0),
+            handoff_timer_(io_service_),
+            handoff_strand_(io_service_)
     {
+		// 前のプロセスが動いていれば、待ち受けソケットと状態を引き継ぐ
+		if (!TakeOver()) {
+			acceptor_.open(endpoint_.protocol());
+			acceptor_.set_option(tcp::acceptor::reuse_address(true));
+			acceptor_.bind(endpoint_);
+			acceptor_.listen();
+			socket_udp_.open(udp::v4());
+			socket_udp_.bind(udp::endpoint(udp::v4(), config()->port()));
+			account_.OpenIdentityStore(config()->identity_store());
+		}
+
+		if (config()->crypto_threads() > 0) {
+			crypto_pool_ = std::make_shared<CryptoPool>(config()->crypto_threads(), config()->crypto_queue_size());
+		}
+
+		if (config()->interest_radius() > 0) {
+			interest_grid_.reset(new InterestGrid(config()->interest_radius()));
+		}
     }
 
     void Server::Start(CallbackFuncPtr callback)
@@ -37,10 +73,11 @@ namespace network {
 				}
             } else if (auto session = c.session().lock()) {
 				auto read_average = session->GetReadByteAverage();
-				if (read_average > config_.receive_limit_2()) {
+				const auto config = this->config();
+				if (read_average > config->receive_limit_2()) {
 					Logger::Info(_T("Banished a session: %d %dbyte/s"), session->id(), read_average);
 					session->Close();
-				} else if(read_average > config_.receive_limit_1()) {
+				} else if(read_average > config->receive_limit_1()) {
 					Logger::Info(_T("Receive limit exceeded: %d: %d byte/s"), session->id(), read_average);
 				} else {
 					if (callback) {
@@ -51,28 +88,54 @@ namespace network {
 
         });
 
-		BOOST_FOREACH(const auto& host, config().lobby_servers()) {
+		BOOST_FOREACH(const auto& host, config_->lobby_servers()) {
 			udp::resolver resolver(io_service_);
 			udp::resolver::query query(udp::v4(), host.c_str(), "39380");
 			lobby_hosts_.push_back(resolver.resolve(query));
 		}
 
-        {
-        auto new_session = boost::make_shared<ServerSession>(io_service_);
-        acceptor_.async_accept(new_session->tcp_socket(),
-                              boost::bind(&Server::ReceiveSession, this, new_session, boost::asio::placeholders::error));
-        }
+        RestoreSessions();
+        AcceptSession();
+        StartHandoffListener();
 
         {
             socket_udp_.async_receive_from(
                 boost::asio::buffer(receive_buf_udp_, UDP_MAX_RECEIVE_LENGTH), sender_endpoint_,
-                boost::bind(&Server::ReceiveUDP, this,
+                udp_strand_.wrap(boost::bind(&Server::ReceiveUDP, this,
                   boost::asio::placeholders::error,
-                  boost::asio::placeholders::bytes_transferred));
+                  boost::asio::placeholders::bytes_transferred)));
         }
 
+        StartPositionTick();
+        timers_.Start();
+
         boost::asio::io_service::work work(io_service_);
-        io_service_.run();
+
+        int io_threads = config()->io_threads();
+        if (io_threads <= 0) {
+            io_threads = std::max(1u, boost::thread::hardware_concurrency());
+        }
+        Logger::Info("IO threads: %d", io_threads);
+
+        while (true) {
+            // 自スレッドを含めて io_threads 個のスレッドで io_service を回す
+            boost::thread_group threads;
+            for (int i = 1; i < io_threads; i++) {
+                threads.create_thread([this](){
+                    io_service_.run();
+                });
+            }
+
+            io_service_.run();
+            threads.join_all();
+
+            // 新しいプロセスに引き継いだら終了する
+            if (!handoff_requested_ || HandOff()) {
+                break;
+            }
+            RollBackHandoff();
+            io_service_.reset();
+        }
     }
 
     void Server::Stop()
@@ -88,26 +151,17 @@ namespace network {
 
 	int Server::GetUserCount() const
 	{
-		auto count = std::count_if(sessions_.begin(), sessions_.end(),
-			[](const SessionWeakPtr& s) -> bool {
-				if (auto session = s.lock()) {
-					return !s.expired() && session->online() && session->id() > 0;
-				} else {
-					return false;
-				}
-			});
-
-		return count;
+		return registry_.user_count();
 	}
 
 	std::string Server::GetStatusJSON() const
 	{
 		auto msg = (
 					boost::format("{\"nam\":\"%s\",\"ver\":\"%d.%d.%d\",\"cnt\":%d,\"cap\":%d,\"stg\":\"%s\"}")
-						% config_.server_name()
+						% config()->server_name()
 						% MMO_VERSION_MAJOR % MMO_VERSION_MINOR % MMO_VERSION_REVISION
 						% GetUserCount()
-						% config_.capacity()
+						% config()->capacity()
 						% channel_.GetDefaultStage()
 					).str();
 
@@ -119,26 +173,39 @@ namespace network {
 		using namespace boost::property_tree;
 		ptree xml_ptree;
 
-		xml_ptree.put_child("config", config_.pt());
+		xml_ptree.put_child("config", config()->pt());
 		xml_ptree.put("version", (boost::format("%d.%d.%d") 
 			% MMO_VERSION_MAJOR % MMO_VERSION_MINOR % MMO_VERSION_REVISION).str());
 		xml_ptree.put("protocol_version", MMO_PROTOCOL_VERSION);
 
 		{
 			ptree player_array;
-			auto id_list = account_.GetIDList();
+			std::string name, model_name;
+			uint64_t write_count = 0, written_frames = 0, written_bytes = 0;
+			boost::mutex::scoped_lock lock(mutex_);
 			BOOST_FOREACH(const auto& s, sessions_) {
 				if (auto session = s.lock()) {
+					write_count += session->write_count();
+					written_frames += session->written_frame_count();
+					written_bytes += session->written_byte_count();
 					if (!s.expired() && session->online() && session->id() > 0) {
 						auto id = session->id();
 						ptree player;
-						player.put("name", account_.GetUserName(id));
-						player.put("model_name", account_.GetUserModelName(id));
+						account_.GetUserName(id, &name);
+						account_.GetUserModelName(id, &model_name);
+						player.put("name", name);
+						player.put("model_name", model_name);
 						player_array.push_back(std::make_pair("", player));
 					}
 				}
 			}
 			xml_ptree.put_child("players", player_array);
+
+			ptree write;
+			write.put("writes", write_count);
+			write.put("frames_per_write", write_count > 0 ? 1.0 * written_frames / write_count : 0);
+			write.put("bytes_per_write", write_count > 0 ? 1.0 * written_bytes / write_count : 0);
+			xml_ptree.put_child("stats.write", write);
 		}
 
 		//{
@@ -150,6 +217,21 @@ namespace network {
 		//}
 
 		xml_ptree.put_child("channels", channel_.pt());
+
+		if (crypto_pool_) {
+			ptree crypto;
+			crypto.put("threads", crypto_pool_->threads());
+			crypto.put("depth", crypto_pool_->depth());
+			crypto.put("capacity", crypto_pool_->capacity());
+			crypto.put("executed", crypto_pool_->executed_count());
+			crypto.put("rejected", crypto_pool_->rejected_count());
+			crypto.put("average_queue_msec", crypto_pool_->average_queue_msec());
+			crypto.put("max_queue_msec", crypto_pool_->max_queue_msec());
+			crypto.put("average_exec_msec", crypto_pool_->average_exec_msec());
+			crypto.put("max_exec_msec", crypto_pool_->max_exec_msec());
+			xml_ptree.put_child("stats.crypto", crypto);
+		}
+
 		std::stringstream stream;
 		boost::archive::text_oarchive oa(stream);
 		oa << xml_ptree;
@@ -157,18 +239,77 @@ namespace network {
 		return stream.str();
 	}
 
-	const Config& Server::config() const
+	ConfigPtr Server::config() const
 	{
+		boost::mutex::scoped_lock lock(config_mutex_);
 		return config_;
 	}
 
+	void Server::ReloadConfig()
+	{
+		// 読み込みは1つのスレッドで行い、他のスレッドはその間も前の設定を使う
+		boost::mutex::scoped_lock reload_lock(config_reload_mutex_, boost::try_to_lock);
+		if (!reload_lock || !config()->IsModified()) {
+			return;
+		}
+
+		auto loaded = std::make_shared<const Config>();
+		{
+			boost::mutex::scoped_lock lock(config_mutex_);
+			config_ = loaded;
+		}
+		Logger::Info(_T("Configuration reloaded."));
+	}
+
 	Account& Server::account()
 	{
 		return account_;
 	}
+
+	TimerWheel& Server::timers()
+	{
+		return timers_;
+	}
+
+	const CryptoPoolPtr& Server::crypto_pool() const
+	{
+		return crypto_pool_;
+	}
+
+	SessionTicket& Server::session_ticket()
+	{
+		return session_ticket_;
+	}
+
+	void Server::ScheduleAccountRemoval(uint32_t user_id)
+	{
+		auto id = timers_.Schedule(ACCOUNT_REMOVE_DELAY_MSEC, [this, user_id](){
+			{
+				boost::mutex::scoped_lock lock(removal_mutex_);
+				account_removals_.erase(user_id);
+			}
+			account_.Remove(user_id);
+		});
+
+		boost::mutex::scoped_lock lock(removal_mutex_);
+		auto& removal = account_removals_[user_id];
+		timers_.Cancel(removal);
+		removal = id;
+	}
+
+	void Server::CancelAccountRemoval(uint32_t user_id)
+	{
+		boost::mutex::scoped_lock lock(removal_mutex_);
+		auto it = account_removals_.find(user_id);
+		if (it != account_removals_.end()) {
+			timers_.Cancel(it->second);
+			account_removals_.erase(it);
+		}
+	}
 	
 	void Server::AddChatLog(const std::string& msg)
 	{
+		boost::mutex::scoped_lock lock(chat_log_mutex_);
 		recent_chat_log_.push_back(msg);
 	}
 
@@ -179,7 +320,8 @@ namespace network {
 
 	bool Server::IsBlockedAddress(const boost::asio::ip::address& address)
 	{
-		BOOST_FOREACH(const auto& pattern, config_.blocking_address_patterns()) {
+		const auto config = this->config();
+		BOOST_FOREACH(const auto& pattern, config->blocking_address_patterns()) {
 			if (network::Utils::MatchWithWildcard(pattern, address.to_string())) {
 				return true;
 			}
@@ -187,90 +329,695 @@ namespace network {
 		return false;
 	}
 
+    void Server::AcceptSession()
+    {
+        auto new_session = boost::make_shared<ServerSession>(io_service_);
+        acceptor_.async_accept(new_session->tcp_socket(),
+                boost::bind(&Server::ReceiveSession, this, new_session, boost::asio::placeholders::error));
+    }
+
     void Server::ReceiveSession(const SessionPtr& session, const boost::system::error_code& error)
     {
-		config_.Reload();
+		// 引き継ぎのために待ち受けを止めた
+		if (handoff_requested_) {
+			return;
+		}
+
+		ReloadConfig();
 
 		if (!session) return;
 
-		const auto address = session->tcp_socket().remote_endpoint().address();
+		boost::system::error_code endpoint_error;
+		const auto address = session->tcp_socket().remote_endpoint(endpoint_error).address();
+
+		if (error || endpoint_error) {
+			session->Close();
 
 		// 拒否IPでないか判定
-		if(IsBlockedAddress(address)) {
+		} else if(IsBlockedAddress(address)) {
 			Logger::Info("Blocked IP Address: %s", address);
             session->Close();
 
 		} else {
             session->set_on_receive(callback_);
+            session->set_flush_window(config()->write_flush_window());
             session->Start();
-            sessions_.push_back(SessionWeakPtr(session));
+            {
+                boost::mutex::scoped_lock lock(mutex_);
+                sessions_.push_back(SessionWeakPtr(session));
+            }
+
+            if (config()->keepalive_interval() > 0) {
+                ScheduleKeepAlive(session, 0);
+            }
 
             // クライアント情報を要求
             session->Send(ClientRequestedClientInfo());
         }
 
-        auto new_session = boost::make_shared<ServerSession>(io_service_);
-        acceptor_.async_accept(new_session->tcp_socket(),
-                boost::bind(&Server::ReceiveSession, this, new_session, boost::asio::placeholders::error));
-
+        AcceptSession();
 		RefreshSession();
     }
 
+	bool Server::TakeOver()
+	{
+		const std::string path = config()->handoff_socket();
+		HandoffChannel channel;
+		if (!channel.Connect(path)) {
+			return false;
+		}
+		if (!channel.PeerIsSameUser()) {
+			Logger::Error("Handoff: the server on %s is run by another user", path);
+			return false;
+		}
+		channel.SetTimeout(HANDOFF_TIMEOUT_MSEC);
+		Logger::Info("Take over from the running server: %s", path);
+
+		// ここから先で失敗した場合、前のプロセスが待ち受けを続けるので起動できない
+		std::string header, account_state, ticket_state;
+		std::vector<int> fds;
+		uint32_t count = 0;
+		if (!channel.Send(Utils::Serialize(static_cast<uint32_t>(HANDOFF_VERSION))) ||
+				!channel.Receive(&header, &fds) || fds.size() != 2 ||
+				!BinaryReader(header).Read(&account_state, &ticket_state, &count)) {
+			throw std::runtime_error("Handoff failed: invalid header");
+		}
+
+		for (uint32_t i = 0; i < count; i++) {
+			std::string state;
+			std::vector<int> session_fds;
+			if (!channel.Receive(&state, &session_fds) || session_fds.size() != 1) {
+				throw std::runtime_error("Handoff failed: invalid session");
+			}
+			restored_sessions_.push_back(std::make_pair(session_fds[0], state));
+		}
+
+		acceptor_.assign(tcp::v4(), fds[0]);
+		socket_udp_.assign(udp::v4(), fds[1]);
+
+		// 前のプロセスが閉じたファイルを開き直してから、メモリ上の状態を読み込む
+		account_.OpenIdentityStore(config()->identity_store());
+		if (!account_.LoadState(account_state) || !session_ticket_.LoadState(ticket_state)) {
+			throw std::runtime_error("Handoff failed: invalid state");
+		}
+
+		if (!channel.Send("OK")) {
+			throw std::runtime_error("Handoff failed: cannot send ack");
+		}
+		return true;
+	}
+
+	void Server::RestoreSessions()
+	{
+		if (restored_sessions_.empty() && account_.GetIDList().empty()) {
+			return;
+		}
+
+		std::unordered_set<uint32_t> restored_ids;
+		BOOST_FOREACH(const auto& restored, restored_sessions_) {
+			auto session = boost::make_shared<ServerSession>(io_service_);
+			boost::system::error_code error;
+			session->tcp_socket().assign(tcp::v4(), restored.first, error);
+			if (error) {
+				HandoffChannel::CloseAll(std::vector<int>(1, restored.first));
+				continue;
+			}
+			if (!session->LoadState(restored.second)) {
+				Logger::Error("Cannot restore a session");
+				session->Close();
+				continue;
+			}
+
+			const uint32_t user_id = session->id();
+			session->set_on_receive(callback_);
+			session->set_flush_window(config()->write_flush_window());
+			session->encrypter().SetPublicKey(account_.GetPublicKey(user_id));
+			{
+				boost::mutex::scoped_lock lock(mutex_);
+				sessions_.push_back(SessionWeakPtr(session));
+			}
+			RegisterSession(session);
+
+			// 範囲の出入りは前のプロセスで送り済み
+			if (interest_grid_) {
+				InterestGrid::Result result;
+				interest_grid_->Update(user_id, session->channel(), account_.GetUserPosition(user_id), &result);
+			}
+
+			if (config()->keepalive_interval() > 0) {
+				ScheduleKeepAlive(session, session->written_frame_count());
+			}
+
+			session->Resume();
+			restored_ids.insert(user_id);
+		}
+		restored_sessions_.clear();
+
+		// 接続を引き継げなかったユーザーはログアウトさせ、削除の待ち時間は最初からやり直す
+		BOOST_FOREACH(uint32_t user_id, account_.GetIDList()) {
+			if (restored_ids.count(user_id)) {
+				continue;
+			}
+			auto old_revision = account_.GetUserRevision(user_id);
+			account_.LogOut(user_id);
+			SendAccountRevisionUpdate(user_id, old_revision);
+			ScheduleAccountRemoval(user_id);
+		}
+
+		Logger::Info("Restored sessions: %d", restored_ids.size());
+	}
+
+	void Server::StartHandoffListener()
+	{
+#ifdef __linux__
+		using boost::asio::local::stream_protocol;
+		const std::string path = config()->handoff_socket();
+		if (path.empty()) {
+			return;
+		}
+
+		if (!handoff_acceptor_) {
+			// 前のプロセスのソケットファイルは置き換える
+			::unlink(path.c_str());
+
+			boost::system::error_code error;
+			handoff_acceptor_.reset(new stream_protocol::acceptor(io_service_));
+			handoff_acceptor_->open(stream_protocol(), error);
+			if (!error) {
+				// ソケットとセッションの鍵を渡すので、自分以外は接続できないようにする
+				const mode_t mask = ::umask(0177);
+				handoff_acceptor_->bind(stream_protocol::endpoint(path), error);
+				::umask(mask);
+			}
+			if (!error) {
+				handoff_acceptor_->listen(1, error);
+			}
+			if (error) {
+				Logger::Error("Cannot listen on the handoff socket: %s", error.message());
+				handoff_acceptor_.reset();
+				return;
+			}
+		}
+
+		handoff_peer_.reset(new stream_protocol::socket(io_service_));
+		handoff_acceptor_->async_accept(*handoff_peer_,
+				boost::bind(&Server::AcceptHandoff, this, boost::asio::placeholders::error));
+#endif
+	}
+
+	void Server::AcceptHandoff(const boost::system::error_code& error)
+	{
+#ifdef __linux__
+		if (error) {
+			return;
+		}
+
+		if (!HandoffChannel::IsSameUser(handoff_peer_->native_handle())) {
+			Logger::Error("Handoff: rejected a connection from another user");
+			StartHandoffListener();
+			return;
+		}
+
+		// 要求が届かなければ接続を閉じて、待ち受けに戻る
+		const auto peer = handoff_peer_.get();
+		handoff_timer_.expires_from_now(boost::posix_time::milliseconds(HANDOFF_REQUEST_TIMEOUT_MSEC));
+		handoff_timer_.async_wait(handoff_strand_.wrap([this, peer](const boost::system::error_code& error){
+			if (!error && handoff_peer_.get() == peer) {
+				boost::system::error_code ignored;
+				handoff_peer_->close(ignored);
+			}
+		}));
+		boost::asio::async_read(*handoff_peer_, boost::asio::buffer(handoff_request_),
+				handoff_strand_.wrap(boost::bind(&Server::ReceiveHandoffRequest, this,
+					boost::asio::placeholders::error)));
+#endif
+	}
+
+	void Server::ReceiveHandoffRequest(const boost::system::error_code& error)
+	{
+#ifdef __linux__
+		boost::system::error_code ignored;
+		handoff_timer_.cancel(ignored);
+
+		uint32_t size = 0, version = 0;
+		if (error || !BinaryReader(std::string(handoff_request_, sizeof(handoff_request_))).Read(&size, &version) ||
+				size != sizeof(version) || version != HANDOFF_VERSION) {
+			Logger::Error("Handoff: invalid request");
+			StartHandoffListener();
+			return;
+		}
+
+		Logger::Info("Handoff requested");
+		handoff_start_time_ = boost::posix_time::microsec_clock::universal_time();
+		// 以降の送受信は io_service を止めてから行うので、ブロッキングに戻す
+		handoff_peer_->native_non_blocking(false, ignored);
+		handoff_peer_->non_blocking(false, ignored);
+		handoff_channel_.reset(new HandoffChannel(handoff_peer_->release()));
+		handoff_peer_.reset();
+
+		handoff_requested_ = true;
+		acceptor_.cancel(ignored);
+
+		{
+			boost::mutex::scoped_lock lock(mutex_);
+			BOOST_FOREACH(const auto& s, sessions_) {
+				if (auto session = s.lock()) {
+					handoff_sessions_.push_back(session);
+				}
+			}
+			handoff_pending_count_ = handoff_sessions_.size();
+		}
+
+		// 送り終わらないセッションは待たずに、引き継ぎの対象から外す
+		handoff_timer_.expires_from_now(boost::posix_time::milliseconds(HANDOFF_SUSPEND_TIMEOUT_MSEC));
+		handoff_timer_.async_wait([this](const boost::system::error_code& error){
+			if (!error) {
+				Logger::Info("Handoff: suspend timed out");
+				io_service_.stop();
+			}
+		});
+
+		if (handoff_sessions_.empty()) {
+			io_service_.stop();
+			return;
+		}
+		BOOST_FOREACH(const SessionPtr& session, handoff_sessions_) {
+			session->Suspend(boost::bind(&Server::OnSessionSuspended, this));
+		}
+#endif
+	}
+
+	void Server::OnSessionSuspended()
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		if (handoff_requested_ && handoff_pending_count_ > 0 && --handoff_pending_count_ == 0) {
+			io_service_.stop();
+		}
+	}
+
+	bool Server::HandOff()
+	{
+		boost::system::error_code ignored;
+		handoff_timer_.cancel(ignored);
+
+		// io_service を止めた時点で残っていた送信などを実行してから状態を保存する
+		// 止まったセッションへの送信は送信待ちに積まれるだけで、書き込みは始まらない
+		{
+			boost::mutex::scoped_lock lock(mutex_);
+			handoff_pending_count_ = 0;
+		}
+		io_service_.reset();
+		io_service_.poll();
+
+		auto& channel = *handoff_channel_;
+		channel.SetTimeout(HANDOFF_TIMEOUT_MSEC);
+
+		// 鍵交換が終わって止まったセッションだけを送る 残りは終了時に切断される
+		std::vector<std::pair<SessionPtr, std::string>> states;
+		BOOST_FOREACH(const SessionPtr& session, handoff_sessions_) {
+			auto state = session->SaveState();
+			if (!state.empty()) {
+				states.push_back(std::make_pair(session, state));
+			}
+		}
+
+		account_.CloseIdentityStore();
+
+		std::vector<int> fds;
+		fds.push_back(acceptor_.native_handle());
+		fds.push_back(socket_udp_.native_handle());
+		bool sent = channel.Send(Utils::Serialize(account_.SaveState(), session_ticket_.SaveState(),
+			static_cast<uint32_t>(states.size())), fds);
+		BOOST_FOREACH(const auto& state, states) {
+			sent = sent && channel.Send(state.second,
+				std::vector<int>(1, state.first->tcp_socket().native_handle()));
+		}
+
+		std::string ack;
+		if (!sent || !channel.Receive(&ack) || ack != "OK") {
+			Logger::Error("Handoff: no response from the new server");
+			return false;
+		}
+
+		Logger::Info("Handed off %d/%d sessions in %d ms", states.size(), handoff_sessions_.size(),
+			(boost::posix_time::microsec_clock::universal_time() - handoff_start_time_).total_milliseconds());
+		return true;
+	}
+
+	void Server::RollBackHandoff()
+	{
+		Logger::Info("Handoff canceled");
+
+		account_.OpenIdentityStore(config()->identity_store());
+		BOOST_FOREACH(const SessionPtr& session, handoff_sessions_) {
+			session->Resume();
+		}
+		handoff_sessions_.clear();
+		handoff_channel_.reset();
+		{
+			boost::mutex::scoped_lock lock(mutex_);
+			handoff_requested_ = false;
+			handoff_pending_count_ = 0;
+		}
+
+		AcceptSession();
+		StartHandoffListener();
+	}
+
 	void Server::RefreshSession()
 	{
+		{
+		boost::mutex::scoped_lock lock(mutex_);
+
 		// 使用済のセッションのポインタを破棄
         auto it = std::remove_if(sessions_.begin(), sessions_.end(),
                 [](const SessionWeakPtr& ptr){
             return ptr.expired();
         });
         sessions_.erase(it, sessions_.end());
+		}
+		registry_.Purge();
 		Logger::Info("Active connection: %d", GetUserCount());
 	}
 
     void Server::SendAll(const Command& command, int channel, bool limited)
     {
-        BOOST_FOREACH(SessionWeakPtr& ptr, sessions_) {
-            if (auto session = ptr.lock()) {
-				if (channel < 0 || (channel >= 0 && session->channel() == channel)) {
-					if (!limited || session->write_average_limit() > session->GetWriteByteAverage()) {
-						if (session->id() > 0) {
-							session->Send(command);
-						}
-					}
-				}
-            }
-        }
+		// 圧縮までは全員で共通なので一度だけ行う
+		auto frame = Session::Compose(command);
+
+        registry_.ForEach(channel, [&](const SessionPtr& session){
+			if (!limited || session->write_average_limit() > session->GetWriteByteAverage()) {
+				session->Send(frame);
+			}
+		});
     }
 
     void Server::SendOthers(const Command& command, uint32_t self_id, int channel, bool limited)
     {
-        BOOST_FOREACH(SessionWeakPtr& ptr, sessions_) {
-            if (auto session = ptr.lock()) {
-				if (channel < 0 || (channel >= 0 && session->channel() == channel)) {
-					if (!limited || session->write_average_limit() > session->GetWriteByteAverage()) {
-						if (session->id() > 0 && session->id() != self_id) {
-							session->Send(command);
-						}
-					}
+		auto frame = Session::Compose(command);
+
+        registry_.ForEach(channel, [&](const SessionPtr& session){
+			if (!limited || session->write_average_limit() > session->GetWriteByteAverage()) {
+				if (session->id() != self_id) {
+					session->Send(frame);
 				}
-            }
-        }
+			}
+		});
     }
 	
+    void Server::SendAccountRevisionUpdate(uint32_t user_id, uint32_t base_revision, uint32_t except_id)
+    {
+		// 変更が無ければパッチは空
+		auto patch = account_.GetUserRevisionPatch(user_id, base_revision);
+		uint32_t patch_user_id, revision;
+		if (!BinaryReader(patch).Read(&patch_user_id, &revision)) {
+			return;
+		}
+
+		// 差分は一度だけ作って共有する
+		std::string body;
+		BinaryWriter(&body).Write(base_revision).WriteBytes(patch.data(), patch.size());
+		auto push = Session::Compose(Command(header::ClientReceiveAccountRevisionPush, body));
+		auto notify = Session::Compose(ClientReceiveAccountRevisionUpdateNotify(user_id, revision));
+
+        registry_.ForEach(-1, [&](const SessionPtr& session){
+			if (session->id() != except_id) {
+				session->Send((session->capabilities() & capability::ACCOUNT_PUSH) ? push : notify);
+			}
+		});
+    }
+
     void Server::SendTo(const Command& command, uint32_t user_id)
 	{
-		auto it = std::find_if(sessions_.begin(), sessions_.end(),
-			[user_id](SessionWeakPtr& ptr) -> bool {
-				if (auto session = ptr.lock()) {
-					return session->id() == user_id;
+		if (auto session = registry_.FindByID(user_id)) {
+			session->Send(command);
+		}
+	}
+
+	void Server::RegisterSession(const SessionPtr& session)
+	{
+		registry_.Update(session);
+	}
+
+	bool Server::UnregisterSession(uint32_t user_id, const SessionPtr& session)
+	{
+		if (!registry_.Remove(user_id, session.get())) {
+			return false;
+		}
+
+		if (interest_grid_) {
+			InterestGrid::Result result;
+			interest_grid_->Remove(user_id, &result);
+			SendInterestChanges(user_id, PlayerPosition(), result);
+		}
+		return true;
+	}
+
+	void Server::UpdatePlayerPosition(const SessionPtr& session, const PlayerPosition& pos)
+	{
+		const uint32_t user_id = session->id();
+		account_.SetUserPosition(user_id, pos);
+
+		InterestGrid::Result result;
+		if (interest_grid_) {
+			interest_grid_->Update(user_id, session->channel(), pos, &result);
+		}
+
+		if (position_tick_msec_ > 0) {
+			// 次の周期でまとめて送る
+			boost::mutex::scoped_lock lock(position_mutex_);
+			dirty_positions_[session->channel()][user_id] = pos;
+
+		} else {
+			ClientUpdatePlayerPosition command(user_id, pos.x, pos.y, pos.z, pos.theta, pos.vy);
+			auto frame = Session::Compose(command);
+			const bool position_delta = config()->position_delta();
+
+			auto send = [&](const SessionPtr& receiver){
+				if (receiver->write_average_limit() > receiver->GetWriteByteAverage()) {
+					if (receiver->udp_enabled()) {
+						SendPositionsUDP(receiver, command.body());
+					} else if (position_delta) {
+						receiver->Send(Command(header::ClientUpdatePlayerPositionDelta,
+							Utils::Serialize(user_id) + receiver->position_codec().Encode(user_id, pos)));
+					} else {
+						receiver->Send(frame);
+					}
+				}
+			};
+
+			if (interest_grid_) {
+				BOOST_FOREACH(uint32_t receiver_id, result.receivers) {
+					if (auto receiver = registry_.FindByID(receiver_id)) {
+						send(receiver);
+					}
+				}
+			} else {
+				registry_.ForEach(session->channel(), [&](const SessionPtr& receiver){
+					if (receiver->id() != user_id) {
+						send(receiver);
+					}
+				});
+			}
+		}
+
+		if (interest_grid_) {
+			SendInterestChanges(user_id, pos, result);
+		}
+	}
+
+	void Server::EnableUDPPosition(const SessionPtr& session)
+	{
+		boost::system::error_code error;
+		auto address = boost::asio::ip::address::from_string(session->global_ip(), error);
+		if (error) {
+			return;
+		}
+		udp::endpoint endpoint(address, session->udp_port());
+
+		// なりすまし防止のためUDPパケットに含める値 暗号化済みのTCPで渡す
+		uint32_t token = 0;
+		CryptoPP::AutoSeededRandomPool rnd;
+		while (token == 0) {
+			rnd.GenerateBlock(reinterpret_cast<byte*>(&token), sizeof(token));
+		}
+		session->set_udp_token(token);
+
+		// 送信側のシーケンス番号と宛先はUDPのストランドでのみ扱う
+		udp_strand_.post([session, endpoint](){
+			session->set_udp_endpoint(endpoint);
+			session->set_udp_enabled(true);
+		});
+
+		session->Send(ClientEnableUDPPosition(token));
+		Logger::Info("Enable UDP position: %d", session->id());
+	}
+
+	void Server::SendPositionsUDP(const SessionPtr& session, const std::string& entries)
+	{
+		udp_strand_.post([this, session, entries](){
+			// 1パケットに収まるよう分割する
+			// 同じ回の分割したパケットは同じシーケンス番号にし、受信側はプレイヤーごとに比べる
+			const uint16_t sequence = session->NextUDPSequence();
+			const size_t chunk_size = UDP_POSITION_ENTRIES * POSITION_ENTRY_SIZE;
+			for (size_t offset = 0; offset < entries.size(); offset += chunk_size) {
+				auto msg = Utils::Serialize(static_cast<uint8_t>(header::ClientUpdatePlayerPositionSequenced),
+					sequence) + entries.substr(offset, chunk_size);
+				DoWriteUDP(msg, session->udp_endpoint());
+			}
+		});
+	}
+
+	void Server::StartPositionTick()
+	{
+		if (config()->position_tick_rate() <= 0) {
+			return;
+		}
+
+		position_tick_msec_ = std::max(1, 1000 / config()->position_tick_rate());
+		Logger::Info("Position tick: %d ms", position_tick_msec_);
+
+		position_tick_timer_.expires_from_now(boost::posix_time::milliseconds(position_tick_msec_));
+		position_tick_timer_.async_wait(boost::bind(&Server::FlushPlayerPositions, this,
+			boost::asio::placeholders::error));
+	}
+
+	void Server::FlushPlayerPositions(const boost::system::error_code& error)
+	{
+		if (error) {
+			return;
+		}
+
+		std::map<int, PositionMap> positions;
+		{
+			boost::mutex::scoped_lock lock(position_mutex_);
+			positions.swap(dirty_positions_);
+		}
+
+		BOOST_FOREACH(const auto& channel_positions, positions) {
+			const PositionMap& channel_map = channel_positions.second;
+
+			// 前回から動いたプレイヤーの位置を1つのコマンドにまとめる
+			auto serialize = [&channel_map](uint32_t receiver_id,
+					const std::vector<uint32_t>* visible, PositionCodec* codec) -> std::string {
+				std::string body;
+				BOOST_FOREACH(const auto& pair, channel_map) {
+					if (pair.first == receiver_id) {
+						continue;
+					}
+					if (visible && std::find(visible->begin(), visible->end(), pair.first) == visible->end()) {
+						continue;
+					}
+					const auto& pos = pair.second;
+					if (codec) {
+						body += Utils::Serialize(pair.first) + codec->Encode(pair.first, pos);
+					} else {
+						body += Utils::Serialize(pair.first, pos.x, pos.y, pos.z, pos.theta, pos.vy);
+					}
+				}
+				return body;
+			};
+
+			// 自分が含まれない受信者には同じフレームを使い回す
+			std::string shared_body;
+			FramePtr shared_frame;
+			if (!interest_grid_) {
+				shared_body = serialize(0, nullptr, nullptr);
+				shared_frame = Session::Compose(Command(header::ClientUpdatePlayerPositionSnapshot,
+					shared_body));
+			}
+
+			const bool position_delta = config()->position_delta();
+			registry_.ForEach(channel_positions.first, [&](const SessionPtr& session){
+				if (session->write_average_limit() <= session->GetWriteByteAverage()) {
+					return;
+				}
+
+				const uint32_t id = session->id();
+				const bool delta = position_delta && !session->udp_enabled();
+
+				std::vector<uint32_t> visible;
+				if (interest_grid_) {
+					visible = interest_grid_->GetVisible(id);
+				} else if (!delta && !channel_map.count(id)) {
+					if (session->udp_enabled()) {
+						SendPositionsUDP(session, shared_body);
+					} else {
+						session->Send(shared_frame);
+					}
+					return;
+				}
+
+				// 差分は受信者ごとの基準で符号化する
+				auto body = serialize(id, interest_grid_ ? &visible : nullptr,
+					delta ? &session->position_codec() : nullptr);
+				if (body.empty()) {
+					return;
+				}
+
+				if (session->udp_enabled()) {
+					SendPositionsUDP(session, body);
 				} else {
-					return false;
+					session->Send(Command(delta ? header::ClientUpdatePlayerPositionDelta :
+						header::ClientUpdatePlayerPositionSnapshot, body));
 				}
 			});
-		
-		if (it != sessions_.end()) {
-			if (auto session = it->lock()) {
-				session->Send(command);
+		}
+
+		position_tick_timer_.expires_at(position_tick_timer_.expires_at() +
+			boost::posix_time::milliseconds(position_tick_msec_));
+		position_tick_timer_.async_wait(boost::bind(&Server::FlushPlayerPositions, this,
+			boost::asio::placeholders::error));
+	}
+
+	void Server::ScheduleKeepAlive(const SessionWeakPtr& session, uint64_t written_frame_count)
+	{
+		timers_.Schedule(config()->keepalive_interval() * 1000, [this, session, written_frame_count](){
+			auto s = session.lock();
+			if (!s || !s->online()) {
+				return;
+			}
+
+			// 間隔の間に何も送っていなければ、経路の維持と切断の検出のために送る
+			uint64_t written = s->written_frame_count();
+			if (written == written_frame_count) {
+				s->Send(ClientReceiveKeepAlive());
+				written++;
+			}
+			ScheduleKeepAlive(session, written);
+		});
+	}
+
+	void Server::SendInterestChanges(uint32_t user_id, const PlayerPosition& pos,
+			const InterestGrid::Result& result)
+	{
+		auto self = registry_.FindByID(user_id);
+
+		// 範囲の出入りは帯域制限に関わらず双方に送る
+		// 位置の差分の基準は出入りのたびに捨てる クライアントも同じコマンドで捨てる
+		typedef std::pair<uint32_t, PlayerPosition> Entered;
+		BOOST_FOREACH(const Entered& entered, result.entered) {
+			const auto& other_pos = entered.second;
+			if (auto other = registry_.FindByID(entered.first)) {
+				other->position_codec().Reset(user_id);
+				other->Send(ClientReceivePlayerEnterArea(user_id,
+					pos.x, pos.y, pos.z, pos.theta, pos.vy));
+			}
+			if (self) {
+				self->position_codec().Reset(entered.first);
+				self->Send(ClientReceivePlayerEnterArea(entered.first,
+					other_pos.x, other_pos.y, other_pos.z, other_pos.theta, other_pos.vy));
+			}
+		}
+
+		BOOST_FOREACH(uint32_t other_id, result.left) {
+			if (auto other = registry_.FindByID(other_id)) {
+				other->position_codec().Reset(user_id);
+				other->Send(ClientReceivePlayerLeaveArea(user_id));
+			}
+			if (self) {
+				self->position_codec().Reset(other_id);
+				self->Send(ClientReceivePlayerLeaveArea(other_id));
 			}
 		}
 	}
@@ -286,10 +1033,10 @@ namespace network {
         udp::resolver::query query(udp::v4(), ip_address.c_str(), port_str.str().c_str());
         udp::resolver::iterator iterator = resolver.resolve(query);
 
-        static char request[] = "MMO UDP Test Packet";
+        static char request[] = UDP_TEST_PACKET;
         for (int i = 0; i < UDP_TEST_PACKET_TIME; i++) {
 
-            io_service_.post(boost::bind(&Server::DoWriteUDP, this, request, *iterator));
+            udp_strand_.post(boost::bind(&Server::DoWriteUDP, this, request, *iterator));
         }
     }
 
@@ -297,13 +1044,13 @@ namespace network {
 	{
 		static char request[] = "P";
 		BOOST_FOREACH(const auto& iterator, lobby_hosts_) {
-			io_service_.post(boost::bind(&Server::DoWriteUDP, this, request, *iterator));
+			udp_strand_.post(boost::bind(&Server::DoWriteUDP, this, request, *iterator));
 		}
 	}
 
     void Server::SendUDP(const std::string& message, const boost::asio::ip::udp::endpoint endpoint)
     {
-		io_service_.post(boost::bind(&Server::DoWriteUDP, this, message, endpoint));
+		udp_strand_.post(boost::bind(&Server::DoWriteUDP, this, message, endpoint));
     }
 
     void Server::ReceiveUDP(const boost::system::error_code& error, size_t bytes_recvd)
@@ -315,9 +1062,9 @@ namespace network {
         if (!error) {
           socket_udp_.async_receive_from(
               boost::asio::buffer(receive_buf_udp_, UDP_MAX_RECEIVE_LENGTH), sender_endpoint_,
-              boost::bind(&Server::ReceiveUDP, this,
+              udp_strand_.wrap(boost::bind(&Server::ReceiveUDP, this,
                 boost::asio::placeholders::error,
-                boost::asio::placeholders::bytes_transferred));
+                boost::asio::placeholders::bytes_transferred)));
         } else {
             Logger::Error("%s", error.message());
         }
@@ -330,8 +1077,8 @@ namespace network {
 
         socket_udp_.async_send_to(
             boost::asio::buffer(s->data(), s->size()), endpoint,
-            boost::bind(&Server::WriteUDP, this,
-              boost::asio::placeholders::error, s));
+            udp_strand_.wrap(boost::bind(&Server::WriteUDP, this,
+              boost::asio::placeholders::error, s)));
     }
 
     void Server::WriteUDP(const boost::system::error_code& error, boost::shared_ptr<std::string> holder)
@@ -360,26 +1107,9 @@ namespace network {
         SessionWeakPtr weak_session;
 
 		// IPアドレスとポートからセッションを特定
-		auto it = std::find_if(sessions_.begin(), sessions_.end(),
-			[&endpoint](const SessionWeakPtr& session) -> bool {
-				if (auto session_ptr = session.lock()) {
-
-					const auto session_endpoint = session_ptr->tcp_socket().remote_endpoint();
-					const auto session_port = session_ptr->udp_port();
-
-					return (session_endpoint.address() == endpoint.address() &&
-						session_port == endpoint.port());
-
-				} else {
-					return false;
-				}
-			});
-
-		if (it != sessions_.end()) {
-			weak_session = *it;
-			if (auto session = weak_session.lock()) {
-				Logger::Debug("Receive UDP Command: %d", session->id());
-			}
+		if (auto session = registry_.FindByEndpoint(endpoint)) {
+			weak_session = session;
+			Logger::Debug("Receive UDP Command: %d", session->id());
 		} else {
 			Logger::Debug("Receive anonymous UDP Command");
 		}
@@ -400,6 +1130,14 @@ namespace network {
 
 		if (header == network::header::ServerRequstedStatus) {
 			SendUDP(GetStatusJSON(), endpoint);
+		} else if (auto session = weak_session.lock()) {
+			// TCPで受信したコマンドと同じストランドで処理する
+			if (auto callback = callback_) {
+				Command command(static_cast<network::header::CommandHeader>(header), body, weak_session);
+				session->strand().post([callback, command](){
+					(*callback)(command);
+				});
+			}
 		} else {
 			if (callback_) {
 				(*callback_)(Command(static_cast<network::header::CommandHeader>(header), body, weak_session));
@@ -422,10 +1160,6 @@ namespace network {
         // IPアドレスを取得
         global_ip_ = socket_tcp_.remote_endpoint().address().to_string();
 
-        boost::asio::async_read_until(socket_tcp_,
-            receive_buf_, NETWORK_UTILS_DELIMITOR,
-            boost::bind(
-              &ServerSession::ReceiveTCP, shared_from_this(),
-              boost::asio::placeholders::error));
+        Receive();
     }
 }
@@ -6,15 +6,30 @@
 
 #include <string>
 #include <list>
+#include <map>
+#include <vector>
 #include <functional>
 #include <boost/circular_buffer.hpp>
 #include "../common/network/Session.hpp"
 #include "Config.hpp"
 #include "Account.hpp"
 #include "Channel.hpp"
+#include "SessionRegistry.hpp"
+#include "InterestGrid.hpp"
+#include "TimerWheel.hpp"
+#include "CryptoPool.hpp"
+#include "SessionTicket.hpp"
+#include "Handoff.hpp"
 
 #define UDP_MAX_RECEIVE_LENGTH (2048)
 #define UDP_TEST_PACKET_TIME (5)
+#define UDP_POSITION_ENTRIES (40)
+#define POSITION_ENTRY_SIZE (12)
+#define TIMER_TICK_MSEC (100)
+#define ACCOUNT_REMOVE_DELAY_MSEC (30 * 60 * 1000)
+#define HANDOFF_SUSPEND_TIMEOUT_MSEC (3000)
+#define HANDOFF_TIMEOUT_MSEC (10000)
+#define HANDOFF_REQUEST_TIMEOUT_MSEC (1000)
 
 namespace network {
 
@@ -38,12 +53,41 @@ class Server {
         void SendOthers(const Command&, uint32_t self_id, int channel = -1, bool limited = false);
         void SendTo(const Command&, uint32_t);
 
+        // base_revision からのアカウントの変更を except_id 以外の全員に知らせる
+        // ACCOUNT_PUSH を有効にしたセッションには差分を、それ以外には更新通知を送る
+        void SendAccountRevisionUpdate(uint32_t user_id, uint32_t base_revision, uint32_t except_id = 0);
+
+        // ログイン・チャンネル変更・UDPポート設定の後に呼ぶ
+        void RegisterSession(const SessionPtr& session);
+
+        // 再接続した別のセッションが同じユーザーIDで残っている場合は false
+        // その場合はログアウトの処理を行わないこと
+        bool UnregisterSession(uint32_t user_id, const SessionPtr& session);
+
+        // 位置情報を記録して周囲のプレイヤーに送る
+        void UpdatePlayerPosition(const SessionPtr& session, const PlayerPosition& pos);
+
+        // UDPのテストパケットが往復したセッションの位置情報をUDPに切り替える
+        void EnableUDPPosition(const SessionPtr& session);
+
+        // ログアウトしたアカウントを一定時間後に削除する 再ログインしたら取り消す
+        void ScheduleAccountRemoval(uint32_t user_id);
+        void CancelAccountRemoval(uint32_t user_id);
+
         bool Empty() const;
 		std::string GetStatusJSON() const;
 		std::string GetFullStatus() const;
 
-		const Config& config() const;
+		// 呼び出した時点の設定 再読み込みされても受け取った値は変わらない
+		ConfigPtr config() const;
 		Account& account();
+		TimerWheel& timers();
+
+		// ハンドシェイクの公開鍵暗号を行うスレッド crypto_threads が 0 なら空
+		const CryptoPoolPtr& crypto_pool() const;
+
+		// 再接続用のチケット
+		SessionTicket& session_ticket();
 
 		void AddChatLog(const std::string& msg);
 
@@ -58,37 +102,103 @@ class Server {
 		bool IsBlockedAddress(const boost::asio::ip::address& address);
 
     private:
+        void AcceptSession();
         void ReceiveSession(const SessionPtr&, const boost::system::error_code&);
 
+        // 再起動の引き継ぎ
+        // 前のプロセスから待ち受けソケットと状態を受け取る 前のプロセスが無ければ false
+        bool TakeOver();
+        void RestoreSessions();
+
+        // 新しいプロセスからの接続を待ち、全セッションを止めてから io_service を止める
+        void StartHandoffListener();
+        void AcceptHandoff(const boost::system::error_code& error);
+        // 要求を確かめてからセッションを止める
+        void ReceiveHandoffRequest(const boost::system::error_code& error);
+        void OnSessionSuspended();
+
+        // 止めたセッションを新しいプロセスに送る 失敗した場合は RollBackHandoff で再開する
+        bool HandOff();
+        void RollBackHandoff();
+
         void ReceiveUDP(const boost::system::error_code& error, size_t bytes_recvd);
         void DoWriteUDP(const std::string& msg, const udp::endpoint& endpoint);
         void WriteUDP(const boost::system::error_code& error, boost::shared_ptr<std::string> holder);
 
         void FetchUDP(const std::string& buffer, const boost::asio::ip::udp::endpoint endpoint);
 
+        void SendInterestChanges(uint32_t user_id, const PlayerPosition& pos,
+                const InterestGrid::Result& result);
+
+        void SendPositionsUDP(const SessionPtr& session, const std::string& entries);
+
+        // config.json が更新されていれば読み込み直す
+        void ReloadConfig();
+
+        void StartPositionTick();
+        void ScheduleKeepAlive(const SessionWeakPtr& session, uint64_t written_frame_count);
+        void FlushPlayerPositions(const boost::system::error_code& error);
+
     private:
-	   Config config_;
+	   ConfigPtr config_;
+	   mutable boost::mutex config_mutex_;
+	   boost::mutex config_reload_mutex_;
 	   Account account_;
 	   Channel channel_;
 
+	   CryptoPoolPtr crypto_pool_;
+	   SessionTicket session_ticket_;
+
        boost::asio::io_service io_service_;
+       TimerWheel timers_;
        tcp::endpoint endpoint_;
        tcp::acceptor acceptor_;
 
        udp::socket socket_udp_;
        udp::endpoint sender_endpoint_;
+       boost::asio::io_service::strand udp_strand_;
 
        char receive_buf_udp_[2048];
        uint8_t udp_packet_count_;
 
        CallbackFuncPtr callback_;
 
-       boost::mutex mutex_;
+       mutable boost::mutex mutex_;
        std::list<SessionWeakPtr> sessions_;
+       SessionRegistry registry_;
+       std::unique_ptr<InterestGrid> interest_grid_;
+
+       // 一定間隔でまとめて送る位置情報 チャンネル -> ユーザーID -> 位置
+       typedef std::map<uint32_t, PlayerPosition> PositionMap;
+       boost::asio::deadline_timer position_tick_timer_;
+       int position_tick_msec_;
+       boost::mutex position_mutex_;
+       std::map<int, PositionMap> dirty_positions_;
 
+       boost::mutex removal_mutex_;
+       std::unordered_map<uint32_t, TimerWheel::TimerID> account_removals_;
+
+	   boost::mutex chat_log_mutex_;
 	   boost::circular_buffer<std::string> recent_chat_log_;
 	   std::list<udp::resolver::iterator> lobby_hosts_;
 
+       // 引き継ぐ側
+       bool handoff_requested_;
+       int handoff_pending_count_;
+       std::vector<SessionPtr> handoff_sessions_;
+       boost::asio::deadline_timer handoff_timer_;
+       boost::asio::io_service::strand handoff_strand_;
+       char handoff_request_[sizeof(uint32_t) * 2];     // 長さとバージョン
+       boost::posix_time::ptime handoff_start_time_;
+       std::unique_ptr<HandoffChannel> handoff_channel_;
+#ifdef __linux__
+       std::unique_ptr<boost::asio::local::stream_protocol::acceptor> handoff_acceptor_;
+       std::unique_ptr<boost::asio::local::stream_protocol::socket> handoff_peer_;
+#endif
+
+       // 引き継がれる側 受け取った接続と状態
+       std::vector<std::pair<int, std::string>> restored_sessions_;
+
 };
 
 }
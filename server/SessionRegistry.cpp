@@ -0,0 +1,169 @@
+//
+// SessionRegistry.cpp
+//
+
+#include "SessionRegistry.hpp"
+#include <boost/functional/hash.hpp>
+
+namespace network {
+
+size_t SessionRegistry::EndpointHash::operator()(const udp::endpoint& endpoint) const
+{
+    size_t seed = 0;
+    const auto address = endpoint.address();
+    if (address.is_v4()) {
+        boost::hash_combine(seed, address.to_v4().to_ulong());
+    } else {
+        const auto bytes = address.to_v6().to_bytes();
+        boost::hash_range(seed, bytes.begin(), bytes.end());
+    }
+    boost::hash_combine(seed, endpoint.port());
+    return seed;
+}
+
+SessionRegistry::SessionRegistry()
+{
+}
+
+void SessionRegistry::Update(const SessionPtr& session)
+{
+    if (!session) {
+        return;
+    }
+
+    const Session* key = session.get();
+
+    Entry entry;
+    entry.session = session;
+    entry.id = session->id();
+    entry.channel = session->channel();
+    entry.has_endpoint = false;
+
+    // UDPの宛先はTCPの接続元アドレスと通知されたポートの組
+    if (session->udp_port() > 0) {
+        boost::system::error_code error;
+        auto address = boost::asio::ip::address::from_string(session->global_ip(), error);
+        if (!error) {
+            entry.endpoint = udp::endpoint(address, session->udp_port());
+            entry.has_endpoint = true;
+        }
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+        Unindex(key, it->second);
+    }
+
+    if (entry.id > 0) {
+        ids_[entry.id] = key;
+        logged_in_[key] = entry.session;
+        channels_[entry.channel][key] = entry.session;
+    }
+
+    if (entry.has_endpoint) {
+        endpoints_[entry.endpoint] = key;
+    }
+
+    entries_[key] = entry;
+}
+
+bool SessionRegistry::Remove(UserID user_id, const Session* session)
+{
+    boost::mutex::scoped_lock lock(mutex_);
+
+    bool current = true;
+    auto id_it = ids_.find(user_id);
+    if (id_it != ids_.end() && id_it->second != session) {
+        auto other = entries_.find(id_it->second);
+        current = other == entries_.end() || other->second.session.expired();
+    }
+
+    auto it = entries_.find(session);
+    if (it != entries_.end()) {
+        Unindex(session, it->second);
+        entries_.erase(it);
+    }
+    if (current) {
+        ids_.erase(user_id);
+    }
+    return current;
+}
+
+void SessionRegistry::Purge()
+{
+    boost::mutex::scoped_lock lock(mutex_);
+
+    for (auto it = entries_.begin(); it != entries_.end(); ) {
+        if (it->second.session.expired()) {
+            Unindex(it->first, it->second);
+            it = entries_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+SessionPtr SessionRegistry::FindByID(UserID user_id) const
+{
+    boost::mutex::scoped_lock lock(mutex_);
+
+    auto id_it = ids_.find(user_id);
+    if (id_it != ids_.end()) {
+        auto it = entries_.find(id_it->second);
+        if (it != entries_.end()) {
+            return it->second.session.lock();
+        }
+    }
+    return SessionPtr();
+}
+
+SessionPtr SessionRegistry::FindByEndpoint(const udp::endpoint& endpoint) const
+{
+    boost::mutex::scoped_lock lock(mutex_);
+
+    auto endpoint_it = endpoints_.find(endpoint);
+    if (endpoint_it != endpoints_.end()) {
+        auto it = entries_.find(endpoint_it->second);
+        if (it != entries_.end()) {
+            return it->second.session.lock();
+        }
+    }
+    return SessionPtr();
+}
+
+int SessionRegistry::user_count() const
+{
+    boost::mutex::scoped_lock lock(mutex_);
+    return logged_in_.size();
+}
+
+void SessionRegistry::Unindex(const Session* key, const Entry& entry)
+{
+    // 同じIDや宛先で後から登録された別のセッションの索引は残す
+    if (entry.id > 0) {
+        auto id_it = ids_.find(entry.id);
+        if (id_it != ids_.end() && id_it->second == key) {
+            ids_.erase(id_it);
+        }
+        logged_in_.erase(key);
+
+        auto channel_it = channels_.find(entry.channel);
+        if (channel_it != channels_.end()) {
+            channel_it->second.erase(key);
+            if (channel_it->second.empty()) {
+                channels_.erase(channel_it);
+            }
+        }
+    }
+
+    if (entry.has_endpoint) {
+        auto endpoint_it = endpoints_.find(entry.endpoint);
+        if (endpoint_it != endpoints_.end() && endpoint_it->second == key) {
+            endpoints_.erase(endpoint_it);
+        }
+    }
+}
+
+}
@@ -0,0 +1,81 @@
+//
+// SessionRegistry.hpp
+//
+
+#pragma once
+
+#include <unordered_map>
+#include <boost/thread.hpp>
+#include <boost/foreach.hpp>
+#include "../common/network/Session.hpp"
+
+namespace network {
+
+// セッションをユーザーID・UDPの宛先・チャンネルから引けるようにする
+class SessionRegistry {
+    public:
+        SessionRegistry();
+
+        // セッションの現在の状態で索引を作り直す
+        void Update(const SessionPtr& session);
+
+        // 同じユーザーIDで後から登録された別のセッションが残っている場合は false
+        bool Remove(UserID user_id, const Session* session);
+
+        // 破棄されたセッションを取り除く
+        void Purge();
+
+        SessionPtr FindByID(UserID user_id) const;
+        SessionPtr FindByEndpoint(const udp::endpoint& endpoint) const;
+
+        // ログイン済みのセッションに対して func を呼ぶ channel < 0 で全チャンネル
+        template<class F>
+        void ForEach(int channel, F func) const
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            const SessionMap* sessions = &logged_in_;
+            if (channel >= 0) {
+                auto it = channels_.find(channel);
+                if (it == channels_.end()) {
+                    return;
+                }
+                sessions = &it->second;
+            }
+            BOOST_FOREACH(const auto& pair, *sessions) {
+                if (auto session = pair.second.lock()) {
+                    func(session);
+                }
+            }
+        }
+
+        int user_count() const;
+
+    private:
+        struct EndpointHash {
+            size_t operator()(const udp::endpoint& endpoint) const;
+        };
+
+        struct Entry {
+            SessionWeakPtr session;
+            UserID id;
+            int channel;
+            bool has_endpoint;
+            udp::endpoint endpoint;
+        };
+
+        typedef std::unordered_map<const Session*, SessionWeakPtr> SessionMap;
+
+        void Unindex(const Session* key, const Entry& entry);
+
+    private:
+        std::unordered_map<const Session*, Entry> entries_;
+
+        std::unordered_map<UserID, const Session*> ids_;
+        std::unordered_map<udp::endpoint, const Session*, EndpointHash> endpoints_;
+        std::unordered_map<int, SessionMap> channels_;
+        SessionMap logged_in_;
+
+        mutable boost::mutex mutex_;
+};
+
+}
@@ -0,0 +1,102 @@
+//
+// SessionTicket.cpp
+//
+
+#include "SessionTicket.hpp"
+#include "../common/network/Utils.hpp"
+#include "../common/network/Encrypter.hpp"
+#include <ctime>
+
+#define SESSION_TICKET_NONCE_SIZE (12)
+#define SESSION_TICKET_TAG_SIZE (16)
+
+namespace network {
+
+using namespace CryptoPP;
+
+SessionTicket::SessionTicket(int lifetime) :
+    lifetime_(lifetime)
+{
+    SetKey(Encrypter::GetRandomBytes(AES::DEFAULT_KEYLENGTH));
+}
+
+void SessionTicket::SetKey(const std::string& key)
+{
+    // nonce はチケットごとに渡すので、ここでの IV は使われない
+    byte iv[SESSION_TICKET_NONCE_SIZE] = {};
+    key_ = key;
+    encrypt_.SetKeyWithIV((const byte*)key_.data(), key_.size(), iv, sizeof(iv));
+    decrypt_.SetKeyWithIV((const byte*)key_.data(), key_.size(), iv, sizeof(iv));
+}
+
+std::string SessionTicket::Issue(uint32_t user_id, const std::string& secret)
+{
+    if (!enabled()) {
+        return std::string();
+    }
+
+    // nonce | 暗号文 | 認証タグ
+    const uint32_t expires = static_cast<uint32_t>(time(nullptr)) + lifetime_;
+    std::string ticket = Encrypter::GetRandomBytes(SESSION_TICKET_NONCE_SIZE)
+        + Utils::Serialize(user_id, expires, secret);
+    const size_t size = ticket.size() - SESSION_TICKET_NONCE_SIZE;
+    ticket.resize(ticket.size() + SESSION_TICKET_TAG_SIZE);
+
+    byte* data = (byte*)&ticket[0];
+    boost::mutex::scoped_lock lock(mutex_);
+    encrypt_.EncryptAndAuthenticate(data + SESSION_TICKET_NONCE_SIZE,
+            data + SESSION_TICKET_NONCE_SIZE + size, SESSION_TICKET_TAG_SIZE,
+            data, SESSION_TICKET_NONCE_SIZE, nullptr, 0,
+            data + SESSION_TICKET_NONCE_SIZE, size);
+    return ticket;
+}
+
+bool SessionTicket::Open(const std::string& ticket, uint32_t* user_id, std::string* secret)
+{
+    if (!enabled() || ticket.size() <= SESSION_TICKET_NONCE_SIZE + SESSION_TICKET_TAG_SIZE) {
+        return false;
+    }
+
+    const size_t size = ticket.size() - SESSION_TICKET_NONCE_SIZE - SESSION_TICKET_TAG_SIZE;
+    std::string plain(size, '\0');
+    const byte* data = (const byte*)ticket.data();
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        if (!decrypt_.DecryptAndVerify((byte*)&plain[0],
+                data + SESSION_TICKET_NONCE_SIZE + size, SESSION_TICKET_TAG_SIZE,
+                data, SESSION_TICKET_NONCE_SIZE, nullptr, 0,
+                data + SESSION_TICKET_NONCE_SIZE, size)) {
+            return false;
+        }
+    }
+
+    uint32_t expires;
+    BinaryReader reader(plain);
+    if (!reader.Read(user_id, &expires, secret)) {
+        return false;
+    }
+    return static_cast<uint32_t>(time(nullptr)) < expires;
+}
+
+bool SessionTicket::enabled() const
+{
+    return lifetime_ > 0;
+}
+
+std::string SessionTicket::SaveState() const
+{
+    return key_;
+}
+
+bool SessionTicket::LoadState(const std::string& state)
+{
+    if (state.size() != AES::DEFAULT_KEYLENGTH) {
+        return false;
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+    SetKey(state);
+    return true;
+}
+
+}
@@ -0,0 +1,46 @@
+//
+// SessionTicket.hpp
+//
+
+#pragma once
+
+#include <string>
+#include <stdint.h>
+#include <gcm.h>
+#include <aes.h>
+#include <boost/thread.hpp>
+
+namespace network {
+
+// 再接続用のチケットを発行して検証する
+// チケットはサーバーだけが知る鍵で暗号化した (ユーザーID, 有効期限, 秘密) で、サーバー側には何も保存しない
+// 鍵は起動ごとに作り直すので、再起動すると以前のチケットは使えなくなる (状態を引き継いだ再起動を除く)
+class SessionTicket {
+    public:
+        // lifetime 秒の間有効なチケットを発行する 0 なら発行しない
+        explicit SessionTicket(int lifetime);
+
+        // 発行しない設定の場合は空文字列
+        std::string Issue(uint32_t user_id, const std::string& secret);
+
+        // 改ざんされているか期限切れの場合は false
+        bool Open(const std::string& ticket, uint32_t* user_id, std::string* secret);
+
+        bool enabled() const;
+
+        // チケットの鍵 引き継いだ側は以前のチケットをそのまま受け付ける
+        std::string SaveState() const;
+        bool LoadState(const std::string& state);
+
+    private:
+        void SetKey(const std::string& key);
+
+    private:
+        const int lifetime_;
+        std::string key_;
+        CryptoPP::GCM<CryptoPP::AES>::Encryption encrypt_;
+        CryptoPP::GCM<CryptoPP::AES>::Decryption decrypt_;
+        boost::mutex mutex_;
+};
+
+}
@@ -0,0 +1,275 @@
+//
+// TimerWheel.cpp
+//
+
+#include "TimerWheel.hpp"
+#include "../common/Logger.hpp"
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_MAX_TICKS ((1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+#define TIMER_WHEEL_NIL (0xFFFFFFFF)
+#define TIMER_WHEEL_SLOT_FREE (0xFFFFFFFF)
+#define TIMER_WHEEL_SLOT_RUNNING (0xFFFFFFFE)
+
+namespace network {
+
+namespace {
+
+TimerWheel::TimerID MakeID(uint32_t index, uint32_t generation)
+{
+    return (static_cast<uint64_t>(generation) << 32) | (static_cast<uint64_t>(index) + 1);
+}
+
+}
+
+TimerWheel::TimerWheel(boost::asio::io_service& io_service, int tick_msec) :
+    timer_(io_service),
+    tick_msec_(std::max(1, tick_msec)),
+    free_list_(TIMER_WHEEL_NIL),
+    current_tick_(0),
+    size_(0)
+{
+    std::fill(&slots_[0][0], &slots_[0][0] + TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS, TIMER_WHEEL_NIL);
+}
+
+void TimerWheel::Start()
+{
+    start_time_ = boost::posix_time::microsec_clock::universal_time();
+    Wait();
+}
+
+void TimerWheel::Stop()
+{
+    timer_.cancel();
+}
+
+TimerWheel::TimerID TimerWheel::Schedule(int msec, const Handler& handler, int interval)
+{
+    const uint64_t ticks = (std::max(0, msec) + tick_msec_ - 1) / tick_msec_;
+
+    boost::mutex::scoped_lock lock(mutex_);
+    const uint32_t index = Allocate();
+    Node& node = nodes_[index];
+    node.expires = current_tick_ + ticks;
+    node.interval = interval > 0 ? std::max(1, (interval + tick_msec_ - 1) / tick_msec_) : 0;
+    node.handler = handler;
+    Link(index);
+
+    return MakeID(index, node.generation);
+}
+
+bool TimerWheel::Cancel(TimerID id)
+{
+    if (id == 0) {
+        return false;
+    }
+    const uint32_t index = static_cast<uint32_t>(id & 0xFFFFFFFF) - 1;
+    const uint32_t generation = static_cast<uint32_t>(id >> 32);
+
+    boost::mutex::scoped_lock lock(mutex_);
+    if (index >= nodes_.size()) {
+        return false;
+    }
+
+    Node& node = nodes_[index];
+    if (node.generation != generation || node.slot == TIMER_WHEEL_SLOT_FREE) {
+        return false;
+    }
+
+    // 実行中の繰り返しタイマーは、実行後に再登録されなくなる
+    if (node.slot != TIMER_WHEEL_SLOT_RUNNING) {
+        Unlink(index);
+    }
+    Free(index);
+    return true;
+}
+
+void TimerWheel::Advance(uint64_t ticks)
+{
+    // ハンドラはロックの外で呼ぶ 繰り返しのタイマーはIDを残しておき、後で再登録する
+    std::vector<std::pair<TimerID, Handler>> expired;
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        for (uint64_t i = 0; i < ticks; i++) {
+            const uint32_t slot = current_tick_ & TIMER_WHEEL_MASK;
+            if (slot == 0) {
+                Cascade(1);
+            }
+
+            uint32_t& head = slots_[0][slot];
+            while (head != TIMER_WHEEL_NIL) {
+                const uint32_t index = head;
+                Unlink(index);
+
+                Node& node = nodes_[index];
+                if (node.interval > 0) {
+                    node.slot = TIMER_WHEEL_SLOT_RUNNING;
+                    expired.push_back(std::make_pair(MakeID(index, node.generation), node.handler));
+                } else {
+                    expired.push_back(std::make_pair(TimerID(0), Handler()));
+                    expired.back().second.swap(node.handler);
+                    Free(index);
+                }
+            }
+            current_tick_++;
+        }
+    }
+
+    if (expired.empty()) {
+        return;
+    }
+
+    BOOST_FOREACH(const auto& timer, expired) {
+        try {
+            timer.second();
+        } catch (std::exception& e) {
+            Logger::Error("Timer handler failed: %s", e.what());
+        }
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+    BOOST_FOREACH(const auto& timer, expired) {
+        if (timer.first == 0) {
+            continue;
+        }
+        const uint32_t index = static_cast<uint32_t>(timer.first & 0xFFFFFFFF) - 1;
+        Node& node = nodes_[index];
+        if (node.generation == static_cast<uint32_t>(timer.first >> 32) &&
+                node.slot == TIMER_WHEEL_SLOT_RUNNING) {
+            node.expires = current_tick_ + node.interval - 1;
+            Link(index);
+        }
+    }
+}
+
+size_t TimerWheel::size() const
+{
+    boost::mutex::scoped_lock lock(mutex_);
+    return size_;
+}
+
+int TimerWheel::tick_msec() const
+{
+    return tick_msec_;
+}
+
+uint32_t TimerWheel::Allocate()
+{
+    uint32_t index;
+    if (free_list_ != TIMER_WHEEL_NIL) {
+        index = free_list_;
+        free_list_ = nodes_[index].next;
+    } else {
+        index = nodes_.size();
+        nodes_.push_back(Node());
+        nodes_.back().slot = TIMER_WHEEL_SLOT_FREE;
+    }
+    size_++;
+    return index;
+}
+
+void TimerWheel::Free(uint32_t index)
+{
+    Node& node = nodes_[index];
+    node.handler = Handler();
+    node.generation++;
+    node.slot = TIMER_WHEEL_SLOT_FREE;
+    node.next = free_list_;
+    free_list_ = index;
+    size_--;
+}
+
+void TimerWheel::Link(uint32_t index)
+{
+    Node& node = nodes_[index];
+    if (node.expires < current_tick_) {
+        node.expires = current_tick_;
+    }
+    if (node.expires - current_tick_ > TIMER_WHEEL_MAX_TICKS) {
+        node.expires = current_tick_ + TIMER_WHEEL_MAX_TICKS;
+    }
+
+    // 残りのティック数で段を選び、期限の該当する桁で枠を選ぶ
+    const uint64_t delta = node.expires - current_tick_;
+    int level = 0;
+    while (level + 1 < TIMER_WHEEL_LEVELS && delta >= (1ULL << (TIMER_WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    const uint32_t slot = (node.expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+
+    uint32_t& head = slots_[level][slot];
+    node.slot = level * TIMER_WHEEL_SLOTS + slot;
+    node.prev = TIMER_WHEEL_NIL;
+    node.next = head;
+    if (head != TIMER_WHEEL_NIL) {
+        nodes_[head].prev = index;
+    }
+    head = index;
+}
+
+void TimerWheel::Unlink(uint32_t index)
+{
+    Node& node = nodes_[index];
+    if (node.prev != TIMER_WHEEL_NIL) {
+        nodes_[node.prev].next = node.next;
+    } else {
+        slots_[node.slot / TIMER_WHEEL_SLOTS][node.slot % TIMER_WHEEL_SLOTS] = node.next;
+    }
+    if (node.next != TIMER_WHEEL_NIL) {
+        nodes_[node.next].prev = node.prev;
+    }
+}
+
+void TimerWheel::Cascade(int level)
+{
+    // 1段上の枠が一周したら、その中身を下の段に振り分け直す
+    const uint32_t slot = (current_tick_ >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    uint32_t index = slots_[level][slot];
+    slots_[level][slot] = TIMER_WHEEL_NIL;
+    while (index != TIMER_WHEEL_NIL) {
+        const uint32_t next = nodes_[index].next;
+        Link(index);
+        index = next;
+    }
+
+    if (slot == 0 && level + 1 < TIMER_WHEEL_LEVELS) {
+        Cascade(level + 1);
+    }
+}
+
+void TimerWheel::Wait()
+{
+    uint64_t next_tick;
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        next_tick = current_tick_;
+    }
+    timer_.expires_at(start_time_ + boost::posix_time::milliseconds(next_tick * tick_msec_));
+    timer_.async_wait(boost::bind(&TimerWheel::OnTick, this, boost::asio::placeholders::error));
+}
+
+void TimerWheel::OnTick(const boost::system::error_code& error)
+{
+    if (error) {
+        return;
+    }
+
+    // 遅れた場合は経過した分をまとめて進める
+    const auto elapsed = boost::posix_time::microsec_clock::universal_time() - start_time_;
+    const uint64_t now_tick = elapsed.total_milliseconds() / tick_msec_;
+    uint64_t current_tick;
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        current_tick = current_tick_;
+    }
+    if (now_tick >= current_tick) {
+        Advance(now_tick - current_tick + 1);
+    }
+
+    Wait();
+}
+
+}
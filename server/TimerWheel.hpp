@@ -0,0 +1,79 @@
+//
+// TimerWheel.hpp
+//
+
+#pragma once
+
+#include <vector>
+#include <functional>
+#include <stdint.h>
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+
+#define TIMER_WHEEL_BITS (6)
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS (4)
+
+namespace network {
+
+// 多数のタイマーを1つの deadline_timer でまとめて扱う階層タイミングホイール
+// 予約と取り消しはタイマーの数によらず定数時間で、精度は tick_msec 単位
+// 64^4 ティックより先の予約は、その上限に切り詰める
+class TimerWheel {
+    public:
+        typedef uint64_t TimerID;   // 0 は無効
+        typedef std::function<void()> Handler;
+
+        TimerWheel(boost::asio::io_service& io_service, int tick_msec);
+
+        void Start();
+        void Stop();
+
+        // msec ミリ秒後に handler を呼ぶ
+        // interval を指定すると、以降は取り消すまで interval ミリ秒ごとに呼ぶ
+        TimerID Schedule(int msec, const Handler& handler, int interval = 0);
+
+        // 実行前に取り消せた場合は true 繰り返しのタイマーは実行中でも以降を取り消す
+        bool Cancel(TimerID id);
+
+        // ティックを進めて、期限が来たタイマーを呼ぶ
+        void Advance(uint64_t ticks);
+
+        size_t size() const;
+        int tick_msec() const;
+
+    private:
+        struct Node {
+            Node() : expires(0), generation(0), interval(0), prev(0), next(0), slot(0) {}
+            uint64_t expires;
+            uint32_t generation;    // 解放するたびに増やし、古いIDでの取り消しを防ぐ
+            uint32_t interval;      // ティック 0 なら1回だけ
+            uint32_t prev, next;
+            uint32_t slot;
+            Handler handler;
+        };
+
+        uint32_t Allocate();
+        void Free(uint32_t index);
+        void Link(uint32_t index);
+        void Unlink(uint32_t index);
+        void Cascade(int level);
+
+        void OnTick(const boost::system::error_code& error);
+        void Wait();
+
+    private:
+        boost::asio::deadline_timer timer_;
+        const int tick_msec_;
+        boost::posix_time::ptime start_time_;
+
+        std::vector<Node> nodes_;
+        uint32_t free_list_;
+        uint32_t slots_[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+        uint64_t current_tick_;     // 次に処理するティック
+        size_t size_;
+
+        mutable boost::mutex mutex_;
+};
+
+}
@@ -0,0 +1,122 @@
+//
+// AccountBench.cpp
+//
+// Account の名前などを値で返す方法と、呼び出し側のバッファにコピーする方法で
+// 1回あたりの時間とメモリ確保の回数を比べる
+// make bench_account で実行する
+//
+
+#include "../Account.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+using namespace boost::posix_time;
+
+namespace {
+    size_t allocations = 0;
+}
+
+// メモリ確保の回数を数える
+void* operator new(size_t size)
+{
+    allocations++;
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) throw()
+{
+    std::free(p);
+}
+
+namespace {
+
+int failures = 0;
+
+void Check(bool condition, const char* name)
+{
+    if (!condition) {
+        std::printf("FAILED: %s\n", name);
+        failures++;
+    }
+}
+
+void Bench(Account& account, UserID users)
+{
+    const size_t reads = 1000000;
+    const size_t repeat = reads / (users * 4);
+    size_t sum_by_value = 0, sum_buffer = 0;
+
+    const size_t a0 = allocations;
+    auto t0 = microsec_clock::universal_time();
+    for (size_t r = 0; r < repeat; r++) {
+        for (UserID id = 1; id <= users; id++) {
+            sum_by_value += account.GetUserName(id).size();
+            sum_by_value += account.GetUserTrip(id).size();
+            sum_by_value += account.GetUserModelName(id).size();
+            sum_by_value += account.GetUserIPAddress(id).size();
+        }
+    }
+    auto t1 = microsec_clock::universal_time();
+    const size_t a1 = allocations;
+
+    std::string name, trip, model_name, ip_address;
+    for (size_t r = 0; r < repeat; r++) {
+        for (UserID id = 1; id <= users; id++) {
+            account.GetUserName(id, &name);
+            account.GetUserTrip(id, &trip);
+            account.GetUserModelName(id, &model_name);
+            account.GetUserIPAddress(id, &ip_address);
+            sum_buffer += name.size() + trip.size() + model_name.size() + ip_address.size();
+        }
+    }
+    auto t2 = microsec_clock::universal_time();
+    const size_t a2 = allocations;
+
+    Check(sum_by_value == sum_buffer, "same values");
+
+    const double count = repeat * users * 4.0;
+    std::printf("%6u users  by value %6.1f ns %5.2f alloc  buffer %6.1f ns %5.2f alloc\n",
+            static_cast<unsigned int>(users),
+            (t1 - t0).total_microseconds() * 1000.0 / count, (a1 - a0) / count,
+            (t2 - t1).total_microseconds() * 1000.0 / count, (a2 - a1) / count);
+}
+
+}
+
+int main()
+{
+    const UserID populations[] = {1000, 10000};
+
+    Account account;
+    for (UserID id = 1; id <= populations[1]; id++) {
+        char value[64];
+        std::sprintf(value, "player name %05u", id);
+        account.SetUserName(id, value);
+        std::sprintf(value, "trip%08u", id);
+        account.SetUserTrip(id, value);
+        std::sprintf(value, "char:model:%u", id % 10);
+        account.SetUserModelName(id, value);
+        std::sprintf(value, "192.168.%u.%u", id / 250, id % 250);
+        account.SetUserIPAddress(id, value);
+    }
+
+    // いないユーザーは空になる
+    std::string name = "stale";
+    Check(!account.GetUserName(populations[1] + 1, &name) && name.empty(), "missing user");
+
+    std::printf("per read of one property\n");
+    for (int i = 0; i < 2; i++) {
+        Bench(account, populations[i]);
+    }
+
+    if (failures > 0) {
+        return 1;
+    }
+    std::printf("OK\n");
+    return 0;
+}
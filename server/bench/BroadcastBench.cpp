@@ -0,0 +1,111 @@
+//
+// BroadcastBench.cpp
+//
+// SendAll / SendOthers で1つのコマンドをチャンネルの全員に送る時の CPU 時間を、
+// 受信者ごとに圧縮する以前の方法と、一度だけ圧縮したフレームを共有する方法で比べる
+// make bench_broadcast で実行する
+//
+
+#include "../../common/network/Session.hpp"
+#include "../../common/network/Command.hpp"
+#include <cstdio>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+using namespace network;
+using namespace boost::posix_time;
+
+namespace {
+
+// 接続せずに、送信前の処理だけを行う
+class BenchSession : public Session {
+    public:
+        BenchSession(boost::asio::io_service& io_service) :
+            Session(io_service) {}
+
+        void Start() {}
+
+        // 以前の SendAll と同じく、受信者ごとにヘッダの付加と圧縮から行う
+        std::string SerializeEach(const Command& command)
+        {
+            return Seal(Compose(command)->data());
+        }
+
+        // 共有したフレームに、受信者ごとの暗号化とフレーミングだけを行う
+        std::string SealShared(const FramePtr& frame)
+        {
+            return Seal(frame->data());
+        }
+};
+
+typedef boost::shared_ptr<BenchSession> BenchSessionPtr;
+
+std::string JsonPayload(size_t size)
+{
+    std::string data = "{\"type\":\"chat\",\"body\":\"";
+    int i = 0;
+    while (data.size() + 2 < size) {
+        char word[32];
+        std::sprintf(word, "hello world %d ", i++ % 100);
+        data += word;
+    }
+    data.resize(size - 2);
+    return data + "\"}";
+}
+
+void Bench(const char* name, const Command& command, const std::vector<BenchSessionPtr>& sessions,
+        size_t population)
+{
+    const size_t sends = 200000;
+    const size_t repeat = std::max<size_t>(1, sends / population);
+    size_t bytes = 0;
+
+    auto t0 = microsec_clock::universal_time();
+    for (size_t r = 0; r < repeat; r++) {
+        for (size_t i = 0; i < population; i++) {
+            bytes += sessions[i]->SerializeEach(command).size();
+        }
+    }
+    auto t1 = microsec_clock::universal_time();
+    for (size_t r = 0; r < repeat; r++) {
+        auto frame = Session::Compose(command);
+        for (size_t i = 0; i < population; i++) {
+            bytes += sessions[i]->SealShared(frame).size();
+        }
+    }
+    auto t2 = microsec_clock::universal_time();
+
+    const double each = (t1 - t0).total_microseconds() * 1.0 / repeat;
+    const double shared = (t2 - t1).total_microseconds() * 1.0 / repeat;
+    std::printf("%-6s %5u  per-recipient %9.1f us  shared %9.1f us  x%.2f  [%u]\n",
+            name, static_cast<unsigned int>(population), each, shared, each / shared,
+            static_cast<unsigned int>(bytes % 10));
+}
+
+}
+
+int main()
+{
+    boost::asio::io_service io_service;
+
+    const size_t populations[] = {1, 10, 100, 500, 1000};
+    std::vector<BenchSessionPtr> sessions;
+    for (size_t i = 0; i < populations[4]; i++) {
+        sessions.push_back(boost::make_shared<BenchSession>(boost::ref(io_service)));
+        sessions.back()->EnableEncryption();
+    }
+    io_service.poll();
+
+    // 短いチャットは圧縮しないので差は出ない
+    const Command chat(header::ClientReceiveJSON, JsonPayload(80));
+    const Command json(header::ClientReceiveJSON, JsonPayload(1024));
+    const Command large(header::ClientReceiveJSON, JsonPayload(8192));
+
+    std::printf("recipients, microseconds per broadcast\n");
+    for (int i = 0; i < 5; i++) {
+        Bench("80B", chat, sessions, populations[i]);
+        Bench("1KB", json, sessions, populations[i]);
+        Bench("8KB", large, sessions, populations[i]);
+    }
+    std::printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,204 @@
+//
+// ByteStuffingBench.cpp
+//
+// バイトスタッフィングが以前の1バイトずつの実装と同じ結果になることを確かめ、
+// 平文・LZ4・暗号文のペイロードで速度を比べる
+// Utils.cpp を SIMD 無し・SSE2・AVX2 でそれぞれ組み込み、make bench_byte_stuffing で実行する
+//
+
+#include "../../common/network/Utils.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+using namespace network;
+using namespace boost::posix_time;
+
+#if defined(NETWORK_UTILS_NO_SIMD)
+#define BENCH_VARIANT "scalar"
+#elif defined(__AVX2__)
+#define BENCH_VARIANT "avx2"
+#else
+#define BENCH_VARIANT "sse2"
+#endif
+
+namespace {
+
+int failures = 0;
+
+// 以前の実装
+std::string OldEncode(const std::string& in)
+{
+    std::string out;
+    out.reserve(in.size() * 1.2);
+    for (size_t i = 0; i < in.size(); i++) {
+        const char c = in[i];
+        if (c == 0x7e || c == 0x7d) {
+            out += 0x7d;
+            out += c ^ 0x20;
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+std::string OldDecode(const char* data, size_t size)
+{
+    std::string out;
+    out.reserve(size);
+    bool escape = false;
+    for (const char* it = data; it != data + size; ++it) {
+        const char c = *it;
+        if (escape) {
+            out += c ^ 0x20;
+            escape = false;
+        } else if (!(escape = (c == 0x7d))) {
+            out += c;
+        }
+    }
+    return out;
+}
+
+uint32_t Random()
+{
+    static uint32_t state = 2463534242u;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+// escape_rate / 256 の割合でエスケープが必要なバイトを混ぜる
+std::string RandomBytes(size_t size, int escape_rate)
+{
+    std::string data(size, '\0');
+    for (size_t i = 0; i < size; i++) {
+        const uint32_t r = Random();
+        if (static_cast<int>(r & 0xFF) < escape_rate) {
+            data[i] = (r & 0x100) ? 0x7e : 0x7d;
+        } else {
+            data[i] = static_cast<char>(r >> 16);
+        }
+    }
+    return data;
+}
+
+void CheckSame(const std::string& in, const char* name)
+{
+    const std::string encoded = Utils::ByteStuffingEncode(in);
+    if (encoded != OldEncode(in) || Utils::ByteStuffingDecode(encoded) != in) {
+        std::printf("FAILED: %s encode (%u bytes)\n", name, static_cast<unsigned int>(in.size()));
+        failures++;
+    }
+    // 不正な入力や末尾のエスケープ文字も以前と同じように扱う
+    if (Utils::ByteStuffingDecode(in) != OldDecode(in.data(), in.size())) {
+        std::printf("FAILED: %s decode (%u bytes)\n", name, static_cast<unsigned int>(in.size()));
+        failures++;
+    }
+}
+
+void Test()
+{
+    // SIMD の幅をまたぐ長さと、エスケープの位置を全て試す
+    for (size_t size = 0; size <= 100; size++) {
+        for (size_t pos = 0; pos < size; pos++) {
+            std::string data(size, 'a');
+            data[pos] = 0x7e;
+            CheckSame(data, "single 0x7e");
+            data[pos] = 0x7d;
+            CheckSame(data, "single 0x7d");
+        }
+    }
+
+    const int rates[] = {0, 2, 16, 128, 256};
+    for (int r = 0; r < 5; r++) {
+        for (int i = 0; i < 2000; i++) {
+            CheckSame(RandomBytes(Random() % 300, rates[r]), "random");
+        }
+    }
+    CheckSame(std::string(1000, 0x7d), "all 0x7d");
+    CheckSame(std::string(1000, 0x7e), "all 0x7e");
+}
+
+// チャットや位置などの JSON を並べた平文
+std::string PlainPayload(size_t size)
+{
+    std::string data;
+    int i = 0;
+    while (data.size() < size) {
+        char line[128];
+        std::sprintf(line, "{\"type\":\"chat\",\"id\":%d,\"name\":\"user%d\",\"body\":\"hello world %d\"}",
+                i, i % 50, i * 7);
+        data += line;
+        i++;
+    }
+    data.resize(size);
+    return data;
+}
+
+double MegaBytesPerSecond(size_t bytes, const time_duration& duration)
+{
+    return bytes / 1048576.0 / (duration.total_microseconds() / 1000000.0);
+}
+
+void Bench(const char* name, const std::string& payload)
+{
+    const size_t total = 64 << 20;
+    const size_t repeat = total / payload.size();
+    const std::string encoded = Utils::ByteStuffingEncode(payload);
+    size_t check = 0;
+
+    auto t0 = microsec_clock::universal_time();
+    for (size_t i = 0; i < repeat; i++) {
+        check += Utils::ByteStuffingEncode(payload).size();
+    }
+    auto t1 = microsec_clock::universal_time();
+    for (size_t i = 0; i < repeat; i++) {
+        check += Utils::ByteStuffingDecode(encoded).size();
+    }
+    auto t2 = microsec_clock::universal_time();
+    for (size_t i = 0; i < repeat; i++) {
+        check += OldEncode(payload).size();
+    }
+    auto t3 = microsec_clock::universal_time();
+    for (size_t i = 0; i < repeat; i++) {
+        check += OldDecode(encoded.data(), encoded.size()).size();
+    }
+    auto t4 = microsec_clock::universal_time();
+
+    const size_t bytes = repeat * payload.size();
+    std::printf("%-6s %5u  encode %7.0f MB/s (old %5.0f)  decode %7.0f MB/s (old %5.0f)  escaped %.2f%%  [%u]\n",
+            name, static_cast<unsigned int>(payload.size()),
+            MegaBytesPerSecond(bytes, t1 - t0), MegaBytesPerSecond(bytes, t3 - t2),
+            MegaBytesPerSecond(bytes, t2 - t1), MegaBytesPerSecond(bytes, t4 - t3),
+            100.0 * (encoded.size() - payload.size()) / payload.size(),
+            static_cast<unsigned int>(check % 10));
+}
+
+}
+
+int main()
+{
+    Test();
+
+    std::printf("variant %s\n", BENCH_VARIANT);
+    const size_t sizes[] = {64, 512, 4096};
+    for (int i = 0; i < 3; i++) {
+        const std::string plain = PlainPayload(sizes[i]);
+        Bench("plain", plain);
+        // LZ4 は短いと小さくならないので、圧縮後に同じ長さになるよう元を長めにする
+        std::string lz4 = Utils::LZ4Compress(PlainPayload(sizes[i] * 8));
+        lz4.resize(std::min(lz4.size(), sizes[i]));
+        Bench("lz4", lz4);
+        // AES の暗号文は一様な乱数と同じ割合でエスケープが必要になる
+        Bench("aes", RandomBytes(sizes[i], 0));
+    }
+
+    if (failures > 0) {
+        std::printf("%d checks failed\n", failures);
+        return 1;
+    }
+    std::printf("OK\n");
+    return 0;
+}
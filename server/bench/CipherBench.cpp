@@ -0,0 +1,126 @@
+//
+// CipherBench.cpp
+//
+// 20〜200バイトの小さなフレームを AES-CFB と AES-GCM で暗号化して送り、
+// 受信側で復号するまでの1フレームあたりの時間とバイト数を比べる
+// make bench_cipher で実行する
+//
+
+#include "../../common/network/Session.hpp"
+#include "../../common/network/Command.hpp"
+#include "../../common/network/Utils.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+using namespace network;
+using namespace boost::posix_time;
+
+namespace {
+
+// 接続せずに、送信前と受信後の処理だけを行う
+class BenchSession : public Session {
+    public:
+        BenchSession(boost::asio::io_service& io_service, bool authenticated) :
+            Session(io_service)
+        {
+            encryption_ = true;
+            authenticated_encryption_ = authenticated;
+            length_prefixed_send_ = true;
+            length_prefixed_receive_ = true;
+        }
+
+        void Start() {}
+
+        std::string SerializeFrame(const Command& command)
+        {
+            return Seal(Compose(command)->data());
+        }
+
+        // 長さを読み飛ばして復号する
+        bool ReceiveFrame(const std::string& frame)
+        {
+            uint32_t length = 0;
+            size_t read = Utils::DeserializeVarint(frame.data(), frame.size(), &length);
+            return Deserialize(frame.data() + read, length).header() == header::ClientReceiveJSON;
+        }
+};
+
+typedef boost::shared_ptr<BenchSession> BenchSessionPtr;
+
+int failures = 0;
+
+void Check(bool condition, const char* name)
+{
+    if (!condition) {
+        std::printf("FAILED: %s\n", name);
+        failures++;
+    }
+}
+
+std::string RandomPayload(size_t size)
+{
+    std::string data(size, 0);
+    for (size_t i = 0; i < size; i++) {
+        data[i] = static_cast<char>(std::rand() & 0xff);
+    }
+    return data;
+}
+
+void Bench(size_t size)
+{
+    boost::asio::io_service io_service;
+    const size_t count = 200000;
+    const Command command(header::ClientReceiveJSON, RandomPayload(size));
+
+    std::printf("%4u B", static_cast<unsigned int>(size));
+    for (int authenticated = 0; authenticated < 2; authenticated++) {
+        // 再接続と同じ手順で、送信側と受信側に同じ共通鍵を持たせる
+        auto sender = boost::make_shared<BenchSession>(boost::ref(io_service), authenticated != 0);
+        auto receiver = boost::make_shared<BenchSession>(boost::ref(io_service), authenticated != 0);
+        const std::string secret(32, 's');
+        const std::string client_random(32, 'c');
+        receiver->encrypter().Resume(secret, client_random,
+                sender->encrypter().AcceptResumption(secret, client_random));
+
+        std::vector<std::string> frames(count);
+        auto t0 = microsec_clock::universal_time();
+        for (size_t i = 0; i < count; i++) {
+            frames[i] = sender->SerializeFrame(command);
+        }
+        auto t1 = microsec_clock::universal_time();
+        size_t received = 0;
+        for (size_t i = 0; i < count; i++) {
+            received += receiver->ReceiveFrame(frames[i]);
+        }
+        auto t2 = microsec_clock::universal_time();
+
+        Check(received == count, authenticated ? "gcm frames" : "cfb frames");
+        std::printf("  %s %5u B  seal %6.3f us  open %6.3f us",
+                authenticated ? "GCM" : "CFB",
+                static_cast<unsigned int>(frames[0].size()),
+                (t1 - t0).total_microseconds() * 1.0 / count,
+                (t2 - t1).total_microseconds() * 1.0 / count);
+    }
+    std::printf("\n");
+}
+
+}
+
+int main()
+{
+    std::srand(1);
+
+    std::printf("AES-NI %s\n", Encrypter::HardwareAESAvailable() ? "available" : "not available");
+    std::printf("payload, bytes on wire and microseconds per frame\n");
+    const size_t sizes[] = {20, 50, 100, 200};
+    for (int i = 0; i < 4; i++) {
+        Bench(sizes[i]);
+    }
+
+    if (failures > 0) {
+        return 1;
+    }
+    std::printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,146 @@
+//
+// FramingBench.cpp
+//
+// 区切り文字とバイトスタッフィングによるフレームと、長さを前置したフレームで
+// 送信側の組み立て、受信側の切り出しと復号の時間、回線上のバイト数を比べる
+// make bench_framing で実行する
+//
+
+#include "../../common/network/Session.hpp"
+#include "../../common/network/Command.hpp"
+#include "../../common/network/Utils.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+using namespace network;
+using namespace boost::posix_time;
+
+namespace {
+
+// 接続せずに、送信前と受信後の処理だけを行う
+class BenchSession : public Session {
+    public:
+        BenchSession(boost::asio::io_service& io_service, bool length_prefixed) :
+            Session(io_service)
+        {
+            length_prefixed_send_ = length_prefixed;
+            length_prefixed_receive_ = length_prefixed;
+        }
+
+        void Start() {}
+
+        std::string SerializeFrame(const Command& command)
+        {
+            return Seal(Compose(command)->data());
+        }
+
+        // ReceiveTCP と同じ方法でバッファからフレームを切り出して復号する
+        size_t ReceiveAll(const std::string& buffer)
+        {
+            const char* data = buffer.data();
+            const size_t size = buffer.size();
+            size_t commands = 0;
+            size_t begin = 0;
+            while (begin < size) {
+                if (length_prefixed_receive_) {
+                    uint32_t length = 0;
+                    size_t read = Utils::DeserializeVarint(data + begin, size - begin, &length);
+                    if (read == 0 || size - begin - read < length) {
+                        break;
+                    }
+                    commands += Deserialize(data + begin + read, length).body().size() > 0;
+                    begin += read + length;
+                } else {
+                    const char* end = static_cast<const char*>(
+                        std::memchr(data + begin, NETWORK_UTILS_DELIMITOR, size - begin));
+                    if (!end) {
+                        break;
+                    }
+                    size_t length = end - (data + begin);
+                    commands += Deserialize(data + begin, length).body().size() > 0;
+                    begin += length + 1;
+                }
+            }
+            return commands;
+        }
+};
+
+typedef boost::shared_ptr<BenchSession> BenchSessionPtr;
+
+std::string JsonPayload(size_t size)
+{
+    std::string data = "{\"type\":\"chat\",\"body\":\"";
+    int i = 0;
+    while (data.size() + 2 < size) {
+        char word[32];
+        std::sprintf(word, "hello world %d ", i++ % 100);
+        data += word;
+    }
+    data.resize(size - 2);
+    return data + "\"}";
+}
+
+// 暗号文と同じく、どのバイト値も同じ割合で現れる
+std::string RandomPayload(size_t size)
+{
+    std::string data(size, 0);
+    for (size_t i = 0; i < size; i++) {
+        data[i] = static_cast<char>(std::rand() & 0xff);
+    }
+    return data;
+}
+
+void Bench(const char* name, const Command& command)
+{
+    boost::asio::io_service io_service;
+    const size_t count = 20000;
+
+    std::printf("%-8s", name);
+    for (int length_prefixed = 0; length_prefixed < 2; length_prefixed++) {
+        auto sender = boost::make_shared<BenchSession>(boost::ref(io_service), length_prefixed != 0);
+        auto receiver = boost::make_shared<BenchSession>(boost::ref(io_service), length_prefixed != 0);
+        sender->EnableEncryption();
+        receiver->EnableEncryption();
+        io_service.poll();
+
+        std::string wire;
+        auto t0 = microsec_clock::universal_time();
+        for (size_t i = 0; i < count; i++) {
+            wire += sender->SerializeFrame(command);
+        }
+        auto t1 = microsec_clock::universal_time();
+        const size_t received = receiver->ReceiveAll(wire);
+        auto t2 = microsec_clock::universal_time();
+
+        if (received != count) {
+            std::printf("\nFAILED: %u of %u frames\n",
+                    static_cast<unsigned int>(received), static_cast<unsigned int>(count));
+            std::exit(1);
+        }
+
+        std::printf("  %s %7.1f B %7.3f us %7.3f us",
+                length_prefixed ? "prefixed" : "stuffing",
+                wire.size() * 1.0 / count,
+                (t1 - t0).total_microseconds() * 1.0 / count,
+                (t2 - t1).total_microseconds() * 1.0 / count);
+    }
+    std::printf("\n");
+}
+
+}
+
+int main()
+{
+    std::srand(1);
+
+    std::printf("bytes on wire, encode and decode microseconds per frame\n");
+    Bench("pos", Command(header::ClientReceiveJSON, RandomPayload(12)));
+    Bench("80B", Command(header::ClientReceiveJSON, JsonPayload(80)));
+    Bench("1KB", Command(header::ClientReceiveJSON, JsonPayload(1024)));
+    Bench("1KB bin", Command(header::ClientReceiveJSON, RandomPayload(1024)));
+    Bench("8KB bin", Command(header::ClientReceiveJSON, RandomPayload(8192)));
+    std::printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,174 @@
+//
+// PositionCodecBench.cpp
+//
+// PositionCodec の差分符号化を確かめ、1件あたりの時間とバイト数を測る
+// make bench_position_codec で実行する
+//
+
+#include "../../common/network/PositionCodec.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+using namespace network;
+using namespace boost::posix_time;
+
+namespace {
+
+int failures = 0;
+
+void Check(bool condition, const char* name)
+{
+    if (!condition) {
+        std::printf("FAILED: %s\n", name);
+        failures++;
+    }
+}
+
+bool Equals(const PlayerPosition& a, const PlayerPosition& b)
+{
+    return a.x == b.x && a.y == b.y && a.z == b.z && a.theta == b.theta && a.vy == b.vy;
+}
+
+// 符号化して復号し、元の値に戻ることと符号化後の長さを確かめる
+void CheckRoundTrip(const PlayerPosition* base, const PlayerPosition& pos,
+        size_t expected_size, uint8_t expected_flags, const char* name)
+{
+    const std::string data = PositionCodec::EncodeDelta(pos, base);
+    Check(data.size() == expected_size, name);
+    Check(!data.empty() && static_cast<uint8_t>(data[0]) == expected_flags, name);
+
+    PlayerPosition decoded;
+    Check(PositionCodec::DecodeDelta(data.data(), data.size(), base, &decoded) == data.size(), name);
+    Check(Equals(decoded, pos), name);
+
+    // 途中で切れている場合は読まない
+    if (data.size() > 1) {
+        Check(PositionCodec::DecodeDelta(data.data(), data.size() - 1, base, &decoded) == 0, name);
+    }
+}
+
+void Test()
+{
+    const PlayerPosition base(100, -200, 300, 250, -3);
+
+    CheckRoundTrip(nullptr, base, 9, PositionCodec::FLAG_ABSOLUTE, "absolute without base");
+    CheckRoundTrip(&base, base, 1, 0, "unchanged");
+
+    CheckRoundTrip(&base, PlayerPosition(101, -200, 300, 250, -3),
+            2, PositionCodec::FLAG_X, "int8 x");
+    CheckRoundTrip(&base, PlayerPosition(100 + 127, -200 - 128, 300, 250, -3),
+            3, PositionCodec::FLAG_X | PositionCodec::FLAG_Y, "int8 limits");
+
+    // 1つの軸が int8 に収まらなければ全ての軸を2バイトにする
+    CheckRoundTrip(&base, PlayerPosition(100 + 128, -199, 300, 250, -3),
+            5, PositionCodec::FLAG_WIDE | PositionCodec::FLAG_X | PositionCodec::FLAG_Y, "int16 widening");
+    CheckRoundTrip(&base, PlayerPosition(100, -200, 300 - 129, 250, -3),
+            3, PositionCodec::FLAG_WIDE | PositionCodec::FLAG_Z, "int16 negative");
+
+    // int16 に収まらない差分は絶対値で送る
+    const PlayerPosition far_base(-30000, 0, 0, 0, 0);
+    CheckRoundTrip(&far_base, PlayerPosition(30000, 0, 0, 0, 0),
+            9, PositionCodec::FLAG_ABSOLUTE, "absolute fallback");
+
+    // 角度は1バイトで一周するので、差分も折り返す
+    CheckRoundTrip(&base, PlayerPosition(100, -200, 300, 4, -3),
+            2, PositionCodec::FLAG_THETA, "theta wrap forward");
+    const PlayerPosition theta_base(0, 0, 0, 3, 0);
+    CheckRoundTrip(&theta_base, PlayerPosition(0, 0, 0, 252, 0),
+            2, PositionCodec::FLAG_THETA, "theta wrap backward");
+
+    CheckRoundTrip(&base, PlayerPosition(100, -200, 300, 250, 7),
+            2, PositionCodec::FLAG_VY, "vy");
+
+    // 基準が無い差分は復号できない
+    PlayerPosition decoded;
+    const PlayerPosition origin;
+    const std::string delta = PositionCodec::EncodeDelta(PlayerPosition(1, 0, 0, 0, 0), &origin);
+    Check(PositionCodec::DecodeDelta(delta.data(), delta.size(), nullptr, &decoded) == 0, "delta without base");
+
+    // 相手ごとの基準を更新し、Reset の後は絶対値に戻る
+    PositionCodec encoder, decoder;
+    Check(encoder.Encode(1, base).size() == 9, "codec first");
+    Check(encoder.Encode(1, base).size() == 1, "codec unchanged");
+    encoder.Reset(1);
+    Check(encoder.Encode(1, base).size() == 9, "codec reset");
+
+    PositionCodec restored;
+    Check(restored.LoadState(encoder.SaveState()) && restored.Encode(1, base).size() == 1, "codec state");
+
+    const std::string first = encoder.Encode(2, PlayerPosition(0, 0, 0, 0, 0));
+    const std::string second = encoder.Encode(2, PlayerPosition(5, 0, 0, 0, 0));
+    Check(decoder.Decode(2, first.data(), first.size(), &decoded) == first.size(), "codec decode first");
+    Check(decoder.Decode(2, second.data(), second.size(), &decoded) == second.size() &&
+            decoded.x == 5, "codec decode delta");
+}
+
+// 歩いているプレイヤーを想定した位置の列
+std::vector<PlayerPosition> MakeWalk(size_t count)
+{
+    std::vector<PlayerPosition> positions;
+    PlayerPosition pos;
+    std::srand(1);
+    for (size_t i = 0; i < count; i++) {
+        if (std::rand() % 4 != 0) {
+            pos.x += std::rand() % 21 - 10;
+            pos.z += std::rand() % 21 - 10;
+            pos.theta += std::rand() % 9 - 4;
+        }
+        if (std::rand() % 50 == 0) {
+            pos.vy = std::rand() % 20 - 10;
+            pos.y += pos.vy * 40;
+        }
+        positions.push_back(pos);
+    }
+    return positions;
+}
+
+void Bench()
+{
+    const size_t count = 1000000;
+    const std::vector<PlayerPosition> positions = MakeWalk(count);
+
+    PositionCodec encoder, decoder;
+    std::vector<std::string> encoded;
+    encoded.reserve(count);
+
+    auto start_time = microsec_clock::universal_time();
+    for (size_t i = 0; i < count; i++) {
+        encoded.push_back(encoder.Encode(1, positions[i]));
+    }
+    auto encode_time = microsec_clock::universal_time();
+
+    size_t bytes = 0;
+    bool matched = true;
+    PlayerPosition decoded;
+    for (size_t i = 0; i < count; i++) {
+        bytes += encoded[i].size();
+        decoder.Decode(1, encoded[i].data(), encoded[i].size(), &decoded);
+        matched = matched && Equals(decoded, positions[i]);
+    }
+    auto decode_time = microsec_clock::universal_time();
+    Check(matched, "bench round trip");
+
+    std::printf("positions        %u\n", static_cast<unsigned int>(count));
+    std::printf("bytes / position %.2f (absolute 9)\n", 1.0 * bytes / count);
+    std::printf("encode           %.1f ns / position\n",
+            (encode_time - start_time).total_nanoseconds() * 1.0 / count);
+    std::printf("decode           %.1f ns / position\n",
+            (decode_time - encode_time).total_nanoseconds() * 1.0 / count);
+}
+
+}
+
+int main()
+{
+    Test();
+    Bench();
+    if (failures > 0) {
+        std::printf("%d checks failed\n", failures);
+        return 1;
+    }
+    std::printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,229 @@
+//
+// SerializeBench.cpp
+//
+// CommandTemplateN と Utils::Serialize / Deserialize を BinaryWriter / BinaryReader で
+// 書き直す前と後で、同じバイト列になることを確かめ、1回あたりの時間を比べる
+// make bench_serialize で実行する
+//
+
+#include "../../common/network/Command.hpp"
+#include "../../common/network/Utils.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+using namespace network;
+using namespace boost::posix_time;
+
+namespace {
+
+// 書き直す前の実装 値ごとに一時的な文字列を作って反転し、連結する
+namespace legacy {
+    inline std::string ConvertEndian(const std::string& in)
+    {
+        if (Utils::little_endian()) {
+            std::string out = in;
+            std::reverse(out.begin(), out.end());
+            return out;
+        } else {
+            return in;
+        }
+    }
+
+    template<class T>
+    inline std::string GetSerializedValue(const T& t)
+    {
+        return ConvertEndian(std::string(reinterpret_cast<const char*>(&t), sizeof(t)));
+    }
+
+    template<>
+    inline std::string GetSerializedValue(const std::string& t)
+    {
+        int size = t.size();
+        return ConvertEndian(std::string(reinterpret_cast<const char*>(&size), sizeof(int))) +
+                std::string(t);
+    }
+
+    template<class T1, class T2>
+    inline std::string Serialize(const T1& t1, const T2& t2)
+    {
+        return GetSerializedValue(t1) + GetSerializedValue(t2);
+    }
+
+    template<class T1, class T2, class T3, class T4, class T5, class T6>
+    inline std::string Serialize(const T1& t1, const T2& t2, const T3& t3, const T4& t4, const T5& t5, const T6& t6)
+    {
+        return GetSerializedValue(t1) + GetSerializedValue(t2)
+            + GetSerializedValue(t3) + GetSerializedValue(t4)
+             + GetSerializedValue(t5) + GetSerializedValue(t6);
+    }
+
+    template<class First>
+    inline First GetDeserializedValue(std::string& buffer)
+    {
+        const First value = *reinterpret_cast<const First*>(ConvertEndian(buffer.substr(0, sizeof(First))).data());
+        buffer.erase(0, sizeof(First));
+        return value;
+    }
+
+    template<>
+    inline std::string GetDeserializedValue<std::string>(std::string& buffer)
+    {
+        int size = *reinterpret_cast<const int*>(ConvertEndian(buffer.substr(0, sizeof(int))).data());
+        buffer.erase(0, sizeof(int));
+        std::string data(buffer.data(), size);
+        buffer.erase(0, size);
+        return data;
+    }
+
+    template<class T1>
+    inline size_t Deserialize(const std::string& data, T1* t1)
+    {
+        std::string buffer(data);
+        *t1 = GetDeserializedValue<T1>(buffer);
+        return data.size() - buffer.size();
+    }
+
+    template<class T1, class T2, class T3, class T4, class T5, class T6>
+    inline size_t Deserialize(const std::string& data, T1* t1, T2* t2, T3* t3, T4* t4, T5* t5, T6* t6)
+    {
+        std::string buffer(data);
+        *t1 = GetDeserializedValue<T1>(buffer);
+        *t2 = GetDeserializedValue<T2>(buffer);
+        *t3 = GetDeserializedValue<T3>(buffer);
+        *t4 = GetDeserializedValue<T4>(buffer);
+        *t5 = GetDeserializedValue<T5>(buffer);
+        *t6 = GetDeserializedValue<T6>(buffer);
+        return data.size() - buffer.size();
+    }
+}
+
+int failures = 0;
+
+void Check(bool condition, const char* name)
+{
+    if (!condition) {
+        std::printf("FAILED: %s\n", name);
+        failures++;
+    }
+}
+
+void Report(const char* name, const time_duration& before, const time_duration& after, size_t count)
+{
+    const double b = before.total_microseconds() * 1000.0 / count;
+    const double a = after.total_microseconds() * 1000.0 / count;
+    std::printf("%-28s before %9.1f ns  after %9.1f ns  x%.1f\n", name, b, a, b / a);
+}
+
+// 初期化情報と同じ形式 プロパティ番号と文字列の組
+std::string InitializeData(int properties)
+{
+    std::string data;
+    for (int i = 0; i < properties; i++) {
+        char value[32];
+        std::sprintf(value, "value %d", i);
+        data += legacy::Serialize(static_cast<uint16_t>(0xA3), std::string(value));
+    }
+    return data;
+}
+
+void BenchSerialize()
+{
+    const size_t count = 1000000;
+    size_t sum = 0;
+
+    Check(ClientUpdatePlayerPosition(7, -100, 200, -300, 90, 3).body() ==
+            legacy::Serialize<uint32_t, int16_t, int16_t, int16_t, uint8_t, uint8_t>(7, -100, 200, -300, 90, 3),
+            "position bytes");
+
+    auto t0 = microsec_clock::universal_time();
+    for (size_t i = 0; i < count; i++) {
+        Command command(header::ClientUpdatePlayerPosition,
+                legacy::Serialize<uint32_t, int16_t, int16_t, int16_t, uint8_t, uint8_t>(
+                    i, i & 0x7fff, 200, -300, 90, 3));
+        sum += command.body().size();
+    }
+    auto t1 = microsec_clock::universal_time();
+    for (size_t i = 0; i < count; i++) {
+        ClientUpdatePlayerPosition command(i, i & 0x7fff, 200, -300, 90, 3);
+        sum += command.body().size();
+    }
+    auto t2 = microsec_clock::universal_time();
+
+    Check(sum == count * 2 * 12, "serialize size");
+    Report("CommandTemplate6 (position)", t1 - t0, t2 - t1, count);
+}
+
+void BenchDeserialize()
+{
+    const size_t count = 1000000;
+    const std::string body = ClientUpdatePlayerPosition(7, -100, 200, -300, 90, 3).body();
+    uint32_t id;
+    int16_t x, y, z;
+    uint8_t theta, vy;
+    size_t sum = 0;
+
+    auto t0 = microsec_clock::universal_time();
+    for (size_t i = 0; i < count; i++) {
+        sum += legacy::Deserialize(body, &id, &x, &y, &z, &theta, &vy) + id;
+    }
+    auto t1 = microsec_clock::universal_time();
+    for (size_t i = 0; i < count; i++) {
+        sum += Utils::Deserialize(body, &id, &x, &y, &z, &theta, &vy) + id;
+    }
+    auto t2 = microsec_clock::universal_time();
+
+    Check(sum == count * 2 * (12 + 7) && x == -100 && z == -300 && vy == 3, "deserialize values");
+    Report("Deserialize 6 fields", t1 - t0, t2 - t1, count);
+}
+
+void BenchInitializeData()
+{
+    const size_t count = 2000;
+    const std::string data = InitializeData(200);
+    size_t before_sum = 0, after_sum = 0;
+
+    // 以前の Account::LoadInitializeData と同じく、先頭から erase しながら読む
+    auto t0 = microsec_clock::universal_time();
+    for (size_t i = 0; i < count; i++) {
+        std::string buffer(data);
+        while (buffer.size()) {
+            uint16_t property;
+            buffer.erase(0, legacy::Deserialize(buffer, &property));
+            std::string value;
+            buffer.erase(0, legacy::Deserialize(buffer, &value));
+            before_sum += value.size();
+        }
+    }
+    auto t1 = microsec_clock::universal_time();
+    for (size_t i = 0; i < count; i++) {
+        BinaryReader reader(data);
+        while (reader.remaining() > 0) {
+            uint16_t property;
+            std::string value;
+            if (!reader.Read(&property, &value)) {
+                break;
+            }
+            after_sum += value.size();
+        }
+    }
+    auto t2 = microsec_clock::universal_time();
+
+    Check(before_sum == after_sum, "initialize data values");
+    Report("200 initialize properties", t1 - t0, t2 - t1, count);
+}
+
+}
+
+int main()
+{
+    BenchSerialize();
+    BenchDeserialize();
+    BenchInitializeData();
+
+    if (failures > 0) {
+        return 1;
+    }
+    std::printf("OK\n");
+    return 0;
+}
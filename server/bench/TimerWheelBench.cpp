@@ -0,0 +1,123 @@
+//
+// TimerWheelBench.cpp
+//
+// 10万個のタイマーの予約、取り消し、期限切れの処理にかかる時間を、
+// タイマーごとに deadline_timer を使う以前の方法と TimerWheel で比べる
+// make bench_timer_wheel で実行する
+//
+
+#include "../TimerWheel.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+using namespace network;
+using namespace boost::posix_time;
+
+namespace {
+
+const size_t TIMERS = 100000;
+
+int failures = 0;
+size_t fired = 0;
+
+void Check(bool condition, const char* name)
+{
+    if (!condition) {
+        std::printf("FAILED: %s\n", name);
+        failures++;
+    }
+}
+
+void Fire()
+{
+    fired++;
+}
+
+void FireAsio(const boost::system::error_code& error)
+{
+    if (!error) {
+        fired++;
+    }
+}
+
+// 1秒から1時間まで ログアウト後の削除やキープアライブの間隔に近い
+int Delay(size_t i)
+{
+    return 1000 + static_cast<int>((i * 7919) % 3600000);
+}
+
+void Report(const char* name, const time_duration& asio, const time_duration& wheel)
+{
+    const double a = asio.total_microseconds() * 1000.0 / TIMERS;
+    const double w = wheel.total_microseconds() * 1000.0 / TIMERS;
+    std::printf("%-10s deadline_timer %8.1f ns  TimerWheel %8.1f ns  x%.1f\n", name, a, w, a / w);
+}
+
+}
+
+int main()
+{
+    boost::asio::io_service io_service;
+
+    // 以前の方法 タイマーごとに deadline_timer を作って待つ
+    std::vector<std::unique_ptr<boost::asio::deadline_timer>> timers;
+    timers.reserve(TIMERS);
+    auto t0 = microsec_clock::universal_time();
+    for (size_t i = 0; i < TIMERS; i++) {
+        timers.push_back(std::unique_ptr<boost::asio::deadline_timer>(
+                    new boost::asio::deadline_timer(io_service)));
+        timers.back()->expires_from_now(milliseconds(Delay(i)));
+        timers.back()->async_wait(&FireAsio);
+    }
+    auto t1 = microsec_clock::universal_time();
+    for (size_t i = 0; i < TIMERS; i++) {
+        timers[i]->cancel();
+    }
+    auto t2 = microsec_clock::universal_time();
+    timers.clear();
+    io_service.poll();
+    io_service.reset();
+    Check(fired == 0, "deadline_timer cancelled");
+
+    // TimerWheel は Start せずに Advance でティックを進める
+    TimerWheel wheel(io_service, 100);
+    std::vector<TimerWheel::TimerID> ids(TIMERS);
+    auto t3 = microsec_clock::universal_time();
+    for (size_t i = 0; i < TIMERS; i++) {
+        ids[i] = wheel.Schedule(Delay(i), &Fire);
+    }
+    auto t4 = microsec_clock::universal_time();
+    size_t cancelled = 0;
+    for (size_t i = 0; i < TIMERS; i++) {
+        cancelled += wheel.Cancel(ids[i]);
+    }
+    auto t5 = microsec_clock::universal_time();
+    Check(cancelled == TIMERS && wheel.size() == 0, "wheel cancelled");
+
+    Report("schedule", t1 - t0, t4 - t3);
+    Report("cancel", t2 - t1, t5 - t4);
+
+    // 半分を取り消して、残りを期限切れまで進める
+    for (size_t i = 0; i < TIMERS; i++) {
+        ids[i] = wheel.Schedule(Delay(i), &Fire);
+    }
+    for (size_t i = 0; i < TIMERS; i += 2) {
+        wheel.Cancel(ids[i]);
+    }
+    const uint64_t ticks = 3601000 / wheel.tick_msec() + 1;
+    auto t6 = microsec_clock::universal_time();
+    wheel.Advance(ticks);
+    auto t7 = microsec_clock::universal_time();
+    Check(fired == TIMERS / 2 && wheel.size() == 0, "wheel fired");
+
+    std::printf("advance %u ticks, %u fired: %.1f ms\n",
+            static_cast<unsigned int>(ticks), static_cast<unsigned int>(fired),
+            (t7 - t6).total_microseconds() / 1000.0);
+
+    if (failures > 0) {
+        return 1;
+    }
+    std::printf("OK\n");
+    return 0;
+}
@@ -32,6 +32,11 @@ using namespace boost::posix_time;
 
 void client_sync(network::Server& server);
 void public_ping(network::Server& server);
+void log_in(network::Server& server, const network::SessionPtr& session, uint32_t user_id);
+void begin_key_exchange(network::Server& server, const network::SessionPtr& session, uint32_t user_id);
+void send_common_key(network::Server& server, network::Signature& sign,
+        const network::SessionPtr& session, uint32_t user_id, bool start_session = false);
+void start_encrypted_session(network::Server& server, const network::SessionPtr& session);
 void server();
 
 int main(int argc, char* argv[])
@@ -113,7 +118,11 @@ void server()
 					break;
 				}
 				
-				std::stringstream message_json(network::Utils::Deserialize<std::string>(c.body()));
+				network::ServerReceiveJSONView view(c);
+				if (!view.valid()) {
+					break;
+				}
+				std::stringstream message_json(view.get<0>().str());
 
 				using namespace boost::property_tree;
 				ptree message_tree;
@@ -159,11 +168,40 @@ void server()
         case network::header::ServerUpdatePlayerPosition:
         {
             if (auto session = c.session().lock()) {
-                PlayerPosition pos;
-                network::Utils::Deserialize(c.body(), &pos.x, &pos.y, &pos.z, &pos.theta, &pos.vy);
-                server.account().SetUserPosition(session->id(), pos);
-                server.SendOthers(network::ClientUpdatePlayerPosition(session->id(),
-					pos.x,pos.y,pos.z,pos.theta, pos.vy), session->id(), session->channel(), true);
+                network::ServerUpdatePlayerPositionView view(c);
+                if (view.valid()) {
+                    server.UpdatePlayerPosition(session, view.get<0>());
+                }
+            }
+        }
+            break;
+
+        // 位置情報受信 (UDP)
+        case network::header::ServerUpdatePlayerPositionSequenced:
+        {
+            if (auto session = c.session().lock()) {
+                network::ServerUpdatePlayerPositionSequencedView view(c);
+                if (!view.valid()) {
+                    break;
+                }
+                uint32_t token = view.get<0>();
+                uint16_t sequence = view.get<1>();
+
+                // 古いパケットは捨てる
+                if (token != 0 && token == session->udp_token() && session->AcceptUDPSequence(sequence)) {
+                    server.UpdatePlayerPosition(session, view.get<2>());
+                }
+            }
+        }
+            break;
+
+        // UDPのテストパケットがクライアントに届いた
+        case network::header::ServerReceiveUDPTestPacketAck:
+        {
+            if (auto session = c.session().lock()) {
+                if (server.config()->udp_position() && session->id() > 0 && session->udp_token() == 0) {
+                    server.EnableUDPPosition(session);
+                }
             }
         }
             break;
@@ -174,7 +212,7 @@ void server()
             if (auto session = c.session().lock()) {
 
 				// 最大接続数を超えていないか判定
-				if (server.GetUserCount() >= server.config().capacity()) {
+				if (server.GetUserCount() >= server.config()->capacity()) {
 					Logger::Info("Refused Session");
 					session->SyncSend(network::ClientReceiveServerCrowdedError());
 					session->Close();
@@ -183,11 +221,13 @@ void server()
 
 				session->ResetReadByteAverage();
 
-                std::string finger_print;
-                uint16_t version;
-                uint16_t udp_port;
-
-                network::Utils::Deserialize(c.body(), &finger_print, &version, &udp_port);
+                network::ServerReceiveClientInfoView view(c);
+                if (!view.valid()) {
+                    break;
+                }
+                const auto& finger_print = view.get<0>();
+                uint16_t version = view.get<1>();
+                uint16_t udp_port = view.get<2>();
 
                 // クライアントのプロトコルバージョンをチェック
                 if (version != MMO_PROTOCOL_VERSION) {
@@ -198,29 +238,23 @@ void server()
 
                 // UDPパケットの宛先を設定
                 session->set_udp_port(udp_port);
+                server.RegisterSession(session);
 
                 Logger::Info("UDP destination is %s:%d", session->global_ip(), session->udp_port());
 
                 // テスト送信
                 server.SendUDPTestPacket(session->global_ip(), session->udp_port());
 
-                uint32_t id = server.account().GetUserIdFromFingerPrint(finger_print);
+                uint32_t id = server.account().GetUserIdFromFingerPrint(finger_print.str());
                 if (id == 0) {
                     // 未登録の場合、公開鍵を要求
                     session->Send(network::ClientRequestedPublicKey());
                 } else {
                     uint32_t user_id = static_cast<uint32_t>(id);
-                    // ログイン
-                    session->set_id(user_id);
-                    server.account().LogIn(user_id);
-                    session->encrypter().SetPublicKey(server.account().GetPublicKey(user_id));
-
-                    server.account().SetUserIPAddress(session->id(), session->global_ip());
-                    server.account().SetUserUDPPort(session->id(), session->udp_port());
+                    begin_key_exchange(server, session, user_id);
 
                     // 共通鍵を送り返す
-                    auto key = session->encrypter().GetCryptedCommonKey();
-                    session->Send(network::ClientReceiveCommonKey(key, sign.Sign(key), user_id));
+                    send_common_key(server, sign, session, user_id);
 
                 }
                 Logger::Info(msg);
@@ -228,43 +262,172 @@ void server()
         }
             break;
 
+        // 接続時の情報をまとめて受信
+        // 有効なチケットがあれば公開鍵暗号を省いて再開し、無ければ公開鍵で鍵交換をしてそのまま暗号化通信を始める
+        case network::header::ServerReceiveClientHello:
+        {
+            if (auto session = c.session().lock()) {
+
+				if (server.GetUserCount() >= server.config()->capacity()) {
+					Logger::Info("Refused Session");
+					session->SyncSend(network::ClientReceiveServerCrowdedError());
+					session->Close();
+					return;
+				}
+
+				session->ResetReadByteAverage();
+
+                network::ServerReceiveClientHelloView view(c);
+                if (!view.valid()) {
+                    break;
+                }
+                const auto& finger_print = view.get<0>();
+                uint16_t version = view.get<1>();
+                uint16_t udp_port = view.get<2>();
+                const auto& public_key = view.get<3>();
+                const auto& ticket = view.get<4>();
+                const auto& client_random = view.get<5>();
+
+                if (version != MMO_PROTOCOL_VERSION) {
+                    Logger::Info("Unsupported Client Version : v%d", version);
+                    session->Send(network::ClientReceiveUnsupportVersionError(1));
+                    return;
+                }
+
+                session->set_udp_port(udp_port);
+                server.RegisterSession(session);
+                server.SendUDPTestPacket(session->global_ip(), session->udp_port());
+
+                // チケットの持ち主と、今回の公開鍵が一致する場合だけ再開する
+                uint32_t user_id = 0;
+                std::string secret;
+                bool resumed = false;
+                if (!ticket.empty() && server.session_ticket().Open(ticket.str(), &user_id, &secret)) {
+                    const auto& registered_key = server.account().GetPublicKey(user_id);
+                    resumed = !registered_key.empty() &&
+                        network::Encrypter::GetHash(registered_key) == finger_print.str();
+                }
+
+                if (resumed) {
+                    begin_key_exchange(server, session, user_id);
+                    auto server_random = session->encrypter().AcceptResumption(secret, client_random.str());
+                    session->Send(network::ClientReceiveSessionResumed(user_id, server_random));
+                    start_encrypted_session(server, session);
+                    Logger::Info("Resume session %d", user_id);
+                } else {
+                    // フィンガープリントは同じメッセージの公開鍵から作ったものでなければならない
+                    if (public_key.empty() ||
+                            network::Encrypter::GetHash(public_key.str()) != finger_print.str()) {
+                        Logger::Info("Fingerprint does not match the public key");
+                        session->Close();
+                        return;
+                    }
+
+                    // 登録済みの公開鍵なら既存のユーザーIDが返る
+                    user_id = server.account().RegisterPublicKey(public_key.str());
+                    begin_key_exchange(server, session, user_id);
+                    send_common_key(server, sign, session, user_id, true);
+                }
+                Logger::Info(msg);
+            }
+        }
+            break;
+
         // 公開鍵受信
         case network::header::ServerReceivePublicKey:
         {
             if (auto session = c.session().lock()) {
-				auto public_key = network::Utils::Deserialize<std::string>(c.body());
-                uint32_t user_id = server.account().RegisterPublicKey(public_key);
+				network::ServerReceivePublicKeyView view(c);
+				if (!view.valid()) {
+					break;
+				}
+                uint32_t user_id = server.account().RegisterPublicKey(view.get<0>().str());
 
 				assert(user_id > 0);
 
 				session->ResetReadByteAverage();
 
-                // ログイン
-                session->set_id(user_id);
-                server.account().LogIn(user_id);
-                session->encrypter().SetPublicKey(server.account().GetPublicKey(user_id));
-
-                server.account().SetUserIPAddress(session->id(), session->global_ip());
-                server.account().SetUserUDPPort(session->id(), session->udp_port());
+                begin_key_exchange(server, session, user_id);
 
                 // 共通鍵を送り返す
-                auto key = session->encrypter().GetCryptedCommonKey();
-                session->Send(network::ClientReceiveCommonKey(key, sign.Sign(key), user_id));
+                send_common_key(server, sign, session, user_id);
 
             }
             Logger::Info(msg);
         }
             break;
 
+        // クライアントが対応している機能
+        case network::header::ServerReceiveCapabilities:
+        {
+            if (auto session = c.session().lock()) {
+                network::ServerReceiveCapabilitiesView view(c);
+                if (!view.valid()) {
+                    break;
+                }
+                uint32_t capabilities = view.get<0>();
+
+                // サーバーで有効にしている機能だけを返す
+                uint32_t accepted = network::capability::LENGTH_PREFIXED_FRAMING |
+                    network::capability::ACCOUNT_SNAPSHOT |
+                    network::capability::ACCOUNT_PUSH |
+                    network::capability::AUTHENTICATED_ENCRYPTION;
+                if (server.config()->stream_compression()) {
+                    accepted |= network::capability::STREAM_COMPRESSION;
+                }
+                accepted &= capabilities;
+                session->set_capabilities(accepted);
+
+                session->Send(network::ClientReceiveCapabilities(accepted));
+                if (accepted & network::capability::STREAM_COMPRESSION) {
+                    session->EnableStreamCompression();
+                }
+                if (accepted & network::capability::LENGTH_PREFIXED_FRAMING) {
+                    session->EnableLengthPrefixedFraming();
+                }
+                if (accepted & network::capability::AUTHENTICATED_ENCRYPTION) {
+                    session->EnableAuthenticatedEncryption();
+                }
+
+                Logger::Info(msg);
+            }
+        }
+            break;
+
+        // 共通鍵を受け取れたことの確認
+        case network::header::ServerReceiveKeyConfirmation:
+        {
+            if (auto session = c.session().lock()) {
+                network::ServerReceiveKeyConfirmationView view(c);
+
+                // 公開鍵に対応する秘密鍵を持つ相手だけが正しい値を作れる
+                const uint32_t user_id = session->pending_id();
+                if (!view.valid() || session->id() > 0 || user_id == 0 ||
+                        view.get<0>().str() != session->encrypter().GetKeyConfirmation()) {
+                    Logger::Info("Key confirmation failed");
+                    session->Close();
+                    break;
+                }
+                session->set_pending_id(0);
+                log_in(server, session, user_id);
+
+                // 次回の接続用のチケットは本人と確かめてから送る
+                if (server.session_ticket().enabled()) {
+                    session->Send(network::ClientReceiveSessionTicket(server.session_ticket().Issue(
+                            user_id, session->encrypter().GetResumptionSecret())));
+                }
+
+                Logger::Info(msg);
+            }
+        }
+            break;
+
         // 暗号化通信開始
         case network::header::ServerStartEncryptedSession:
         {
             if (auto session = c.session().lock()) {
 				
-				session->Send(network::ClientReceiveServerInfo(server.config().stage()));
-
-                session->Send(network::ClientStartEncryptedSession());
-                session->EnableEncryption();
+                start_encrypted_session(server, session);
 
                 Logger::Info(msg);
             }
@@ -275,18 +438,34 @@ void server()
         case network::header::ServerReceiveAccountInitializeData:
         {
             if (auto session = c.session().lock()) {
-				auto data = network::Utils::Deserialize<std::string>(c.body());
-                server.account().LoadInitializeData(session->id(), data);
-
-                const auto& list = server.account().GetIDList();
-                BOOST_FOREACH(UserID user_id, list) {
-                    session->Send(network::ClientReceiveAccountRevisionUpdateNotify(user_id,
-                            server.account().GetUserRevision(user_id)));
+				network::ServerReceiveAccountInitializeDataView view(c);
+				if (!view.valid()) {
+					break;
+				}
+                server.account().LoadInitializeData(session->id(), view.get<0>());
+
+                // 再接続で直前に ServerRequestedAccountChanges に返信していれば、それで足りている
+                if (!session->account_synced()) {
+                    // 再接続の時に使う通し番号を先に知らせる
+                    // これより後の変更は以下の情報と重複しても構わない
+                    session->Send(network::Command(network::header::ClientReceiveAccountChanges,
+                            server.account().GetChangesSince(server.account().instance_id(),
+                                server.account().GetCurrentRevision())));
+
+                    if (session->capabilities() & network::capability::ACCOUNT_SNAPSHOT) {
+                        // チャンネル内の全員の情報をまとめて送る
+                        session->Send(network::Command(network::header::ClientReceiveAccountSnapshot,
+                                server.account().GetChannelSnapshot(session->channel())));
+                    } else {
+                        const auto& list = server.account().GetIDList();
+                        BOOST_FOREACH(UserID user_id, list) {
+                            session->Send(network::ClientReceiveAccountRevisionUpdateNotify(user_id,
+                                    server.account().GetUserRevision(user_id)));
+                        }
+                    }
                 }
 
-                server.SendOthers(
-                        network::ClientReceiveAccountRevisionUpdateNotify(session->id(),
-                                server.account().GetUserRevision(session->id())), session->id());
+                server.SendAccountRevisionUpdate(session->id(), 0, session->id());
 
                 Logger::Info(msg);
             }
@@ -297,9 +476,12 @@ void server()
         case network::header::ServerRequestedAccountRevisionPatch:
         {
             if (auto session = c.session().lock()) {
-                uint32_t user_id;
-                uint32_t client_revision;
-                network::Utils::Deserialize(c.body(), &user_id, &client_revision);
+                network::ServerRequestedAccountRevisionPatchView view(c);
+                if (!view.valid()) {
+                    break;
+                }
+                uint32_t user_id = view.get<0>();
+                uint32_t client_revision = view.get<1>();
 
                 if (client_revision < server.account().GetUserRevision(user_id)) {
                     session->Send(network::ClientReceiveAccountRevisionPatch(
@@ -310,12 +492,32 @@ void server()
         }
         break;
 
+        // 通し番号より後のアカウントの変更の要求
+        case network::header::ServerRequestedAccountChanges:
+        {
+            if (auto session = c.session().lock()) {
+                network::ServerRequestedAccountChangesView view(c);
+                if (!view.valid()) {
+                    break;
+                }
+                // 番号が古い場合や別のサーバーの場合は全員分が返るので、どちらでも最新になる
+                session->Send(network::Command(network::header::ClientReceiveAccountChanges,
+                        server.account().GetChangesSince(view.get<0>(), view.get<1>())));
+                session->set_account_synced(true);
+                Logger::Info(msg);
+            }
+        }
+        break;
+
         case network::header::ServerUpdateAccountProperty:
         {
             if (auto session = c.session().lock()) {
-                AccountProperty property;
-				std::string buffer = c.body().substr(sizeof(AccountProperty));
-                network::Utils::Deserialize(c.body(), &property);
+                network::ServerUpdateAccountPropertyView view(c);
+                if (!view.valid()) {
+                    break;
+                }
+                AccountProperty property = view.get<0>();
+                const auto& value = view.get<1>();
 
                 auto old_revision = server.account().GetUserRevision(session->id());
 
@@ -323,44 +525,45 @@ void server()
 
                 case NAME:
                     {
-						std::string value;
-						network::Utils::Deserialize(buffer, &value);
-                        server.account().SetUserName(session->id(), value);
+                        server.account().SetUserName(session->id(), value.str());
                     }
                     break;
                 case TRIP:
                     {
-						std::string value;
-						network::Utils::Deserialize(buffer, &value);
-                        server.account().SetUserTrip(session->id(), value);
+                        server.account().SetUserTrip(session->id(), value.str());
                     }
                     break;
                 case MODEL_NAME:
                     {
-						std::string value;
-						network::Utils::Deserialize(buffer, &value);
-                        server.account().SetUserModelName(session->id(), value);
+                        server.account().SetUserModelName(session->id(), value.str());
                     }
                     break;
                 case CHANNEL:
                     {
-						std::string value;
-						network::Utils::Deserialize(buffer, &value);
-						auto channel = *reinterpret_cast<const unsigned int*>(value.data());
+						// クライアントは Utils::Serialize したチャンネル番号を送ってくる
+						uint32_t channel;
+						network::BinaryReader reader(value);
+						if (value.size == sizeof(uint8_t)) {
+							channel = static_cast<uint8_t>(value.data[0]);
+						} else if (value.size != sizeof(uint32_t) || !reader.Read(&channel)) {
+							break;
+						}
                         server.account().SetUserChannel(session->id(), channel);
 						session->set_channel(channel);
+						server.RegisterSession(session);
+
+						// 移動先のチャンネルにいる全員の情報
+						if (session->capabilities() & network::capability::ACCOUNT_SNAPSHOT) {
+							session->Send(network::Command(network::header::ClientReceiveAccountSnapshot,
+									server.account().GetChannelSnapshot(channel)));
+						}
                     }
                     break;
                 default:
                     ;
                 }
 
-                auto new_revison = server.account().GetUserRevision(session->id());
-                if (new_revison > old_revision) {
-                    server.SendAll(
-                            network::ClientReceiveAccountRevisionUpdateNotify(
-                            session->id(),new_revison));
-                }
+                server.SendAccountRevisionUpdate(session->id(), old_revision);
 
                 Logger::Info(msg);
             }
@@ -370,16 +573,21 @@ void server()
         // エラー
         case network::header::UserFatalConnectionError:
         {
-            if (c.body().size() > 0) {
-                uint32_t user_id = network::Utils::Deserialize<uint32_t>(c.body());
-                server.account().LogOut(user_id);
-
-                server.SendAll(
-                        network::ClientReceiveAccountRevisionUpdateNotify(user_id,
-                                server.account().GetUserRevision(user_id)));
-
-                Logger::Info("Logout User: %d", user_id);
-				server.account().Remove(user_id);
+            network::UserFatalConnectionErrorView view(c);
+            if (view.valid()) {
+                uint32_t user_id = view.get<0>();
+
+                // 古い接続の切断が再接続より後に届いた場合は、新しいセッションのログインを残す
+                if (server.UnregisterSession(user_id, c.session().lock())) {
+                    auto old_revision = server.account().GetUserRevision(user_id);
+                    server.account().LogOut(user_id);
+                    server.SendAccountRevisionUpdate(user_id, old_revision);
+
+                    Logger::Info("Logout User: %d", user_id);
+                    server.ScheduleAccountRemoval(user_id);
+                } else {
+                    Logger::Info("Stale connection closed: %d", user_id);
+                }
             }
         }
         Logger::Info(msg);
@@ -393,21 +601,69 @@ void server()
 
 	client_sync(server);
 
-	if (server.config().is_public()) {
+	if (server.config()->is_public()) {
 		public_ping(server);
 	}
 
     server.Start(callback);
 }
 
-void public_ping(network::Server& server)
+void log_in(network::Server& server, const network::SessionPtr& session, uint32_t user_id)
+{
+    session->set_id(user_id);
+    server.RegisterSession(session);
+    server.CancelAccountRemoval(user_id);
+    server.account().LogIn(user_id);
+    session->encrypter().SetPublicKey(server.account().GetPublicKey(user_id));
+
+    server.account().SetUserIPAddress(session->id(), session->global_ip());
+    server.account().SetUserUDPPort(session->id(), session->udp_port());
+}
+
+void begin_key_exchange(network::Server& server, const network::SessionPtr& session, uint32_t user_id)
+{
+    // 共通鍵は登録済みの公開鍵で暗号化する ServerReceiveKeyConfirmation が届くまではログインさせない
+    session->set_pending_id(user_id);
+    session->encrypter().SetPublicKey(server.account().GetPublicKey(user_id));
+}
+
+void send_common_key(network::Server& server, network::Signature& sign,
+        const network::SessionPtr& session, uint32_t user_id, bool start_session)
 {
-    boost::thread([&server](){
-        while (1) {
-            boost::this_thread::sleep(boost::posix_time::seconds(10));
-			server.SendPublicPing();
+    // 公開鍵は設定済みなので、暗号化と署名は他のスレッドから行ってよい
+    // start_session の場合はクライアントの ServerStartEncryptedSession を待たずに暗号化通信を始める
+    auto job = [&server, &sign, session, user_id, start_session](){
+        auto key = session->encrypter().GetCryptedCommonKey();
+        session->Send(network::ClientReceiveCommonKey(key, sign.Sign(key), user_id));
+        if (start_session) {
+            start_encrypted_session(server, session);
         }
-    });
+    };
+
+    // 接続が集中しても他の通信を止めないよう、専用のスレッドで行う
+    const auto& pool = server.crypto_pool();
+    if (!pool) {
+        job();
+    } else if (!pool->Post(job)) {
+        Logger::Info("Crypto queue is full");
+        session->SyncSend(network::ClientReceiveServerCrowdedError());
+        session->Close();
+    }
+}
+
+void start_encrypted_session(network::Server& server, const network::SessionPtr& session)
+{
+    session->Send(network::ClientReceiveServerInfo(server.config()->stage()));
+
+    session->Send(network::ClientStartEncryptedSession());
+    session->EnableEncryption();
+}
+
+void public_ping(network::Server& server)
+{
+    server.timers().Schedule(10000, [&server](){
+		server.SendPublicPing();
+    }, 10000);
 }
 
 void client_sync(network::Server& server)
@@ -427,18 +683,14 @@ void client_sync(network::Server& server)
     // クライアントから起動している場合、クライアントの状態を監視
 	#ifdef _WIN32
     if (execute_with_client) {
-        boost::thread([&server](){
-            while (1) {
-                boost::this_thread::sleep(boost::posix_time::seconds(4));
-                try {
-					using namespace boost::interprocess;
-					windows_shared_memory shm(open_only, "MMO_SERVER_WITH_CLIENT", read_only);
-                } catch(std::exception& e) {
-                    server.Stop();
-                    break;
-                }
+        server.timers().Schedule(4000, [&server](){
+            try {
+				using namespace boost::interprocess;
+				windows_shared_memory shm(open_only, "MMO_SERVER_WITH_CLIENT", read_only);
+            } catch(std::exception& e) {
+                server.Stop();
             }
-        });
+        }, 4000);
     }
 	#endif
     #ifdef __linux__